@@ -101,7 +101,6 @@ BVRef		bvr;
 BVRef		menuBVR;
 BVRef		bvChain;
 
-static unsigned long	Adler32(unsigned char *buffer, long length);
 //static void			selectBiosDevice(void);
 
 /** options.c **/
@@ -223,8 +222,28 @@ static int ExecKernel(void *binary)
 
 	usb_loop();
 
+	CachePrintStats();
+	NameCachePrintStats();
+
 #if DEBUG
 	if (interruptsAvailable) ShowInterruptCounters();
+
+	{
+		struct malloc_stats mstats;
+
+		malloc_get_stats(&mstats);
+		verbose("malloc: %lu allocs (%lu from slabs, %lu pages), %lu frees, %lu bytes in use, peak %lu\n",
+			mstats.mallocs, mstats.slabMallocs, mstats.slabPages, mstats.frees, mstats.bytesInUse, mstats.peakBytesInUse);
+	}
+
+	{
+		struct arena *a;
+
+		for (a = arena_list; a; a = a->next)
+		{
+			verbose("arena %s: %lu bytes in use, peak %lu\n", a->name, a->bytesInUse, a->peakBytes);
+		}
+	}
 #endif
 
 	// If we were in text mode, switch to graphics mode.
@@ -278,7 +297,7 @@ long LoadKernelCache(const char *cacheFile, void **binary)
 	char		kernelCacheFile[512];
 	char		kernelCachePath[512];
 	long		flags, ret=-1;
-	unsigned long	adler32 = 0;
+	unsigned long	adler = 0;
 	u_int32_t time, cachetime, kerneltime, exttime;
 
 	if((gBootMode & kBootModeSafe) != 0)
@@ -301,8 +320,8 @@ long LoadKernelCache(const char *cacheFile, void **binary)
 			// Reset cache name.
 			bzero(gCacheNameAdler + 64, sizeof(gCacheNameAdler) - 64);
 			snprintf(gCacheNameAdler + 64, sizeof(gCacheNameAdler) - 64, "%s,%s", gRootDevice, bootInfo->bootFile);
-			adler32 = Adler32((unsigned char *)gCacheNameAdler, sizeof(gCacheNameAdler));
-			snprintf(kernelCacheFile, sizeof(kernelCacheFile), "%s.%08lX", kDefaultCachePathLeo, adler32);
+			adler = OSSwapHostToBigInt32(adler32((unsigned char *)gCacheNameAdler, sizeof(gCacheNameAdler)));
+			snprintf(kernelCacheFile, sizeof(kernelCacheFile), "%s.%08lX", kDefaultCachePathLeo, adler);
 			verbose("Reseted kernel cache file path: %s\n", kernelCacheFile);
 
 		}
@@ -593,7 +612,12 @@ long LoadKernelCache(const char *cacheFile, void **binary)
 	// Since the kernel cache file exists and is the most recent try to load it
 	DBG("Loading Kernel Cache from: '%s%s' (%s)\n", gBootVolume->label, gBootVolume->altlabel, gBootVolume->type_name);
 
-	ret = LoadThinFatFile(kernelCachePath, binary);
+	// Compressed caches are decompressed while they are read.
+	ret = LoadCompressedKernel(kernelCachePath, binary);
+	if (ret == -2)
+	{
+		ret = LoadThinFatFile(kernelCachePath, binary);
+	}
 	return ret; // ret contain the length of the binary
 }
 
@@ -1276,50 +1300,3 @@ uint32_t getMacOSVerCurrent()
 	return MacOSVerCurrent;
 }
 
-// =========================================================================
-unsigned long Adler32(unsigned char *buf, long len)
-{
-#define BASE 65521L /* largest prime smaller than 65536 */
-#define NMAX 5000
-// NMAX (was 5521) the largest n such that 255n(n+1)/2 + (n+1)(BASE-1) <= 2^32-1
-
-#define DO1(buf, i)	{s1 += buf[i]; s2 += s1;}
-#define DO2(buf, i)	DO1(buf, i); DO1(buf, i + 1);
-#define DO4(buf, i)	DO2(buf, i); DO2(buf, i + 2);
-#define DO8(buf, i)	DO4(buf, i); DO4(buf, i + 4);
-#define DO16(buf)	DO8(buf, 0); DO8(buf, 8);
-
-	int k;
-
-	unsigned long s1 = 1; // adler & 0xffff;
-	unsigned long s2 = 0; // (adler >> 16) & 0xffff;
-	unsigned long result;
-
-	while (len > 0)
-	{
-		k = len < NMAX ? len : NMAX;
-		len -= k;
-		while (k >= 16)
-		{
-			DO16(buf);
-			buf += 16;
-			k -= 16;
-		}
-
-		if (k != 0)
-		{
-			do
-			{
-				s1 += *buf++;
-				s2 += s1;
-			} while (--k);
-		}
-
-		s1 %= BASE;
-		s2 %= BASE;
-	}
-
-	result = (s2 << 16) | s1;
-
-	return OSSwapHostToBigInt32(result);
-}
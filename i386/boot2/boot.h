@@ -299,6 +299,7 @@ extern void loadImageScale (void *input, int iw, int ih, int ip, void *output, i
 extern long LoadExtraDrivers(char * dirSpec);
 extern long LoadDrivers(char * dirSpec);
 extern long DecodeKernel(void *binary, entry_t *rentry, char **raddr, int *rsize);
+extern long LoadCompressedKernel(const char *fileSpec, void **binary);
 typedef long (*FileLoadDrivers_t)(char *dirSpec, long plugin);
 // Bungo:
 extern char gDarwinBuildVerStr[256];
@@ -339,6 +340,23 @@ typedef struct {
 extern int decompress_lzss(u_int8_t *dst, u_int32_t dstlen, u_int8_t *src, u_int32_t srclen);
 extern u_int8_t *compress_lzss(u_int8_t *dst, u_int32_t dstlen, u_int8_t *src, u_int32_t srcLen);
 
+/*
+ * Streaming decoders: each call decodes what it can of the src bytes it is
+ * given and returns how many it consumed (-1 on a bad stream). Unless last
+ * is set, an opcode cut off at the end of src is left for the next call,
+ * together with the bytes after it. done is set once the end of the stream
+ * is reached or dst is full.
+ */
+typedef struct lzss_stream {
+	u_int8_t	*dst;		/* next output byte */
+	u_int8_t	*dstBegin;
+	u_int8_t	*dstEnd;
+	int		done;
+} lzss_stream;
+
+extern void lzss_stream_init(lzss_stream *stream, u_int8_t *dst, u_int32_t dstlen);
+extern long decompress_lzss_stream(lzss_stream *stream, u_int8_t *src, u_int32_t srclen, int last);
+
 /*
  * lzvn.c
  */
@@ -346,6 +364,17 @@ extern size_t lzvn_decode(void		*dst,
                           size_t	dst_size,
                           const void	*src,
                           size_t	src_size);
+
+typedef struct lzvn_stream {
+	u_int8_t	*dst;		/* next output byte */
+	u_int8_t	*dstBegin;
+	u_int8_t	*dstEnd;
+	int		done;
+	size_t		distance;	/* match distance, reused by some opcodes */
+} lzvn_stream;
+
+extern void lzvn_stream_init(lzvn_stream *stream, void *dst, size_t dst_size);
+extern long lzvn_decode_stream(lzvn_stream *stream, const void *src, size_t src_size, int last);
 /*
 extern size_t lzvn_encode(void		*dst,
                           size_t	dst_size,
@@ -39,6 +39,7 @@
 #include "xml.h"
 #include "ramdisk.h"
 #include "modules.h"
+#include "kextindex.h"
 
 #if DEBUG
 	#define DBG(x...)	printf(x)
@@ -48,8 +49,10 @@
 
 struct Module {  
 	struct Module *nextModule;
+	struct Module *nextHash;		// same bucket of gModuleHash
 	long          willLoad;
 	TagPtr        dict;
+	char          *identifier;		// CFBundleIdentifier
 	char          *plistAddr;
 	long          plistLength;
 	char          *executablePath;
@@ -88,9 +91,21 @@ enum {
 	kCFBundleType3
 };
 
-long (*LoadExtraDrivers_p)(FileLoadDrivers_t FileLoadDrivers_p);
+// Directory entries fetched per GetDirEntries() call while scanning for kexts.
+#define kDriverDirBatch 32
+
+// Compressed kernel cache bytes read per call, plus room for an opcode the
+// decoder had to leave for the next chunk.
+#define kKernelReadChunk	(512 * 1024)
+#define kKernelReadSlack	512
+
+// Buckets of the CFBundleIdentifier hash used to resolve OSBundleLibraries.
+#define kModuleHashSize 256
+
+// Start of the kernel's version[] string, e.g. "Darwin Kernel Version 17.0.0: ..."
+#define kDarwinVersionPrefix	"Darwin Kernel Version"
 
-static inline unsigned long Adler32( unsigned char * buffer, long length );
+long (*LoadExtraDrivers_p)(FileLoadDrivers_t FileLoadDrivers_p);
 
 long FileLoadDrivers(char *dirSpec, long plugin);
 long NetLoadDrivers(char *dirSpec);
@@ -106,45 +121,26 @@ static long MatchLibraries(void);
 	static void ThinFatFile(void **loadAddrP, unsigned long *lengthP);
 #endif
 static long ParseXML(char *buffer, ModulePtr *module, TagPtr *personalities);
+static unsigned long HashIdentifier(const char *identifier);
+static void AddModule(ModulePtr module);
+static ModulePtr FindLibrary(ModulePtr module, const char *identifier, const char *version);
+static unsigned long long ParseKextVersion(const char *string);
+static long AddDriverPList(char *dirSpec, char *name, long bundleType, long length);
+static long FileLoadKextIndex(const char *dirSpec);
 static long InitDriverSupport(void);
 
 ModulePtr gModuleHead, gModuleTail;
+static ModulePtr gModuleHash[kModuleHashSize];
 static TagPtr	gPersonalityHead, gPersonalityTail;
 static char	*gExtensionsSpec;
 static char	*gDriverSpec;
 static char	*gFileSpec;
 static char	*gTempSpec;
 static char	*gFileName;
+// Modules, their paths and plists are kept until the kernel is started.
+static struct arena gDriverArena = ARENA_INITIALIZER("drivers", 64 * 1024);
 // Bungo:
-char gDarwinBuildVerStr[256] = "Darwin Kernel Version";
-
-static inline unsigned long Adler32( unsigned char *buffer, long length )
-{
-	long          cnt;
-	unsigned long result, lowHalf, highHalf;
-
-	lowHalf  = 1;
-	highHalf = 0;
-
-	for (cnt = 0; cnt < length; cnt++)
-	{
-		if ((cnt % 5000) == 0)
-		{
-			lowHalf  %= 65521L;
-			highHalf %= 65521L;
-		}
-
-		lowHalf  += buffer[cnt];
-		highHalf += lowHalf;
-	}
-
-	lowHalf  %= 65521L;
-	highHalf %= 65521L;
-
-	result = (highHalf << 16) | lowHalf;
-
-	return result;
-}
+char gDarwinBuildVerStr[256] = kDarwinVersionPrefix;
 
 //==========================================================================
 // InitDriverSupport
@@ -323,6 +319,305 @@ static long FileLoadMKext( const char *dirSpec, const char *extDirSpec )
 	return -1;
 }
 
+//==========================================================================
+// KextIndexCheckRecord
+// Return the strings following an index record, or 0 when the record does
+// not fit in the length bytes left in the index.
+static char *KextIndexCheckRecord( KextIndexRecord *record, unsigned long length )
+{
+	unsigned long	need;
+	char		*strings;
+
+	if (length < sizeof(KextIndexRecord) || record->recordLength < sizeof(KextIndexRecord)
+		|| record->recordLength > length || (record->recordLength & 3))
+	{
+		return 0;
+	}
+
+	need = sizeof(KextIndexRecord) + record->parentLength + record->nameLength
+		+ record->identifierLength + record->executableLength + record->requiredLength + 5
+		+ record->librariesLength + record->plistLength;
+
+	if (need > record->recordLength || record->nameLength == 0)
+	{
+		return 0;
+	}
+
+	strings = (char *)(record + 1);
+
+	if (strings[record->parentLength] != '\0'
+		|| strings[record->parentLength + record->nameLength + 1] != '\0'
+		|| strings[record->parentLength + record->nameLength + record->identifierLength + 2] != '\0')
+	{
+		return 0;
+	}
+
+	return strings;
+}
+
+//==========================================================================
+// FileLoadKextIndex
+// Load the drivers of dirSpec/Extensions from dirSpec/Extensions.kextindex.
+// The index is written by the kextindex utility; it is only trusted while
+// the folder, every top level kext in it, their PlugIns folders and every
+// indexed Info.plist still carry the recorded modification times, otherwise
+// -1 sends the caller back to the full scan.
+static long FileLoadKextIndex( const char *dirSpec )
+{
+	KextIndexHeader		header;
+	KextIndexRecord		*record, **topLevel = 0;
+	FSDirEntry		*entries = 0;
+	char			*index = 0, *cursor, *strings, *parent, *name, *identifier, *plist;
+	unsigned long		left;
+	long			ret, flags, count, i, found, low, high, mid = 0, cmp, length;
+	long long		dirIndex;
+	u_int32_t		time;
+	unsigned long		n, top;
+	long			result = -1;
+
+	// Like the mkext caches, the index is not used for a safe boot.
+	if (gBootMode & kBootModeSafe)
+	{
+		return -1;
+	}
+
+	ret = GetFileInfo(dirSpec, "Extensions", &flags, &time);
+	if (ret != 0 || (flags & kFileTypeMask) != kFileTypeDirectory)
+	{
+		return -1;
+	}
+
+	snprintf(gDriverSpec, 4096, "%s%s", dirSpec, kKextIndexFileName);
+
+	if (ReadFileAtOffset(gDriverSpec, &header, 0, sizeof(header)) != sizeof(header))
+	{
+		return -1;
+	}
+
+	if (header.magic != kKextIndexMagic || header.version != kKextIndexVersion
+		|| header.length < sizeof(header) || header.numTopLevel > header.numBundles)
+	{
+		verbose("LoadDrivers: '%s' is not a kext index\n", gDriverSpec);
+		return -1;
+	}
+
+	if (header.dirTime != time)
+	{
+		verbose("LoadDrivers: '%s' is stale\n", gDriverSpec);
+		return -1;
+	}
+
+	do {
+	// One read for the whole index, kept out of the load buffer which the
+	// plists are parsed in.
+	index = malloc(header.length);
+	topLevel = malloc((header.numTopLevel + 1) * sizeof(KextIndexRecord *));
+	entries = malloc(kDriverDirBatch * sizeof(FSDirEntry));
+	if (!index || !topLevel || !entries)
+	{
+		break;
+	}
+
+	if (ReadFileAtOffset(gDriverSpec, index, 0, header.length) != header.length)
+	{
+		break;
+	}
+
+	// Check the record bounds and collect the top level kexts.
+	cursor = index + sizeof(header);
+	left = header.length - sizeof(header);
+	top = 0;
+	for (n = 0; n < header.numBundles; n++)
+	{
+		record = (KextIndexRecord *)cursor;
+		if (KextIndexCheckRecord(record, left) == 0)
+		{
+			break;
+		}
+
+		if (!(record->flags & kKextIndexFlagPlugIn))
+		{
+			if (top == header.numTopLevel)
+			{
+				break;
+			}
+			topLevel[top++] = record;
+		}
+
+		cursor += record->recordLength;
+		left -= record->recordLength;
+	}
+
+	if (n != header.numBundles || top != header.numTopLevel)
+	{
+		verbose("LoadDrivers: '%s' is damaged\n", gDriverSpec);
+		break;
+	}
+
+	// Every kext in the folder must be indexed with its current time, and
+	// nothing else may be.
+	snprintf(gTempSpec, 4096, "%sExtensions", dirSpec);
+	found = 0;
+	dirIndex = 0;
+	while ((count = GetDirEntries(gTempSpec, &dirIndex, entries, kDriverDirBatch)) > 0)
+	{
+		for (i = 0; i < count && found >= 0; i++)
+		{
+			name = entries[i].name;
+			length = strlen(name);
+
+			if ((entries[i].flags & kFileTypeMask) != kFileTypeDirectory
+				|| length < 5 || strcmp(name + length - 5, ".kext"))
+			{
+				continue;
+			}
+
+			low = 0;
+			high = (long)top - 1;
+			cmp = 1;
+			while (low <= high)
+			{
+				mid = (low + high) / 2;
+				strings = (char *)(topLevel[mid] + 1);
+				cmp = strcmp(name, strings + topLevel[mid]->parentLength + 1);
+				if (cmp == 0)
+				{
+					break;
+				}
+				else if (cmp < 0)
+				{
+					high = mid - 1;
+				}
+				else
+				{
+					low = mid + 1;
+				}
+			}
+
+			if (cmp != 0 || topLevel[mid]->dirTime != entries[i].time)
+			{
+				found = -1;
+			}
+			else
+			{
+				found++;
+			}
+		}
+
+		if (found < 0 || count < kDriverDirBatch)
+		{
+			break;
+		}
+	}
+
+	if (found != (long)top)
+	{
+		verbose("LoadDrivers: '%s' is stale\n", gDriverSpec);
+		break;
+	}
+
+	// An Info.plist edited in place, or a plug-in added or removed, leaves
+	// the folder times above alone, so each indexed Info.plist and each
+	// PlugIns folder is checked too.
+	cursor = index + sizeof(header);
+	for (n = 0; n < header.numBundles; n++)
+	{
+		record = (KextIndexRecord *)cursor;
+		cursor += record->recordLength;
+
+		parent = (char *)(record + 1);
+		name = parent + record->parentLength + 1;
+
+		snprintf(gTempSpec, 4096, "%sExtensions/%s%s%s/%s", dirSpec, parent, record->parentLength ? "/" : "",
+			name, (record->flags & kKextIndexFlagContents) ? "Contents/" : "");
+
+		if (GetFileInfo(gTempSpec, "Info.plist", &flags, &time) != 0
+			|| (flags & kFileTypeMask) != kFileTypeFlat || time != record->plistTime)
+		{
+			break;
+		}
+
+		if (!(record->flags & kKextIndexFlagPlugIn))
+		{
+			if (GetFileInfo(gTempSpec, "PlugIns", &flags, &time) != 0
+				|| (flags & kFileTypeMask) != kFileTypeDirectory)
+			{
+				flags = 0;
+				time = 0;
+			}
+			else
+			{
+				flags = kKextIndexFlagPlugIns;
+			}
+
+			if (flags != (record->flags & kKextIndexFlagPlugIns) || time != record->plugInsTime)
+			{
+				break;
+			}
+		}
+	}
+
+	if (n != header.numBundles)
+	{
+		verbose("LoadDrivers: '%s' is stale\n", gDriverSpec);
+		break;
+	}
+
+	verbose("LoadDrivers: Loading from '%s'\n", gDriverSpec);
+
+	// The index stands in for the scan even if none of its kexts is wanted.
+	cursor = index + sizeof(header);
+	for (n = 0; n < header.numBundles; n++)
+	{
+		record = (KextIndexRecord *)cursor;
+		cursor += record->recordLength;
+
+		strings = (char *)(record + 1);
+		parent = strings;
+		name = parent + record->parentLength + 1;
+		identifier = name + record->nameLength + 1;
+
+		// Same filter as ParseXML, without touching the plist.
+		if (record->requiredLength == 0 && strcmp(identifier, "com.apple.driver.AppleSMC"))
+		{
+			continue;
+		}
+
+		if (record->parentLength)
+		{
+			snprintf(gTempSpec, 4096, "%sExtensions/%s", dirSpec, parent);
+		}
+		else
+		{
+			snprintf(gTempSpec, 4096, "%sExtensions", dirSpec);
+		}
+
+		plist = identifier + record->identifierLength + record->executableLength
+			+ record->requiredLength + 3 + record->librariesLength;
+		bcopy(plist, (void *)kLoadAddr, record->plistLength);
+
+		AddDriverPList(gTempSpec, name, (record->flags & kKextIndexFlagContents) ? kCFBundleType2 : kCFBundleType3, record->plistLength);
+	}
+
+	result = 0;
+	} while (0);
+
+	if (entries)
+	{
+		free(entries);
+	}
+	if (topLevel)
+	{
+		free(topLevel);
+	}
+	if (index)
+	{
+		free(index);
+	}
+
+	return result;
+}
+
 //==========================================================================
 // FileLoadDrivers
 long FileLoadDrivers( char *dirSpec, long plugin )
@@ -330,7 +625,9 @@ long FileLoadDrivers( char *dirSpec, long plugin )
 	long long	index;
 	long		ret, length, flags, bundleType;
 	long		result = -1;
+	long		count, i;
 	u_int32_t	time;
+	FSDirEntry	*entries;
 	const char	* name;
 
 	if ( !plugin )
@@ -346,63 +643,83 @@ long FileLoadDrivers( char *dirSpec, long plugin )
 			return 0;
 		}
 
+		// Then the kext index written by the kextindex utility.
+		else if (FileLoadKextIndex(dirSpec) == 0)
+		{
+			return 0;
+		}
+
 		strcat(dirSpec, "Extensions");
 	}
 
-	index = 0;
-	while (1)
+	// Each call (and each plugin recursion) reads the directory in batches of its own.
+	entries = malloc(kDriverDirBatch * sizeof(FSDirEntry));
+	if (!entries)
 	{
-		ret = GetDirEntry(dirSpec, &index, &name, &flags, &time);
-		if (ret == -1) {
-			break;
-		}
+		return -1;
+	}
 
-		// Make sure this is a directory.
-		if ((flags & kFileTypeMask) != kFileTypeDirectory)
+	index = 0;
+	while ((count = GetDirEntries(dirSpec, &index, entries, kDriverDirBatch)) > 0)
+	{
+		for (i = 0; i < count; i++)
 		{
-			continue;
-		}
+			name = entries[i].name;
 
-		// Make sure this is a kext.
-		length = strlen(name);
-		if (strncmp(name + length - 5, ".kext", sizeof(".kext") ))
-		{
-			continue;
-		}
+			// Make sure this is a directory.
+			if ((entries[i].flags & kFileTypeMask) != kFileTypeDirectory)
+			{
+				continue;
+			}
+
+			// Make sure this is a kext.
+			length = strlen(name);
+			if (length < 5 || strcmp(name + length - 5, ".kext"))
+			{
+				continue;
+			}
 
-		// Save the file name.
-		strlcpy(gFileName, name, 4096);
+			// Save the file name.
+			strlcpy(gFileName, name, 4096);
 
-		// Determine the bundle type.
-		snprintf(gTempSpec, 4096, "%s/%s", dirSpec, gFileName);
-		ret = GetFileInfo(gTempSpec, "Contents", &flags, &time);
-		if (ret == 0)
-		{
-			bundleType = kCFBundleType2;
-		}
-		else
-		{
-			bundleType = kCFBundleType3;
-		}
+			// Determine the bundle type.
+			snprintf(gTempSpec, 4096, "%s/%s", dirSpec, gFileName);
+			ret = GetFileInfo(gTempSpec, "Contents", &flags, &time);
+			if (ret == 0)
+			{
+				bundleType = kCFBundleType2;
+			}
+			else
+			{
+				bundleType = kCFBundleType3;
+			}
 
-		if (!plugin)
-		{
-			snprintf(gDriverSpec, 4096, "%s/%s/%sPlugIns", dirSpec, gFileName, (bundleType == kCFBundleType2) ? "Contents/" : "");
-		}
+			if (!plugin)
+			{
+				snprintf(gDriverSpec, 4096, "%s/%s/%sPlugIns", dirSpec, gFileName, (bundleType == kCFBundleType2) ? "Contents/" : "");
+			}
 
-		ret = LoadDriverPList(dirSpec, gFileName, bundleType);
+			ret = LoadDriverPList(dirSpec, gFileName, bundleType);
 
-		if (result != 0)
-		{
-			result = ret;
+			if (result != 0)
+			{
+				result = ret;
+			}
+
+			if (!plugin)
+			{
+				FileLoadDrivers(gDriverSpec, 1);
+			}
 		}
 
-		if (!plugin)
+		if (count < kDriverDirBatch)
 		{
-			FileLoadDrivers(gDriverSpec, 1);
+			break;
 		}
 	}
 
+	free(entries);
+
 	return result;
 }
 
@@ -474,7 +791,7 @@ long LoadDriverMKext( char *fileSpec )
 		( GetPackageElement(signature2) != kDriverPackageSignature2) ||
 		( GetPackageElement(length)      > kLoadSize )               ||
 		( GetPackageElement(adler32)    !=
-		Adler32((unsigned char *)&package->version, GetPackageElement(length) - 0x10) ) )
+		adler32((unsigned char *)&package->version, GetPackageElement(length) - 0x10) ) )
 	{
 		return -1;
 	}
@@ -497,7 +814,35 @@ long LoadDriverMKext( char *fileSpec )
 // LoadDriverPList
 long LoadDriverPList( char *dirSpec, char *name, long bundleType )
 {
-	long		length, executablePathLength, bundlePathLength;
+	long		length;
+
+	// Construct the file spec to the plist, then load it.
+
+	if(name)
+	{
+		snprintf(gFileSpec, 4096, "%s/%s/%sInfo.plist", dirSpec, name, (bundleType == kCFBundleType2) ? "Contents/" : "");
+	}
+	else
+	{
+		snprintf(gFileSpec, 4096, "%s/%sInfo.plist", dirSpec, (bundleType == kCFBundleType2) ? "Contents/" : "");
+	}
+
+	length = LoadFile(gFileSpec);
+
+	if (length == -1)
+	{
+		return -1;
+	}
+
+	return AddDriverPList(dirSpec, name, bundleType, length);
+}
+
+//==========================================================================
+// AddDriverPList
+// Register the driver whose Info.plist (length bytes) is at kLoadAddr.
+static long AddDriverPList( char *dirSpec, char *name, long bundleType, long length )
+{
+	long		executablePathLength, bundlePathLength;
 	ModulePtr	module;
 	TagPtr		personalities;
 	char		*buffer = 0;
@@ -505,6 +850,8 @@ long LoadDriverPList( char *dirSpec, char *name, long bundleType )
 	char		*tmpBundlePath = 0;
 	long		ret = -1;
 
+	((char *)kLoadAddr)[length] = '\0';
+
 	do {
 	// Save the driver path.
         
@@ -518,7 +865,7 @@ long LoadDriverPList( char *dirSpec, char *name, long bundleType )
 	}
 	executablePathLength = strlen(gFileSpec) + 1;
 
-	tmpExecutablePath = malloc(executablePathLength);
+	tmpExecutablePath = arena_alloc(&gDriverArena, executablePathLength);
 	if (tmpExecutablePath == 0) {
 		break;
 	}
@@ -534,7 +881,7 @@ long LoadDriverPList( char *dirSpec, char *name, long bundleType )
 	}
 	bundlePathLength = strlen(gFileSpec) + 1;
 
-	tmpBundlePath = malloc(bundlePathLength);
+	tmpBundlePath = arena_alloc(&gDriverArena, bundlePathLength);
 	if (tmpBundlePath == 0)
 	{
 		break;
@@ -542,37 +889,21 @@ long LoadDriverPList( char *dirSpec, char *name, long bundleType )
 
 	strlcpy(tmpBundlePath, gFileSpec, bundlePathLength);
 
-	// Construct the file spec to the plist, then load it.
-
-	if(name)
-	{
-		snprintf(gFileSpec, 4096, "%s/%s/%sInfo.plist", dirSpec, name, (bundleType == kCFBundleType2) ? "Contents/" : "");
-	}
-	else
-	{
-		snprintf(gFileSpec, 4096, "%s/%sInfo.plist", dirSpec, (bundleType == kCFBundleType2) ? "Contents/" : "");
-	}
-
-	length = LoadFile(gFileSpec);
+	length = length + 1;
+	buffer = arena_alloc(&gDriverArena, length);
 
-	if (length == -1)
+	if (buffer == 0)
 	{
 		break;
 	}
 
-	length = length + 1;
-	buffer = malloc(length);
-
-	if (buffer == 0)
-	{
-		break;
-	}
-
-	strlcpy(buffer, (char *)kLoadAddr, length);
+	// Keep the untouched plist for the module; the parser works in place
+	// on the load buffer.
+	bcopy((char *)kLoadAddr, buffer, length);
 
 	// Parse the plist.
 
-	ret = ParseXML(buffer, &module, &personalities);
+	ret = ParseXML((char *)kLoadAddr, &module, &personalities);
 
 	if (ret != 0) {
 		break;
@@ -589,7 +920,7 @@ long LoadDriverPList( char *dirSpec, char *name, long bundleType )
 	module->executablePath = tmpExecutablePath;
 	module->bundlePath = tmpBundlePath;
 	module->bundlePathLength = bundlePathLength;
-	module->plistAddr = malloc(length);
+	module->plistAddr = buffer;
 
 	if ((module->executablePath == 0) || (module->bundlePath == 0) || (module->plistAddr == 0))
 	{
@@ -601,19 +932,14 @@ long LoadDriverPList( char *dirSpec, char *name, long bundleType )
 	tmpExecutablePath = 0;
 	tmpBundlePath = 0;
 
-	// Add the plist to the module.
+	// The plist copy now belongs to the module.
 
-	strlcpy(module->plistAddr, (char *)kLoadAddr, length);
+	buffer = 0;
 	module->plistLength = length;
 
 	// Add the module to the end of the module list.
-        
-	if (gModuleHead == 0) {
-		gModuleHead = module;
-	} else 	{
-		gModuleTail->nextModule = module;
-	}
-	gModuleTail = module;
+
+	AddModule(module);
 
 	// Add the persionalities to the personality list.
 
@@ -636,14 +962,15 @@ long LoadDriverPList( char *dirSpec, char *name, long bundleType )
 	}
 	while (0);
     
+	// Newest first, so the arena can roll the space back.
 	if ( buffer ) {
-		free( buffer );
-	}
-	if ( tmpExecutablePath ) {
-		free( tmpExecutablePath );
+		arena_free( &gDriverArena, buffer );
 	}
 	if ( tmpBundlePath ) {
-		free( tmpBundlePath );
+		arena_free( &gDriverArena, tmpBundlePath );
+	}
+	if ( tmpExecutablePath ) {
+		arena_free( &gDriverArena, tmpExecutablePath );
 	}
 	return ret;
 }
@@ -656,8 +983,10 @@ long LoadMatchedModules( void )
 	ModulePtr	module;
 	char		*fileName, segName[32];
 	DriverInfoPtr	driver;
-	long		length, driverAddr, driverLength;
+	long		length, driverAddr, driverLength, available;
 	void		*executableAddr = 0;
+	char		*imageAddr;
+	moduleHook_t	*hook = intern_hook("LoadMatchedModules");
 
 	module = gModuleHead;
 
@@ -665,6 +994,13 @@ long LoadMatchedModules( void )
 	{
 		if (module->willLoad)
 		{
+			// Lay the DriverInfo out at the next free kernel address and read
+			// the executable right behind the plist; the range is only
+			// claimed once its size is known.
+			available = AvailableKernelMemory(&driverAddr);
+			imageAddr = (char *)(driverAddr + sizeof(DriverInfo) + module->plistLength);
+			available -= sizeof(DriverInfo) + module->plistLength + module->bundlePathLength;
+
 			prop = XMLGetProperty(module->dict, kPropCFBundleExecutable);
 
 			if (prop != 0)
@@ -672,27 +1008,44 @@ long LoadMatchedModules( void )
 				fileName = prop->string;
 				snprintf(gFileSpec, 4096, "%s%s", module->executablePath, fileName);
 
-				length = LoadThinFatFile(gFileSpec, &executableAddr);
-				if (length == 0)
+				length = (available > 0) ? LoadThinFatFileAt(gFileSpec, imageAddr, available) : -1;
+				executableAddr = imageAddr;
+
+				if (length == -1)
 				{
-					length = LoadFile(gFileSpec);
-					executableAddr = (void *)kLoadAddr;
+					// Filesystems without fs_readfile go through the load buffer.
+					length = LoadThinFatFile(gFileSpec, &executableAddr);
+					if (length == 0)
+					{
+						length = LoadFile(gFileSpec);
+						executableAddr = (void *)kLoadAddr;
+					}
 				}
 //		printf("%s length = %d addr = 0x%x\n", gFileSpec, length, driverModuleAddr); getchar();
 			}
 			else
 			{
 				length = 0;
+				executableAddr = imageAddr;
 			}
 
 			if ((length != -1) && executableAddr)
 			{
 				// Make make in the image area.
 
-				execute_hook("LoadMatchedModules", module, &length, executableAddr, NULL);
+				execute_hook_handle(hook, module, &length, executableAddr, NULL);
 
 				driverLength = sizeof(DriverInfo) + module->plistLength + length + module->bundlePathLength;
-				driverAddr = AllocateKernelMemory(driverLength);
+
+				// A hook that allocated kernel memory was handed the range the
+				// executable was read into; lay the DriverInfo out in the new
+				// allocation and copy the executable there as before.
+				available = AllocateKernelMemory(driverLength);
+				if (available != driverAddr)
+				{
+					driverAddr = available;
+					imageAddr = (char *)(driverAddr + sizeof(DriverInfo) + module->plistLength);
+				}
 
 				// Set up the DriverInfo.
 				driver = (DriverInfoPtr)driverAddr;
@@ -701,8 +1054,7 @@ long LoadMatchedModules( void )
 
 				if (length != 0)
 				{
-					driver->executableAddr = (void *)(driverAddr + sizeof(DriverInfo) +
-										 module->plistLength);
+					driver->executableAddr = imageAddr;
 					driver->executableLength = length;
 				}
 				else
@@ -715,15 +1067,31 @@ long LoadMatchedModules( void )
 									 module->plistLength + driver->executableLength);
 				driver->bundlePathLength = module->bundlePathLength;
 
-				// Save the plist, module and bundle.
-				strlcpy(driver->plistAddr, module->plistAddr, driver->plistLength);
+				// Save the plist, module and bundle; the executable is only
+				// copied if it went through the load buffer or was moved.
+				memcpy(driver->plistAddr, module->plistAddr, driver->plistLength);
 
-				if (length != 0)
+				if ((length != 0) && (executableAddr != imageAddr))
 				{
-					memcpy(driver->executableAddr, executableAddr, length);
+					if ((char *)executableAddr < imageAddr &&
+						(char *)executableAddr + length > imageAddr)
+					{
+						// Moved up over itself; copy from the end.
+						char *src = (char *)executableAddr + length;
+						char *dst = imageAddr + length;
+
+						while (dst > imageAddr)
+						{
+							*--dst = *--src;
+						}
+					}
+					else
+					{
+						memcpy(driver->executableAddr, executableAddr, length);
+					}
 				}
 
-				strlcpy(driver->bundlePathAddr, module->bundlePath, module->bundlePathLength);
+				memcpy(driver->bundlePathAddr, module->bundlePath, module->bundlePathLength);
 
 				// Add an entry to the memory map.
 				snprintf(segName, sizeof(segName), "Driver-%lx", (unsigned long)driver);
@@ -749,58 +1117,254 @@ static long MatchPersonalities( void )
 // MatchLibraries
 static long MatchLibraries( void )
 {
-	TagPtr     prop;
-	TagPtr     prop2;
-	ModulePtr  module;
-	ModulePtr  module2;
-	long       done;
+	TagPtr		prop;
+	ModulePtr	module;
+	ModulePtr	library;
+	ModulePtr	*worklist;
+	long		count, top;
+	char		*version;
+
+	// Every module is pushed at most once: when it is first marked to load.
+	count = 0;
+	for (module = gModuleHead; module != 0; module = module->nextModule)
+	{
+		count++;
+	}
 
-	do {
-		done = 1;
-		module = gModuleHead;
-        
-		while (module != 0)
+	worklist = malloc((count + 1) * sizeof(ModulePtr));
+	if (worklist == 0)
+	{
+		return -1;
+	}
+
+	top = 0;
+	for (module = gModuleHead; module != 0; module = module->nextModule)
+	{
+		if (module->willLoad == 1)
 		{
-			if (module->willLoad == 1)
-			{
-				prop = XMLGetProperty(module->dict, kPropOSBundleLibraries);
+			worklist[top++] = module;
+		}
+	}
 
-				if (prop != 0)
-				{
-					prop = prop->tag;
+	while (top > 0)
+	{
+		module = worklist[--top];
+		module->willLoad = 2;
 
-					while (prop != 0)
-					{
-						module2 = gModuleHead;
+		prop = XMLGetProperty(module->dict, kPropOSBundleLibraries);
+		if (prop == 0)
+		{
+			continue;
+		}
 
-						while (module2 != 0)
-						{
-							prop2 = XMLGetProperty(module2->dict, kPropCFBundleIdentifier);
-
-							if ((prop2 != 0) && (!strcmp(prop->string, prop2->string)))
-							{
-								if (module2->willLoad == 0)
-								{
-									module2->willLoad = 1;
-								}
-								break;
-							}
-							module2 = module2->nextModule;
-						}
-						prop = prop->tagNext;
-					}
+		for (prop = prop->tag; prop != 0; prop = prop->tagNext)
+		{
+			version = (prop->tag && prop->tag->type == kTagTypeString) ? prop->tag->string : 0;
+			library = FindLibrary(module, prop->string, version);
+
+			if (library == 0)
+			{
+				// The kernel provides its own interfaces as kpi and kernel
+				// bundles, which are never on disk.
+				if (strncmp(prop->string, "com.apple.kpi.", 14) && strncmp(prop->string, "com.apple.kernel", 16))
+				{
+					verbose("MatchLibraries: %s needs %s, which was not found\n", module->identifier, prop->string);
 				}
-				module->willLoad = 2;
-				done = 0;
+				continue;
+			}
+
+			if (library->willLoad == 0)
+			{
+				library->willLoad = 1;
+				worklist[top++] = library;
 			}
-			module = module->nextModule;
 		}
 	}
-	while (!done);
+
+	free(worklist);
 
 	return 0;
 }
 
+//==========================================================================
+// HashIdentifier
+static unsigned long HashIdentifier( const char *identifier )
+{
+	unsigned long hash = 5381;
+
+	while (*identifier)
+	{
+		hash = hash * 33 + (unsigned char)*identifier++;
+	}
+
+	return hash % kModuleHashSize;
+}
+
+//==========================================================================
+// AddModule
+// Append the module to the module list and to the identifier hash.
+static void AddModule( ModulePtr module )
+{
+	TagPtr		prop;
+	ModulePtr	*link;
+	unsigned long	hash;
+
+	if (gModuleHead == 0) {
+		gModuleHead = module;
+	} else 	{
+		gModuleTail->nextModule = module;
+	}
+	gModuleTail = module;
+
+	prop = XMLGetProperty(module->dict, kPropCFBundleIdentifier);
+	if ((prop == 0) || (prop->type != kTagTypeString))
+	{
+		return;
+	}
+	module->identifier = prop->string;
+
+	hash = HashIdentifier(module->identifier);
+
+	// Buckets keep registration order, so the first kext found for an
+	// identifier still wins among equally suitable ones.
+	for (link = &gModuleHash[hash]; *link != 0; link = &(*link)->nextHash)
+	{
+	}
+	*link = module;
+}
+
+//==========================================================================
+// FindLibrary
+// Return the first module with this identifier that is compatible with the
+// requested version: CFBundleVersion >= version >= OSBundleCompatibleVersion.
+// If none is, the first one is returned anyway and the kernel decides.
+static ModulePtr FindLibrary( ModulePtr module, const char *identifier, const char *version )
+{
+	TagPtr			prop;
+	ModulePtr		library, first = 0;
+	unsigned long		hash;
+	unsigned long long	wanted, current, compatible;
+
+	hash = HashIdentifier(identifier);
+
+	wanted = version ? ParseKextVersion(version) : 0;
+
+	for (library = gModuleHash[hash]; library != 0; library = library->nextHash)
+	{
+		if (strcmp(library->identifier, identifier))
+		{
+			continue;
+		}
+
+		if (first == 0)
+		{
+			first = library;
+		}
+
+		if (wanted == 0)
+		{
+			return library;
+		}
+
+		prop = XMLGetProperty(library->dict, kPropCFBundleVersion);
+		current = (prop && prop->type == kTagTypeString) ? ParseKextVersion(prop->string) : 0;
+
+		prop = XMLGetProperty(library->dict, kPropOSBundleCompatibleVersion);
+		compatible = (prop && prop->type == kTagTypeString) ? ParseKextVersion(prop->string) : 0;
+
+		if (compatible != 0 && compatible <= wanted && wanted <= current)
+		{
+			return library;
+		}
+	}
+
+	if (first != 0)
+	{
+		verbose("MatchLibraries: %s needs %s %s, no compatible version found\n", module->identifier, identifier, version);
+	}
+
+	return first;
+}
+
+//==========================================================================
+// ParseKextVersion
+// Turn a kext version ("1.2.3", "2.0b4", "10.1fc2") into a number that sorts
+// like the version; 0 if the string is not a valid version.
+static unsigned long long ParseKextVersion( const char *string )
+{
+	unsigned long long	version = 0;
+	unsigned long		part;
+	long			i, digits, stage, stageLevel;
+
+	// Up to three parts: major (4 digits), minor and revision (2 digits each).
+	for (i = 0; i < 3; i++)
+	{
+		part = 0;
+		digits = 0;
+		while (*string >= '0' && *string <= '9')
+		{
+			part = part * 10 + (*string++ - '0');
+			digits++;
+		}
+
+		if (digits == 0 || digits > ((i == 0) ? 4 : 2))
+		{
+			return 0;
+		}
+
+		version = version * 100 + part;
+
+		if (*string != '.')
+		{
+			i++;
+			break;
+		}
+		string++;
+	}
+
+	for (; i < 3; i++)
+	{
+		version *= 100;
+	}
+
+	// Stage: development < alpha < beta < final candidate < release.
+	stage = 4;
+	switch (*string)
+	{
+		case 'd':	stage = 0; string++; break;
+		case 'a':	stage = 1; string++; break;
+		case 'b':	stage = 2; string++; break;
+		case 'f':
+			if (string[1] != 'c')
+			{
+				return 0;
+			}
+			stage = 3;
+			string += 2;
+			break;
+		case '\0':	break;
+		default:	return 0;
+	}
+
+	stageLevel = 0;
+	if (stage != 4)
+	{
+		digits = 0;
+		while (*string >= '0' && *string <= '9')
+		{
+			stageLevel = stageLevel * 10 + (*string++ - '0');
+			digits++;
+		}
+
+		if (digits == 0 || digits > 3 || *string != '\0')
+		{
+			return 0;
+		}
+	}
+
+	return (version * 5 + stage) * 1000 + stageLevel;
+}
+
 //==========================================================================
 // FindModule
 
@@ -882,7 +1446,7 @@ static long ParseXML( char *buffer, ModulePtr *module, TagPtr *personalities )
 		}
 	}
 
-	tmpModule = malloc(sizeof(Module));
+	tmpModule = arena_alloc(&gDriverArena, sizeof(Module));
 	if (tmpModule == 0)
 	{
 		XMLFreeTag(moduleDict);
@@ -903,17 +1467,441 @@ static long ParseXML( char *buffer, ModulePtr *module, TagPtr *personalities )
 	return 0;
 }
 
+//==========================================================================
+// LoadCompressedKernel
+// Read a 'comp' kernel cache in chunks and decompress each chunk as it
+// arrives, summing the output for the Adler-32 check as it is produced, so
+// the compressed image never has to be in memory as a whole. Returns the
+// uncompressed length with *binary pointing at it, -2 if the file is not a
+// compressed kernel cache (or can't be read in chunks) and -1 on errors.
+long LoadCompressedKernel(const char *fileSpec, void **binary)
+{
+	compressed_kernel_header	header;
+	lzss_stream	lzss;
+	lzvn_stream	lzvn;
+	u_int8_t	*chunk = 0, *output = 0, *mark;
+	void		*fat;
+	unsigned long	base = 0, length = 0, remaining, size, have = 0, adler = 1;
+	long		used = 0, ret = -1;
+	int		isLZVN;
+
+	// The first page holds the fat header, if any, or the comp header.
+	chunk = malloc(kKernelReadChunk + kKernelReadSlack);
+	if (chunk == 0)
+	{
+		return -1;
+	}
+
+	size = ReadFileAtOffset(fileSpec, chunk, 0, 0x1000);
+	fat = chunk;
+	if ((size != -1) && (size >= sizeof(header)) && (ThinFatFile(&fat, &length) == 0) && (length != 0))
+	{
+		base = (u_int8_t *)fat - chunk;
+		size = ReadFileAtOffset(fileSpec, chunk, base, sizeof(header));
+	}
+
+	if ((size == -1) || (size < sizeof(header)))
+	{
+		free(chunk);
+		return -2;
+	}
+
+	bcopy(chunk, &header, sizeof(header));
+
+	if ((header.signature != OSSwapBigToHostConstInt32('comp'))
+		|| ((header.compress_type != OSSwapBigToHostConstInt32('lzss'))
+		&& (header.compress_type != OSSwapBigToHostConstInt32('lzvn'))))
+	{
+		free(chunk);
+		return -2;
+	}
+
+	isLZVN = (header.compress_type == OSSwapBigToHostConstInt32('lzvn'));
+	verbose("\t- Decompressing Kernel Using %s while reading\n", isLZVN ? "lzvn" : "lzss");
+
+	size = OSSwapBigToHostInt32(header.uncompressed_size);
+	remaining = OSSwapBigToHostInt32(header.compressed_size);
+
+	do {
+	output = malloc(size);
+	if (output == 0)
+	{
+		break;
+	}
+
+	if (isLZVN)
+	{
+		lzvn_stream_init(&lzvn, output, size);
+	}
+	else
+	{
+		lzss_stream_init(&lzss, output, size);
+	}
+
+	mark = output;
+	base += sizeof(header);
+
+	// Bytes the decoder could not use yet stay at the front of the chunk.
+	while (remaining != 0 || have != 0)
+	{
+		length = (remaining < kKernelReadChunk) ? remaining : kKernelReadChunk;
+
+		if (length != 0)
+		{
+			if (ReadFileAtOffset(fileSpec, chunk + have, base, length) != length)
+			{
+				error("ERROR! Can't read '%s'.\n", fileSpec);
+				break;
+			}
+
+			base += length;
+			remaining -= length;
+			have += length;
+		}
+
+		if (isLZVN)
+		{
+			used = lzvn_decode_stream(&lzvn, chunk, have, remaining == 0);
+		}
+		else
+		{
+			used = decompress_lzss_stream(&lzss, chunk, have, remaining == 0);
+		}
+
+		if (used < 0)
+		{
+			break;
+		}
+
+		have -= used;
+		bcopy(chunk + used, chunk, have);
+
+		// Checksum the new output while it is still in the cache.
+		if (isLZVN)
+		{
+			adler = adler32_update(adler, mark, lzvn.dst - mark);
+			mark = lzvn.dst;
+		}
+		else
+		{
+			adler = adler32_update(adler, mark, lzss.dst - mark);
+			mark = lzss.dst;
+		}
+
+		if ((isLZVN && lzvn.done) || (!isLZVN && lzss.done))
+		{
+			break;
+		}
+	}
+
+	if (mark - output != size)
+	{
+		error("ERROR! Size mismatch from %s (found: %x, expected: %x).\n", isLZVN ? "lzvn" : "lzss", mark - output, size);
+		break;
+	}
+
+	if (OSSwapBigToHostInt32(header.adler32) != adler)
+	{
+		error("ERROR! Adler mismatch (found: %X, expected: %X).\n", adler, OSSwapBigToHostInt32(header.adler32));
+		break;
+	}
+
+	*binary = output;
+	output = 0;
+	ret = size;
+	} while (0);
+
+	if (output)
+	{
+		free(output);
+	}
+	free(chunk);
+
+	return ret;
+}
+
 #if NOTDEF
 static char gPlatformName[64];
 #endif
 
+//==========================================================================
+// Darwin kernel versions and the OS X versions they belong to. A minor or
+// rev of -1 matches any; the first matching entry wins, so the last entry
+// of each major covers the updates released after this table.
+
+typedef struct DarwinVersion {
+	int		major;
+	int		minor;
+	int		rev;
+	uint32_t	osVersion;
+} DarwinVersion;
+
+static const DarwinVersion gDarwinVersions[] = {
+	{ 10,  0, -1, 0xA060000 },	// Snow Leopard
+	{ 10,  1, -1, 0xA060100 },
+	{ 10,  2, -1, 0xA060200 },
+	{ 10,  3, -1, 0xA060300 },
+	{ 10,  4, -1, 0xA060400 },
+	{ 10,  5, -1, 0xA060500 },
+	{ 10,  6, -1, 0xA060600 },
+	{ 10,  7, -1, 0xA060700 },
+	{ 10, -1, -1, 0xA060800 },
+	{ 11,  0, -1, 0xA070000 },	// Lion
+	{ 11,  1, -1, 0xA070100 },
+	{ 11,  2, -1, 0xA070200 },
+	{ 11,  3, -1, 0xA070300 },
+	{ 11,  4,  0, 0xA070400 },
+	{ 11,  4,  1, 0xA070400 },
+	{ 11, -1, -1, 0xA070500 },
+	{ 12,  0, -1, 0xA080000 },	// Mountain Lion
+	{ 12,  1, -1, 0xA080100 },
+	{ 12,  2, -1, 0xA080200 },
+	{ 12,  3, -1, 0xA080300 },
+	{ 12,  4, -1, 0xA080400 },
+	{ 12, -1, -1, 0xA080500 },	// 10.8.5 and its update
+	{ 13,  0,  0, 0xA090000 },	// Mavericks
+	{ 13,  0,  1, 0xA090000 },	// never released
+	{ 13,  0, -1, 0xA090100 },
+	{ 13,  1, -1, 0xA090100 },	// never released
+	{ 13,  2, -1, 0xA090200 },
+	{ 13,  3, -1, 0xA090300 },
+	{ 13,  4, -1, 0xA090400 },
+	{ 13, -1, -1, 0xA090500 },
+	{ 14,  0, -1, 0xA0A0000 },	// Yosemite, same kernel as 10.10.1
+	{ 14,  1, -1, 0xA0A0100 },
+	{ 14,  2, -1, 0xA0A0200 },
+	{ 14,  3, -1, 0xA0A0300 },
+	{ 14,  4, -1, 0xA0A0400 },
+	{ 14, -1, -1, 0xA0A0500 },
+	{ 15,  0, -1, 0xA0B0000 },	// El Capitan
+	{ 15,  1, -1, 0xA0B0100 },
+	{ 15,  2, -1, 0xA0B0200 },
+	{ 15,  3, -1, 0xA0B0300 },
+	{ 15,  4, -1, 0xA0B0400 },
+	{ 15,  5, -1, 0xA0B0500 },
+	{ 15, -1, -1, 0xA0B0600 },
+	{ 16,  0, -1, 0xA0C0000 },	// Sierra
+	{ 16,  1, -1, 0xA0C0100 },
+	{ 16,  2, -1, 0xA0C0200 },
+	{ 16,  3, -1, 0xA0C0200 },
+	{ 16,  4, -1, 0xA0C0300 },
+	{ 16,  5, -1, 0xA0C0400 },
+	{ 16,  6, -1, 0xA0C0500 },
+	{ 16, -1, -1, 0xA0C0600 },
+	{ 17,  0, -1, 0xA0D0000 },	// High Sierra
+	{ 17, -1, -1, 0xA0D0100 },
+};
+
+// Used when the kernel carries no version string.
+static const DarwinVersion gOSDarwinVersions[] = {
+	{ 10,  0, 0, 0xA060000 },	// Snow Leopard
+	{ 10,  1, 0, 0xA060100 },
+	{ 10,  2, 0, 0xA060200 },
+	{ 10,  3, 0, 0xA060300 },
+	{ 10,  4, 0, 0xA060400 },
+	{ 10,  5, 0, 0xA060500 },
+	{ 10,  6, 0, 0xA060600 },
+	{ 10,  7, 0, 0xA060700 },
+	{ 10,  8, 0, 0xA060800 },
+	{ 11,  0, 0, 0xA070000 },	// Lion
+	{ 11,  1, 0, 0xA070100 },
+	{ 11,  2, 0, 0xA070200 },
+	{ 11,  3, 0, 0xA070300 },
+	{ 11,  4, 0, 0xA070400 },
+	{ 11,  4, 2, 0xA070500 },
+	{ 12,  0, 0, 0xA080000 },	// Mountain Lion
+	{ 12,  1, 0, 0xA080100 },
+	{ 12,  2, 0, 0xA080200 },
+	{ 12,  3, 0, 0xA080300 },
+	{ 12,  4, 0, 0xA080400 },
+	{ 12,  5, 0, 0xA080500 },
+	{ 13,  0, 0, 0xA090000 },	// Mavericks
+	{ 13,  1, 0, 0xA090100 },
+	{ 13,  2, 0, 0xA090200 },
+	{ 13,  3, 0, 0xA090300 },
+	{ 13,  4, 0, 0xA090400 },
+	{ 13,  5, 0, 0xA090500 },
+	{ 14,  0, 0, 0xA0A0000 },	// Yosemite
+	{ 14,  0, 0, 0xA0A0100 },
+	{ 14,  2, 0, 0xA0A0200 },
+	{ 14,  3, 0, 0xA0A0300 },
+	{ 14,  4, 0, 0xA0A0400 },
+	{ 14,  5, 0, 0xA0A0500 },
+	{ 15,  0, 0, 0xA0B0000 },	// El Capitan
+	{ 15,  1, 0, 0xA0B0100 },
+	{ 15,  2, 0, 0xA0B0200 },
+	{ 15,  3, 0, 0xA0B0300 },
+	{ 15,  4, 0, 0xA0B0400 },
+	{ 15,  5, 0, 0xA0B0500 },
+	{ 15,  6, 0, 0xA0B0600 },
+	{ 16,  0, 0, 0xA0C0000 },	// Sierra
+	{ 16,  1, 0, 0xA0C0100 },
+	{ 16,  3, 0, 0xA0C0200 },
+	{ 16,  4, 0, 0xA0C0300 },
+	{ 16,  5, 0, 0xA0C0400 },
+	{ 16,  6, 0, 0xA0C0500 },
+	{ 16,  7, 0, 0xA0C0600 },
+	{ 17,  0, 0, 0xA0D0000 },	// High Sierra
+	{ 17,  1, 0, 0xA0D0100 },
+};
+
+// Last known kernel, for versions newer than both tables.
+#define kLastDarwinMajor	17
+#define kLastDarwinMinor	1
+#define kLastOSVersion		0xA0D0100
+
+// Where the kernel's version[] string lives when there is no _version
+// symbol to find it by; a 0 section stands for the whole segment.
+static const struct {
+	const char	*segname;
+	const char	*sectname;
+} gDarwinVersionSections[] = {
+	{ "__TEXT",		"__const" },
+	{ "__DATA_CONST",	"__const" },
+	{ "__DATA",		"__const" },
+	{ "__TEXT",		0 },
+	{ "__DATA_CONST",	0 },
+	{ "__DATA",		0 },
+};
+
+//==========================================================================
+// Find length bytes of pattern in data; candidates are found with memchr.
+
+static const char *FindBytes(const char *data, unsigned long size, const char *pattern, unsigned long length)
+{
+	const char *end = data + size;
+
+	while ((unsigned long)(end - data) >= length)
+	{
+		data = memchr(data, pattern[0], end - data - length + 1);
+
+		if (!data)
+		{
+			break;
+		}
+
+		if (memcmp(data, pattern, length) == 0)
+		{
+			return data;
+		}
+
+		data++;
+	}
+
+	return 0;
+}
+
+//==========================================================================
+// Return the "Darwin Kernel Version ..." string of a thin kernel, looked up
+// through its _version symbol or, without one, searched for in the
+// sections that hold constant data.
+
+static const char *FindDarwinVersion(void *binary)
+{
+	const char	*version, *data;
+	unsigned long	size, i;
+
+	version = GetMachOSymbol(binary, "_version");
+
+	if (version && strncmp(version, kDarwinVersionPrefix, sizeof(kDarwinVersionPrefix) - 1) == 0)
+	{
+		return version;
+	}
+
+	for (i = 0; i < sizeof(gDarwinVersionSections) / sizeof(gDarwinVersionSections[0]); i++)
+	{
+		data = GetMachOSection(binary, gDarwinVersionSections[i].segname, gDarwinVersionSections[i].sectname, &size);
+
+		if (data && (version = FindBytes(data, size, kDarwinVersionPrefix, sizeof(kDarwinVersionPrefix) - 1)))
+		{
+			return version;
+		}
+	}
+
+	return 0;
+}
+
+//==========================================================================
+// Split "17.0.0: ..." into gDarwinMajor, gDarwinMinor and gDarwinRev;
+// returns true if all three were there.
+
+static bool ParseDarwinVersion(const char *string)
+{
+	int	*fields[] = { &gDarwinMajor, &gDarwinMinor, &gDarwinRev };
+	int	i;
+
+	gDarwinMajor = gDarwinMinor = gDarwinRev = -1;
+
+	for (i = 0; i < 3 && *string && *string != ':'; i++)
+	{
+		*fields[i] = atoi(string);
+
+		while (*string && *string != '.' && *string != ':')
+		{
+			string++;
+		}
+
+		if (*string == '.')
+		{
+			string++;
+		}
+	}
+
+	return gDarwinMajor >= 0 && gDarwinMinor >= 0 && gDarwinRev >= 0;
+}
+
+//==========================================================================
+
+static uint32_t DarwinToOSVersion(int major, int minor, int rev)
+{
+	const DarwinVersion	*entry;
+	unsigned long		i;
+
+	for (i = 0; i < sizeof(gDarwinVersions) / sizeof(gDarwinVersions[0]); i++)
+	{
+		entry = &gDarwinVersions[i];
+
+		if (entry->major == major && (entry->minor < 0 || entry->minor == minor) && (entry->rev < 0 || entry->rev == rev))
+		{
+			return entry->osVersion;
+		}
+	}
+
+	return kLastOSVersion;
+}
+
+//==========================================================================
+
+static void OSToDarwinVersion(uint32_t osVersion)
+{
+	unsigned long i;
+
+	gDarwinMajor = kLastDarwinMajor;
+	gDarwinMinor = kLastDarwinMinor;
+	gDarwinRev = 0;
+
+	for (i = 0; i < sizeof(gOSDarwinVersions) / sizeof(gOSDarwinVersions[0]); i++)
+	{
+		if (gOSDarwinVersions[i].osVersion == osVersion)
+		{
+			gDarwinMajor = gOSDarwinVersions[i].major;
+			gDarwinMinor = gOSDarwinVersions[i].minor;
+			gDarwinRev = gOSDarwinVersions[i].rev;
+			break;
+		}
+	}
+}
+
+//==========================================================================
+
 long DecodeKernel(void *binary, entry_t *rentry, char **raddr, int *rsize)
 {
 	long ret = 0;
 	compressed_kernel_header *kernel_header = (compressed_kernel_header *)binary;
-	u_int32_t uncompressed_size = 0, size = 0, adler32 = 0;
+	u_int32_t uncompressed_size = 0, size = 0, adler = 0;
 	void *buffer = NULL;
 	unsigned long len = 0;
+	const char *version;
 
 /*#if 0
 	printf("kernel header:\n");
@@ -992,10 +1980,10 @@ long DecodeKernel(void *binary, entry_t *rentry, char **raddr, int *rsize)
 			return -1;
 		}
 
-		adler32 = Adler32(binary, uncompressed_size);
-		if (OSSwapBigToHostInt32(kernel_header->adler32) != adler32)
+		adler = adler32(binary, uncompressed_size);
+		if (OSSwapBigToHostInt32(kernel_header->adler32) != adler)
 		{
-			error("ERROR! Adler mismatch (found: %X, expected: %X).\n", adler32, OSSwapBigToHostInt32(kernel_header->adler32));
+			error("ERROR! Adler mismatch (found: %X, expected: %X).\n", adler, OSSwapBigToHostInt32(kernel_header->adler32));
 			return -1;
 		}
 
@@ -1009,255 +1997,20 @@ long DecodeKernel(void *binary, entry_t *rentry, char **raddr, int *rsize)
 		ret = ThinFatFile(&binary, &len);
 	}
 
-	// Bungo: scan binary for Darwin Kernel Version string
-	useDarwinVersion = true;
-	uint32_t offset = 0;
-	strncpy(gDarwinBuildVerStr, "Darwin Kernel Version", sizeof(gDarwinBuildVerStr));
-
-	while ((offset < 0xFFFFFFFF - (uint32_t)binary - 256) && memcmp(binary + offset, gDarwinBuildVerStr, 21))
+	// Bungo: find the Darwin Kernel Version string
+	// Micky1979: and split it into gDarwinMajor, gDarwinMinor and gDarwinRev
+	version = FindDarwinVersion(binary);
+	if (version)
 	{
-		offset++;
-	}
-	if (offset < 0xFFFFFFFF - (uint32_t)binary - 256)
-	{
-		strncpy(gDarwinBuildVerStr, (char *)(binary + offset), sizeof(gDarwinBuildVerStr));
+		strlcpy(gDarwinBuildVerStr, version, sizeof(gDarwinBuildVerStr));
+		useDarwinVersion = ParseDarwinVersion(gDarwinBuildVerStr + sizeof(kDarwinVersionPrefix));
+		kernelOSVer = DarwinToOSVersion(gDarwinMajor, gDarwinMinor, gDarwinRev);
 	}
 	else
 	{
-		strcat(gDarwinBuildVerStr, ": Unknown");
+		strlcpy(gDarwinBuildVerStr, kDarwinVersionPrefix ": Unknown", sizeof(gDarwinBuildVerStr));
 		useDarwinVersion = false;
-	}
-	// Micky1979 use Bungo gDarwinBuildVerStr and split into gDarwinMajor, gDarwinMinor and gDarwinRev
-	if (useDarwinVersion)
-	{
-		useDarwinVersion = false;
-		const char *pattern = strstr(gDarwinBuildVerStr, "Darwin Kernel Version ")+22;
-		const char *until = strstr(pattern, ":");
-		size_t vlen = until - pattern;
-		char *ver = (char *)malloc(sizeof(char)*(len+1));
-		strncpy(ver, pattern, vlen);
-		ver[vlen] = '\0';
-		char *delim;
-		char *temp;
-		gDarwinMajor = -1; gDarwinMinor = -1; gDarwinRev = -1;
-		if (ver != NULL)
-		{
-			temp = ver;
-			int count = 1;
-			while ((delim = strsep_c(&ver, ".")) != NULL)
-			{
-				switch (count)
-				{
-					case 1: gDarwinMajor = atoi(delim); break;
-					case 2: gDarwinMinor = atoi(delim); break;
-					case 3: gDarwinRev   = atoi(delim); break;
-					default: break;
-				}
-				count ++;
-			}
-			free(temp);
-		}
-
-		if (gDarwinMajor >= 0 && gDarwinMinor >= 0 && gDarwinRev >= 0)
-		{
-			useDarwinVersion = true;
-		}
-
-		switch (gDarwinMajor)
-		{
-			case 10:
-				switch (gDarwinMinor)
-				{
-					case 0: kernelOSVer = 0xA060000; break;
-					case 1: kernelOSVer = 0xA060100; break;
-					case 2: kernelOSVer = 0xA060200; break;
-					case 3: kernelOSVer = 0xA060300; break;
-					case 4: kernelOSVer = 0xA060400; break;
-					case 5: kernelOSVer = 0xA060500; break;
-					case 6: kernelOSVer = 0xA060600; break;
-					case 7: kernelOSVer = 0xA060700; break;
-					case 8: kernelOSVer = 0xA060800; break;
-					default:kernelOSVer = 0xA060800; break; //Last known kernel
-				}
-				break;
-			case 11:
-				switch (gDarwinMinor)
-				{
-					case 0: kernelOSVer = 0xA070000; break;
-					case 1: kernelOSVer = 0xA070100; break;
-					case 2: kernelOSVer = 0xA070200; break;
-					case 3: kernelOSVer = 0xA070300; break;
-					case 4:
-						switch (gDarwinRev)
-						{
-							case 0: kernelOSVer = 0xA070400; break;
-							case 1: kernelOSVer = 0xA070400; break;
-							case 2: kernelOSVer = 0xA070500; break;
-							default:kernelOSVer = 0xA070500; break; //Last known kernel
-						}
-					default:kernelOSVer = 0xA070500; break; //Last known kernel
-				}
-				break;
-			case 12:
-				switch (gDarwinMinor)
-				{
-					case 0: kernelOSVer = 0xA080000; break;
-					case 1: kernelOSVer = 0xA080100; break;
-					case 2: kernelOSVer = 0xA080200; break;
-					case 3: kernelOSVer = 0xA080300; break;
-					case 4: kernelOSVer = 0xA080400; break;
-					case 5: kernelOSVer = 0xA080500; break; // 10.8.5
-					case 6: kernelOSVer = 0xA080500; break; // 10.8.5 update
-					default:kernelOSVer = 0xA080500; break; //Last known kernel
-				}
-				break;
-			case 13:
-				switch (gDarwinMinor)
-				{
-					case 0: kernelOSVer = 0xA090000;
-					switch (gDarwinRev)
-					{
-						case 0: kernelOSVer = 0xA090000; break;
-						case 1: kernelOSVer = 0xA090000; break; // never exist (or released)
-						case 2: kernelOSVer = 0xA090100; break;
-						default:kernelOSVer = 0xA090100; break; //Last known kernel
-					}
-						break;
-					case 1: kernelOSVer = 0xA090100; break; // never exist (or released)
-					case 2: kernelOSVer = 0xA090200; break;
-					case 3: kernelOSVer = 0xA090300; break;
-					case 4: kernelOSVer = 0xA090400; break;
-					case 5: kernelOSVer = 0xA090500; break;
-					default:kernelOSVer = 0xA090500; break; //Last known kernel
-				}
-				break;
-			case 14:
-				switch (gDarwinMinor)
-				{
-					case 0: kernelOSVer = 0xA0A0000; break; // same kernel of 10.10.1
-					case 1: kernelOSVer = 0xA0A0100; break; // same kernel of 10.10
-					case 2: kernelOSVer = 0xA0A0200; break;
-					case 3: kernelOSVer = 0xA0A0300; break;
-					case 4: kernelOSVer = 0xA0A0400; break;
-					case 5: kernelOSVer = 0xA0A0500; break;
-					default:kernelOSVer = 0xA0A0500; break; //Last known kernel
-				}
-				break;
-			case 15: /* El Capitan */
-				switch (gDarwinMinor)
-				{
-					case 0: kernelOSVer = 0xA0B0000; break;
-					case 1: kernelOSVer = 0xA0B0100; break;
-					case 2: kernelOSVer = 0xA0B0200; break;
-					case 3: kernelOSVer = 0xA0B0300; break;
-					case 4: kernelOSVer = 0xA0B0400; break;
-					case 5: kernelOSVer = 0xA0B0500; break;
-					case 6: kernelOSVer = 0xA0B0600; break;
-					default:kernelOSVer = 0xA0B0600; break; //Last known kernel (add here updates)
-				}
-				break;
-			case 16:  /* Sierra */
-				switch (gDarwinMinor)
-				{
-					case 0: kernelOSVer = 0xA0C0000; break;
-					case 1: kernelOSVer = 0xA0C0100; break;
-					case 2: kernelOSVer = 0xA0C0200; break;
-					case 3: kernelOSVer = 0xA0C0200; break;
-					case 4: kernelOSVer = 0xA0C0300; break;
-					case 5: kernelOSVer = 0xA0C0400; break;
-					case 6: kernelOSVer = 0xA0C0500; break;
-					case 7: kernelOSVer = 0xA0C0600; break;
-//					case 8: kernelOSVer = 0xA0C0700; break;
-					default:kernelOSVer = 0xA0C0600; break; //Last known kernel (add here updates)
-				}
-				break;
-			case 17:  /* High Sierra */
-				switch (gDarwinMinor)
-				{
-					case 0: kernelOSVer = 0xA0D0000; break;
-					case 1: kernelOSVer = 0xA0D0100; break;
-//					case 2: kernelOSVer = 0xA0D0200; break; // 17.2.0
-//					case 3: kernelOSVer = 0xA0C0200; break;
-//					case 4: kernelOSVer = 0xA0C0300; break;
-//					case 5: kernelOSVer = 0xA0C0400; break;
-//					case 6: kernelOSVer = 0xA0C0500; break;
-//					case 7: kernelOSVer = 0xA0C0600; break;
-//					case 8: kernelOSVer = 0xA0C0700; break;
-					default:kernelOSVer = 0xA0D0100; break; //Last known kernel (add here updates)
-				}
-				break;
-			default:
-				kernelOSVer = 0xA0D0100;
-				break; //Last known kernel is Sierra 10.13.1
-			}
-		}
-		else
-		{
-			switch (MacOSVerCurrent)
-			{
-			// Snow
-			case 0xA060000: gDarwinMajor = 10; gDarwinMinor =  0; gDarwinRev = 0; break; // 10.6
-			case 0xA060100: gDarwinMajor = 10; gDarwinMinor =  1; gDarwinRev = 0; break; // 10.6.1
-			case 0xA060200: gDarwinMajor = 10; gDarwinMinor =  2; gDarwinRev = 0; break; // 10.6.2
-			case 0xA060300: gDarwinMajor = 10; gDarwinMinor =  3; gDarwinRev = 0; break; // 10.6.3
-			case 0xA060400: gDarwinMajor = 10; gDarwinMinor =  4; gDarwinRev = 0; break; // 10.6.4
-			case 0xA060500: gDarwinMajor = 10; gDarwinMinor =  5; gDarwinRev = 0; break; // 10.6.5
-			case 0xA060600: gDarwinMajor = 10; gDarwinMinor =  6; gDarwinRev = 0; break; // 10.6.6
-			case 0xA060700: gDarwinMajor = 10; gDarwinMinor =  7; gDarwinRev = 0; break; // 10.6.7
-			case 0xA060800: gDarwinMajor = 10; gDarwinMinor =  8; gDarwinRev = 0; break; // 10.6.8
-			// Lion
-			case 0xA070000: gDarwinMajor = 11; gDarwinMinor =  0; gDarwinRev = 0; break; // 10.7
-			case 0xA070100: gDarwinMajor = 11; gDarwinMinor =  1; gDarwinRev = 0; break; // 10.7.1
-			case 0xA070200: gDarwinMajor = 11; gDarwinMinor =  2; gDarwinRev = 0; break; // 10.7.2
-			case 0xA070300: gDarwinMajor = 11; gDarwinMinor =  3; gDarwinRev = 0; break; // 10.7.3
-			case 0xA070400: gDarwinMajor = 11; gDarwinMinor =  4; gDarwinRev = 0; break; // 10.7.4
-			case 0xA070500: gDarwinMajor = 11; gDarwinMinor =  4; gDarwinRev = 2; break; // 10.7.5
-			// ML
-			case 0xA080000: gDarwinMajor = 12; gDarwinMinor =  0; gDarwinRev = 0; break; // 10.8
-			case 0xA080100: gDarwinMajor = 12; gDarwinMinor =  1; gDarwinRev = 0; break; // 10.8.1
-			case 0xA080200: gDarwinMajor = 12; gDarwinMinor =  2; gDarwinRev = 0; break; // 10.8.2
-			case 0xA080300: gDarwinMajor = 12; gDarwinMinor =  3; gDarwinRev = 0; break; // 10.8.3
-			case 0xA080400: gDarwinMajor = 12; gDarwinMinor =  4; gDarwinRev = 0; break; // 10.8.4
-			case 0xA080500: gDarwinMajor = 12; gDarwinMinor =  5; gDarwinRev = 0; break; // 10.8.5
-			// Mavericks
-			case 0xA090000: gDarwinMajor = 13; gDarwinMinor =  0; gDarwinRev = 0; break; // 10.9
-			case 0xA090100: gDarwinMajor = 13; gDarwinMinor =  1; gDarwinRev = 0; break; // 10.9.1
-			case 0xA090200: gDarwinMajor = 13; gDarwinMinor =  2; gDarwinRev = 0; break; // 10.9.2
-			case 0xA090300: gDarwinMajor = 13; gDarwinMinor =  3; gDarwinRev = 0; break; // 10.9.3
-			case 0xA090400: gDarwinMajor = 13; gDarwinMinor =  4; gDarwinRev = 0; break; // 10.9.4
-			case 0xA090500: gDarwinMajor = 13; gDarwinMinor =  5; gDarwinRev = 0; break; // 10.9.5
-			// Yosemite
-			case 0xA0A0000: gDarwinMajor = 14; gDarwinMinor =  0; gDarwinRev = 0; break; // 10.10
-			case 0xA0A0100: gDarwinMajor = 14; gDarwinMinor =  0; gDarwinRev = 0; break; // 10.10.1
-			case 0xA0A0200: gDarwinMajor = 14; gDarwinMinor =  2; gDarwinRev = 0; break; // 10.10.2
-			case 0xA0A0300: gDarwinMajor = 14; gDarwinMinor =  3; gDarwinRev = 0; break; // 10.10.3
-			case 0xA0A0400: gDarwinMajor = 14; gDarwinMinor =  4; gDarwinRev = 0; break; // 10.10.4
-			case 0xA0A0500: gDarwinMajor = 14; gDarwinMinor =  5; gDarwinRev = 0; break; // 10.10.5
-			// El Capitan
-			case 0xA0B0000: gDarwinMajor = 15; gDarwinMinor =  0; gDarwinRev = 0; break; // 10.11
-			case 0xA0B0100: gDarwinMajor = 15; gDarwinMinor =  1; gDarwinRev = 0; break; // 10.11.1
-			case 0xA0B0200: gDarwinMajor = 15; gDarwinMinor =  2; gDarwinRev = 0; break; // 10.11.2
-			case 0xA0B0300: gDarwinMajor = 15; gDarwinMinor =  3; gDarwinRev = 0; break; // 10.11.3
-			case 0xA0B0400: gDarwinMajor = 15; gDarwinMinor =  4; gDarwinRev = 0; break; // 10.11.4
-			case 0xA0B0500: gDarwinMajor = 15; gDarwinMinor =  5; gDarwinRev = 0; break; // 10.11.5
-			case 0xA0B0600: gDarwinMajor = 15; gDarwinMinor =  6; gDarwinRev = 0; break; // 10.11.6
-			// Sierra
-			case 0xA0C0000: gDarwinMajor = 16; gDarwinMinor =  0; gDarwinRev = 0; break; // 10.12
-			case 0xA0C0100: gDarwinMajor = 16; gDarwinMinor =  1; gDarwinRev = 0; break; // 10.12.1
-			case 0xA0C0200: gDarwinMajor = 16; gDarwinMinor =  3; gDarwinRev = 0; break; // 10.12.2
-			case 0xA0C0300: gDarwinMajor = 16; gDarwinMinor =  4; gDarwinRev = 0; break; // 10.12.3
-			case 0xA0C0400: gDarwinMajor = 16; gDarwinMinor =  5; gDarwinRev = 0; break; // 10.12.4
-			case 0xA0C0500: gDarwinMajor = 16; gDarwinMinor =  6; gDarwinRev = 0; break; // 10.12.5
-			case 0xA0C0600: gDarwinMajor = 16; gDarwinMinor =  7; gDarwinRev = 0; break; // 10.12.6
-//			case 0xA0C0700: gDarwinMajor = 16; gDarwinMinor =  x; gDarwinRev = x; break; // 10.12.7
-			// High Sierra
-			case 0xA0D0000: gDarwinMajor = 17; gDarwinMinor =  0; gDarwinRev = 0; break; // 10.13
-			case 0xA0D0100: gDarwinMajor = 17; gDarwinMinor =  1; gDarwinRev = 0; break; // 10.13.1
-			// Mojave
-
-			// default = last known kernel
-			default:        gDarwinMajor = 17; gDarwinMinor =  1; gDarwinRev = 0; break; // 10.13.1;
-		}
+		OSToDarwinVersion(MacOSVerCurrent);
 	}
 
 	// Notify modules that the kernel has been decompressed, thinned and is about to be decoded
@@ -6,52 +6,150 @@
 #include "boot.h"
 #include "graphic_utils.h"
 #include "gui.h"
+#include "platform.h"
+
+// Four pixels at a time; rows are not aligned.
+typedef uint32_t blend_u32x4 __attribute__((vector_size(16)));
+typedef uint32_t blend_u32x4u __attribute__((vector_size(16), aligned(1), may_alias));
+typedef char blend_s8x16 __attribute__((vector_size(16)));
+
+/* Blend one semi-transparent pixel over another */
+static inline uint32_t blendPixel(uint32_t src, uint32_t dst)
+{
+	uint32_t dstrb, dstag, srcrb, srcag, drb, dag, rb, ag, alpha;
+
+	alpha = src >> 24;
+
+	/* This is needed to spread the alpha over [0..256] instead of [0..255]
+	Boundary conditions are handled by the callers */
+	dstrb =  dst       & 0xFF00FF;
+	dstag = (dst >> 8) & 0xFF00FF;
+	srcrb =  src       & 0xFF00FF;
+	srcag = (src >> 8) & 0xFF00FF;
+	drb   = srcrb - dstrb;
+	dag   = srcag - dstag;
+	drb *= alpha; dag *= alpha;
+	drb >>= 8; dag >>= 8;
+	rb =  (drb + dstrb)       & 0x00FF00FF;
+	ag = ((dag + dstag) << 8) & 0xFF00FF00;
+	return (rb | ag);
+}
+
+/* Blend count pixels of a row, going by runs of equal kind */
+static void blendRowScalar(const pixel_t *src, pixel_t *dst, uint32_t count)
+{
+	uint32_t n;
+
+	while (count)
+	{
+		/* Skip fully transparent pixels */
+		for (n = 0; n < count && src[n].ch.a == 0; n++);
+		if (n)
+		{
+			src += n; dst += n; count -= n;
+			continue;
+		}
+
+		/* For fully opaque pixels, there is no need to interpolate */
+		for (n = 0; n < count && src[n].ch.a == 255; n++);
+		if (n)
+		{
+			memcpy(dst, src, n * sizeof(pixel_t));
+			src += n; dst += n; count -= n;
+			continue;
+		}
+
+		/* For semi-transparent pixels, do a full blend */
+		dst->value = blendPixel(src->value, dst->value);
+		src++; dst++; count--;
+	}
+}
+
+/* The same with SSE2: four pixels that are all transparent or all opaque
+   are skipped or stored at once, others are blended together with the
+   arithmetic of blendPixel() */
+static void blendRowSSE2(const pixel_t *src, pixel_t *dst, uint32_t count)
+{
+	const blend_u32x4 rbMask = { 0xFF00FF, 0xFF00FF, 0xFF00FF, 0xFF00FF };
+	const blend_u32x4 agMask = { 0xFF00FF00, 0xFF00FF00, 0xFF00FF00, 0xFF00FF00 };
+	const blend_u32x4 zero = { 0, 0, 0, 0 };
+	const blend_u32x4 opaque = { 255, 255, 255, 255 };
+	blend_u32x4 s, d, alpha, isClear, isOpaque, dstrb, dstag, drb, dag, result;
+	int clear, solid;
+
+	for (; count >= 4; count -= 4, src += 4, dst += 4)
+	{
+		s = *(const blend_u32x4u *)src;
+		alpha = s >> 24;
+		isClear = (blend_u32x4)(alpha == zero);
+		isOpaque = (blend_u32x4)(alpha == opaque);
+		clear = __builtin_ia32_pmovmskb128((blend_s8x16)isClear);
+		solid = __builtin_ia32_pmovmskb128((blend_s8x16)isOpaque);
+
+		if (clear == 0xFFFF)
+		{
+			continue;
+		}
+		if (solid == 0xFFFF)
+		{
+			*(blend_u32x4u *)dst = s;
+			continue;
+		}
+
+		d = *(blend_u32x4u *)dst;
+		dstrb =  d       & rbMask;
+		dstag = (d >> 8) & rbMask;
+		drb = (((s       & rbMask) - dstrb) * alpha) >> 8;
+		dag = ((((s >> 8) & rbMask) - dstag) * alpha) >> 8;
+		result = ((drb + dstrb) & rbMask) | (((dag + dstag) << 8) & agMask);
+
+		result = (result & ~isOpaque) | (s & isOpaque);
+		result = (result & ~isClear) | (d & isClear);
+		*(blend_u32x4u *)dst = result;
+	}
+
+	blendRowScalar(src, dst, count);
+}
 
 void blend( const pixmap_t *blendThis,		// Source image
 		pixmap_t *blendInto,		// Dest image
 		const position_t position)	// Where to place the source image
 {
-    uint16_t sx, sy, dx, dy;
-    uint32_t dstrb, dstag, srcrb, srcag, drb, dag, rb, ag, alpha;
-	
-	uint16_t width = (blendThis->width + position.x < blendInto->width) ? blendThis->width: blendInto->width-position.x;
-	uint16_t height = (blendThis->height + position.y < blendInto->height) ? blendThis->height: blendInto->height-position.y;
-	
-	for (dy = position.y, sy = 0; sy < height; dy++, sy++)
+	rect_t all = rect(0, 0, blendInto->width, blendInto->height);
+
+	blendClipped(blendThis, blendInto, position, &all);
+}
+
+void blendClipped( const pixmap_t *blendThis,
+		pixmap_t *blendInto,
+		const position_t position,
+		const rect_t *clip)
+{
+	void (*blendRow)(const pixel_t *, pixel_t *, uint32_t);
+	rect_t area;
+	uint32_t sy;
+
+	if (position.x >= blendInto->width || position.y >= blendInto->height)
 	{
-		for (dx = position.x, sx = 0; sx < width; dx++, sx++)
-		{
-			alpha = (pixel(blendThis, sx, sy).ch.a);
-
-			/* Skip blending for fully transparent pixel */
-			if (alpha == 0)
-			{
-				continue;
-			}
-
-			/* For fully opaque pixel, there is no need to interpolate */
-			if (alpha == 255)
-			{
-				pixel(blendInto, dx, dy).value = pixel(blendThis, sx, sy).value;
-				continue;
-			}
-
-			/* For semi-transparent pixels, do a full blend */
-			//alpha++
-			/* This is needed to spread the alpha over [0..256] instead of [0..255]
-			Boundary conditions were handled above */
-			dstrb =  pixel(blendInto, dx, dy).value       & 0xFF00FF;
-			dstag = (pixel(blendInto, dx, dy).value >> 8) & 0xFF00FF;
-			srcrb =  pixel(blendThis, sx, sy).value       & 0xFF00FF;
-			srcag = (pixel(blendThis, sx, sy).value >> 8) & 0xFF00FF;
-			drb   = srcrb - dstrb;
-			dag   = srcag - dstag;
-			drb *= alpha; dag *= alpha;
-			drb >>= 8; dag >>= 8;
-			rb =  (drb + dstrb)       & 0x00FF00FF;
-			ag = ((dag + dstag) << 8) & 0xFF00FF00;
-			pixel(blendInto, dx, dy).value = (rb | ag);
-		}
+		return;
+	}
+
+	area = rect(position.x, position.y,
+		(blendThis->width + position.x < blendInto->width) ? blendThis->width : blendInto->width - position.x,
+		(blendThis->height + position.y < blendInto->height) ? blendThis->height : blendInto->height - position.y);
+
+	if (!intersectRect(&area, clip))
+	{
+		return;
+	}
+
+	// Platform is scanned before the GUI starts; blend() may run earlier.
+	blendRow = (Platform.CPU.Features & CPU_FEATURE_SSE2) ? blendRowSSE2 : blendRowScalar;
+
+	for (sy = 0; sy < area.height; sy++)
+	{
+		blendRow(&pixel(blendThis, area.x - position.x, area.y - position.y + sy),
+			&pixel(blendInto, area.x, area.y + sy), area.width);
 	}
 }
 
@@ -72,6 +170,56 @@ position_t centeredAt( const pixmap_t *pixmap, const position_t center ) {
 
 position_t pos(const uint16_t x, const uint16_t y) { position_t p; p.x = x; p.y = y; return p; }
 
+rect_t rect(const uint32_t x, const uint32_t y, const uint32_t width, const uint32_t height)
+{
+	rect_t r;
+	r.x = x;
+	r.y = y;
+	r.width = width;
+	r.height = height;
+	return r;
+}
+
+void unionRect(rect_t *r, const rect_t *add)
+{
+	uint32_t right, bottom;
+
+	if (add->width == 0 || add->height == 0)
+	{
+		return;
+	}
+
+	if (r->width == 0 || r->height == 0)
+	{
+		*r = *add;
+		return;
+	}
+
+	right = MAX(r->x + r->width, add->x + add->width);
+	bottom = MAX(r->y + r->height, add->y + add->height);
+	r->x = MIN(r->x, add->x);
+	r->y = MIN(r->y, add->y);
+	r->width = right - r->x;
+	r->height = bottom - r->y;
+}
+
+bool intersectRect(rect_t *r, const rect_t *clip)
+{
+	uint32_t left = MAX(r->x, clip->x);
+	uint32_t top = MAX(r->y, clip->y);
+	uint32_t right = MIN(r->x + r->width, clip->x + clip->width);
+	uint32_t bottom = MIN(r->y + r->height, clip->y + clip->height);
+
+	if (right <= left || bottom <= top)
+	{
+		*r = rect(0, 0, 0, 0);
+		return false;
+	}
+
+	*r = rect(left, top, right - left, bottom - top);
+	return true;
+}
+
 void flipRB(pixmap_t *p)
 {
 	//if(testForQemu()) return;
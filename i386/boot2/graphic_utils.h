@@ -34,6 +34,13 @@ typedef struct {
     uint32_t y;
 } position_t;
 
+typedef struct {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+} rect_t;
+
 // Blends the given pixmap into the given background at the given position
 // Uses the alpha channels to blend, and preserves the final alpha (so the
 // resultant pixmap can be blended again with another background).
@@ -41,6 +48,12 @@ typedef struct {
 void blend( const pixmap_t *blendThis,            // Source image
             pixmap_t *blendInto,                  // Dest image
             const position_t position);         // Where to place the source image
+
+// Same as blend(), but only touches the part of blendInto inside clip.
+void blendClipped( const pixmap_t *blendThis,
+                   pixmap_t *blendInto,
+                   const position_t position,
+                   const rect_t *clip );
 // Returns the topleft co-ordinate where if you put the 'toCenter' pixmap,
 // it is centered in the background.
 position_t centeredIn( const pixmap_t *background, const pixmap_t *toCenter );
@@ -52,6 +65,15 @@ position_t centeredAt( const pixmap_t *pixmap, const position_t center );
 // Utility function returns a position_t struct given the x and y coords as uint16
 position_t pos(const uint16_t x, const uint16_t y);
 
+// Utility function returns a rect_t struct given its origin and size
+rect_t rect(const uint32_t x, const uint32_t y, const uint32_t width, const uint32_t height);
+
+// Grows r to the bounding box of r and add; empty rects are ignored
+void unionRect(rect_t *r, const rect_t *add);
+
+// Shrinks r to its overlap with clip; returns false (and empties r) if none
+bool intersectRect(rect_t *r, const rect_t *clip);
+
 // Flips the R and B components of all pixels in the given pixmap
 void flipRB(pixmap_t *p);
 
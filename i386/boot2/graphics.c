@@ -30,6 +30,7 @@
 #include "appleClut8.h"
 #include "gui.h"
 #include "IOHibernatePrivate.h"
+#include "platform.h"
 
 /*
  * for spinning disk
@@ -404,6 +405,152 @@ char *decodeRLE( const void *rleData, int rleBlocks, int outBytes )
     return out;
 }
 
+//==========================================================================
+// VRAM row writers
+//
+// Each converts a row of 32 bit pixels (blue, green, red, unused) to the
+// frame buffer format of one depth. setVESAGraphicsMode() picks the one for
+// the mode it sets, so the drawing loops need not look at the depth per
+// pixel. Frame buffer rows are not aligned at 24 bits per pixel.
+
+typedef uint32_t vram_u32 __attribute__((aligned(1), may_alias));
+typedef uint32_t vram_u32x4 __attribute__((vector_size(16)));
+typedef uint32_t vram_u32x4u __attribute__((vector_size(16), aligned(1), may_alias));
+typedef int32_t vram_s32x4 __attribute__((vector_size(16)));
+typedef int16_t vram_s16x8 __attribute__((vector_size(16)));
+typedef int16_t vram_s16x8u __attribute__((vector_size(16), aligned(1), may_alias));
+
+static vram_writer_t vramWriter = 0;
+static int vramWriterDepth = 0;
+
+static void writeRow32(void *dst, const pixel_t *src, uint32_t count)
+{
+	memcpy(dst, src, count * 4);
+}
+
+static void writeRow24(void *dst, const pixel_t *src, uint32_t count)
+{
+	const uint32_t *s = (const uint32_t *)src;
+	uint8_t *d = dst;
+
+	// Four pixels make three words.
+	for (; count >= 4; count -= 4, s += 4, d += 12)
+	{
+		((vram_u32 *)d)[0] = (s[0] & 0xffffff) | (s[1] << 24);
+		((vram_u32 *)d)[1] = ((s[1] >> 8) & 0xffff) | (s[2] << 16);
+		((vram_u32 *)d)[2] = ((s[2] >> 16) & 0xff) | (s[3] << 8);
+	}
+
+	for (; count; count--, s++, d += 3)
+	{
+		d[0] = *s;
+		d[1] = *s >> 8;
+		d[2] = *s >> 16;
+	}
+}
+
+static void writeRow16(void *dst, const pixel_t *src, uint32_t count)
+{
+	uint16_t *d = dst;
+
+	for (; count; count--, src++, d++)
+	{
+		*d = ((src->value >> 8) & 0xf800) | ((src->value >> 5) & 0x07e0) | ((src->value >> 3) & 0x001f);
+	}
+}
+
+static void writeRow15(void *dst, const pixel_t *src, uint32_t count)
+{
+	uint16_t *d = dst;
+
+	for (; count; count--, src++, d++)
+	{
+		*d = ((src->value >> 9) & 0x7c00) | ((src->value >> 6) & 0x03e0) | ((src->value >> 3) & 0x001f);
+	}
+}
+
+// The same with SSE2, eight pixels at a time. packssdw saturates, so the
+// 16 bit results are sign extended first to come through unchanged.
+
+static inline vram_s16x8 packRow16(vram_u32x4 a, vram_u32x4 b, int redShift, int greenShift, uint32_t greenMask, uint32_t redMask)
+{
+	const vram_u32x4 blueMask = { 0x1f, 0x1f, 0x1f, 0x1f };
+	vram_u32x4 gm = { greenMask, greenMask, greenMask, greenMask };
+	vram_u32x4 rm = { redMask, redMask, redMask, redMask };
+
+	a = ((a >> redShift) & rm) | ((a >> greenShift) & gm) | ((a >> 3) & blueMask);
+	b = ((b >> redShift) & rm) | ((b >> greenShift) & gm) | ((b >> 3) & blueMask);
+
+	return __builtin_ia32_packssdw128((vram_s32x4)(a << 16) >> 16, (vram_s32x4)(b << 16) >> 16);
+}
+
+static void writeRow16SSE2(void *dst, const pixel_t *src, uint32_t count)
+{
+	vram_s16x8u *d = dst;
+
+	for (; count >= 8; count -= 8, src += 8, d++)
+	{
+		*d = packRow16(*(const vram_u32x4u *)src, *(const vram_u32x4u *)(src + 4), 8, 5, 0x07e0, 0xf800);
+	}
+
+	writeRow16(d, src, count);
+}
+
+static void writeRow15SSE2(void *dst, const pixel_t *src, uint32_t count)
+{
+	vram_s16x8u *d = dst;
+
+	for (; count >= 8; count -= 8, src += 8, d++)
+	{
+		*d = packRow16(*(const vram_u32x4u *)src, *(const vram_u32x4u *)(src + 4), 9, 6, 0x03e0, 0x7c00);
+	}
+
+	writeRow15(d, src, count);
+}
+
+//==========================================================================
+// Pick the row writer for a depth; 16 bit modes with a 5 bit green mask are
+// really 15 bit. Returns 0 for depths the GUI can't draw in.
+
+static vram_writer_t selectVRAMWriter(int depth, int greenMaskSize)
+{
+	bool sse2 = (Platform.CPU.Features & CPU_FEATURE_SSE2) != 0;
+
+	vramWriterDepth = depth;
+
+	switch (depth)
+	{
+		case 32:
+			return writeRow32;
+		case 24:
+			return writeRow24;
+		case 16:
+			if (greenMaskSize == 6)
+			{
+				return sse2 ? writeRow16SSE2 : writeRow16;
+			}
+			// fall through
+		case 15:
+			return sse2 ? writeRow15SSE2 : writeRow15;
+		default:
+			return 0;
+	}
+}
+
+//==========================================================================
+// getVRAMWriter
+
+vram_writer_t getVRAMWriter(void)
+{
+	if (VIDEO(depth) != vramWriterDepth)
+	{
+		// Not set by setVESAGraphicsMode(); take 16 bits as 15, as before.
+		vramWriter = selectVRAMWriter(VIDEO(depth), 5);
+	}
+
+	return vramWriter;
+}
+
 //==========================================================================
 // setVESAGraphicsMode
 
@@ -472,6 +619,8 @@ static int setVESAGraphicsMode( unsigned short width, unsigned short height, uns
 		bootArgs->Video.v_rowBytes	= minfo.BytesPerScanline;	/* 7680 or 6400 */
 		bootArgs->Video.v_baseAddr	= VBEMakeUInt32(minfo.PhysBasePtr);
 
+		vramWriter = selectVRAMWriter(minfo.BitsPerPixel, minfo.GreenMaskSize);
+
 	} while ( 0 );
 
 	return err;
@@ -483,28 +632,21 @@ int convertImage( unsigned short width, unsigned short height, const unsigned ch
 {
 	int index = 0;
 	int size = (width * height); // 16384
-	int depth = VIDEO(depth);
 
 	unsigned char *img = 0;
 	unsigned long *img32;
 
-	switch (depth)
-	{
-		case 32:
-			img32 = malloc(size * 4);
+	// Always 32 bit; drawDataRectangle() converts to the frame buffer depth.
+	img32 = malloc(size * 4);
 
-			if (!img32)
-			{
-				break;
-			}
-
-			for (; index < size; index++)
-			{
-				img32[index] = lookUpCLUTIndex(imageData[index]);
-			}
+	if (img32)
+	{
+		for (; index < size; index++)
+		{
+			img32[index] = lookUpCLUTIndex(imageData[index]);
+		}
 
-			img = (unsigned char *)img32;
-			break;
+		img = (unsigned char *)img32;
 	}
 
 	*newImageData = img;
@@ -788,23 +930,31 @@ void setBackgroundColor( uint32_t color )
 
 //==========================================================================
 // drawDataRectangle
+//
+// data holds width * height 32 bit pixels, as made by convertImage().
 
 void drawDataRectangle( unsigned short  x, unsigned short  y, unsigned short  width, unsigned short  height, unsigned char   *data )
 {
+	vram_writer_t writeRow = getVRAMWriter();
 	unsigned short drawWidth;
 
-	long   pixelBytes = VIDEO(depth) / 8;
+	long   pixelBytes = (VIDEO(depth) + 7) / 8;
 
 	unsigned char * vram   = (unsigned char *) VIDEO(baseAddr) + VIDEO(rowBytes) * y + pixelBytes * x;
 
+	if (!writeRow || !data || x >= VIDEO(width) || y >= VIDEO(height))
+	{
+		return;
+	}
+
 	drawWidth = MIN(width, VIDEO(width) - x);
 	height = MIN(height, VIDEO(height) - y);
 
 	while ( height-- )
 	{
-		bcopy( data, vram, width * pixelBytes );
+		writeRow( vram, (const pixel_t *)data, drawWidth );
 		vram += VIDEO(rowBytes);
-		data += width * pixelBytes;
+		data += width * 4;
 	}
 }
 
@@ -858,14 +1008,51 @@ void loadImageScale (void *input, int iw, int ih, int ip, void *output, int ow,
 
 DECLARE_IOHIBERNATEPROGRESSALPHA
 
+//==============================================================================
+// Top left corner of the hibernation progress bar.
+
+static uint8_t *progressBarOrigin(uint32_t pixelBytes)
+{
+	return (uint8_t *) VIDEO (baseAddr)
+		+ ((VIDEO (width) - kIOHibernateProgressCount * (kIOHibernateProgressWidth + kIOHibernateProgressSpacing)) / 2) * pixelBytes
+		+ (VIDEO (height) - kIOHibernateProgressOriginY - kIOHibernateProgressHeight) * VIDEO (rowBytes);
+}
+
+//==============================================================================
+// Write line y of one progress blob to out, leaving the pixels outside its
+// shape alone.
+
+static void writeProgressRow(vram_writer_t writeRow, uint8_t *out, uint32_t pixelBytes, const pixel_t *row, uint32_t y)
+{
+	uint32_t x, n;
+
+	for (x = 0; x < kIOHibernateProgressWidth; x += n)
+	{
+		for (n = 0; x + n < kIOHibernateProgressWidth && gIOHibernateProgressAlpha[y][x + n] == 0; n++);
+
+		if (n)
+		{
+			continue;
+		}
+
+		for (n = 0; x + n < kIOHibernateProgressWidth && gIOHibernateProgressAlpha[y][x + n] != 0; n++);
+
+		writeRow(out + x * pixelBytes, row + x, n);
+	}
+}
+
+//==============================================================================
+
 void drawPreview(void *src, uint8_t *saveunder)
 {
 	uint8_t    *screen;
-	uint32_t   rowBytes, pixelShift;
+	uint32_t   rowBytes, pixelBytes;
 	uint32_t   x, y;
 	int32_t    blob;
 	uint32_t   alpha, in, color, result;
 	uint8_t    *out;
+	pixel_t    row[kIOHibernateProgressWidth];
+	vram_writer_t writeRow;
 	void       *uncomp;
 	int origwidth, origheight, origbpx;
 	uint32_t   saveindex[kIOHibernateProgressCount] = { 0 };
@@ -904,15 +1091,14 @@ void drawPreview(void *src, uint8_t *saveunder)
 		}
 	}
 
-	pixelShift = VIDEO (depth) >> 4;
-	if (pixelShift < 1)
+	writeRow = getVRAMWriter();
+	if (!writeRow)
 	{
 		return;
 	}
 
-	screen += ((VIDEO (width) 
-				- kIOHibernateProgressCount * (kIOHibernateProgressWidth + kIOHibernateProgressSpacing)) << (pixelShift - 1))
-	+ (VIDEO (height) - kIOHibernateProgressOriginY - kIOHibernateProgressHeight) * rowBytes;
+	pixelBytes = (VIDEO (depth) + 7) / 8;
+	screen = progressBarOrigin(pixelBytes);
 
 	for (y = 0; y < kIOHibernateProgressHeight; y++)
 	{
@@ -928,33 +1114,24 @@ void drawPreview(void *src, uint8_t *saveunder)
 				{
 					if (0xff != alpha)
 					{
-						if (1 == pixelShift)
+						if (2 == pixelBytes)
 						{
-							in = *((uint16_t *)out) & 0x1f;	// 16
+							in = *((uint16_t *)(out + x * 2)) & 0x1f;	// 15/16
 							in = (in << 3) | (in >> 2);
 						}
 						else
 						{
-							in = *((uint32_t *)out) & 0xff;	// 32
+							in = out[x * pixelBytes];	// 24/32
 						}
 
 						saveunder[blob * kIOHibernateProgressSaveUnderSize + saveindex[blob]++] = in;
 						result = ((255 - alpha) * in + alpha * result + 0xff) >> 8;
 					}
-					if (1 == pixelShift)
-					{
-						result >>= 3;
-						*((uint16_t *)out) = (result << 10) | (result << 5) | result;	// 16
-					}
-					else
-					{
-						*((uint32_t *)out) = (result << 16) | (result << 8) | result;	// 32
-					}
-
+					row[x].value = (result << 16) | (result << 8) | result;
 				}
-				out += (1 << pixelShift);
 			}
-			out += (kIOHibernateProgressSpacing << pixelShift);
+			writeProgressRow(writeRow, out, pixelBytes, row, y);
+			out += (kIOHibernateProgressWidth + kIOHibernateProgressSpacing) * pixelBytes;
 		}
 	}
 }
@@ -964,25 +1141,25 @@ void drawPreview(void *src, uint8_t *saveunder)
 void updateProgressBar(uint8_t *saveunder, int32_t firstBlob, int32_t select)
 {
 	uint8_t		*screen;
-	uint32_t	rowBytes, pixelShift;
+	uint32_t	rowBytes, pixelBytes;
 	uint32_t	x, y;
 	int32_t		blob, lastBlob;
 	uint32_t	alpha, in, color, result;
 	uint8_t		*out;
+	pixel_t		row[kIOHibernateProgressWidth];
+	vram_writer_t	writeRow;
 	uint32_t  saveindex[kIOHibernateProgressCount] = { 0 };
 
-	pixelShift = VIDEO(depth) >> 4;
-	if (pixelShift < 1) return;
-	screen = (uint8_t *) VIDEO (baseAddr);
+	writeRow = getVRAMWriter();
+	if (!writeRow) return;
+	pixelBytes = (VIDEO (depth) + 7) / 8;
 	rowBytes = VIDEO (rowBytes);
 
-	screen += ((VIDEO (width) 
-				- kIOHibernateProgressCount * (kIOHibernateProgressWidth + kIOHibernateProgressSpacing)) << (pixelShift - 1))
-	+ (VIDEO (height) - kIOHibernateProgressOriginY - kIOHibernateProgressHeight) * rowBytes;
+	screen = progressBarOrigin(pixelBytes);
 
 	lastBlob  = (select < kIOHibernateProgressCount) ? select : (kIOHibernateProgressCount - 1);
 
-	screen += (firstBlob * (kIOHibernateProgressWidth + kIOHibernateProgressSpacing)) << pixelShift;
+	screen += firstBlob * (kIOHibernateProgressWidth + kIOHibernateProgressSpacing) * pixelBytes;
 
 	for (y = 0; y < kIOHibernateProgressHeight; y++)
 	{
@@ -1002,19 +1179,11 @@ void updateProgressBar(uint8_t *saveunder, int32_t firstBlob, int32_t select)
 						result = ((255 - alpha) * in + alpha * result + 0xff) / 255;
 					}
 
-					if (1 == pixelShift)
-					{
-						result >>= 3;
-						*((uint16_t *)out) = (result << 10) | (result << 5) | result;	// 16
-					}
-					else
-					{
-						*((uint32_t *)out) = (result << 16) | (result << 8) | result;	// 32
-					}
+					row[x].value = (result << 16) | (result << 8) | result;
 				}
-				out += (1 << pixelShift);
 			}
-			out += (kIOHibernateProgressSpacing << pixelShift);
+			writeProgressRow(writeRow, out, pixelBytes, row, y);
+			out += (kIOHibernateProgressWidth + kIOHibernateProgressSpacing) * pixelBytes;
 		}
 	}
 }
@@ -1146,6 +1315,9 @@ void setVideoMode( int mode )
 		{
 			// Tell the kernel to use text mode on a linear frame buffer display
 			bootArgs->Video.v_display = (gVerboseMode) ? /* 2 */ FB_TEXT_MODE : /* 1 */ GRAPHICS_MODE;
+
+			// The mode set cleared the screen.
+			invalidateVRAM();
 		}
 	}
 
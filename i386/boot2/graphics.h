@@ -22,6 +22,11 @@ int loadPngImage(const char *filename, uint16_t *width, uint16_t *height, uint8_
 
 unsigned long lookUpCLUTIndex( unsigned char index );
 
+// Converts count pixels of a row to the frame buffer format at dst
+typedef void (*vram_writer_t)(void *dst, const pixel_t *src, uint32_t count);
+
+vram_writer_t getVRAMWriter(void);
+
 void setBackgroundColor( uint32_t color );
 void drawDataRectangle( unsigned short x, unsigned short y, unsigned short width, unsigned short height, unsigned char * data );
 int convertImage( unsigned short width, unsigned short height, const unsigned char *imageData, unsigned char **newImageData );
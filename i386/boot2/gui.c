@@ -13,6 +13,7 @@
 #include "term.h"
 #include "appleboot.h"
 #include "vers.h"
+#include "themepack.h"
 
 #if DEBUG_GUI
 	#define DBG(x...)	printf(x)
@@ -30,6 +31,8 @@ static const char *theme_name = THEME_NAME_DEFAULT;
 
 #define LOADPNG(img, alt_img) if (loadThemeImage(#img, alt_img) != 0) { return 1; }
 
+#define THEME_DIR_BATCH 32 // directory entries read at a time when checking a theme pack
+
 #define VIDEO(x) (bootArgs->Video.v_ ## x)
 
 #define vram VIDEO(baseAddr)
@@ -323,6 +326,9 @@ int  destroyFont(font_t *font);
 void colorFont(font_t *font, uint32_t color);
 void makeRoundedCorners(pixmap_t *p);
 
+static void damageWindow(window_t *window);
+static void drawPixmap(const pixmap_t *pm, pixmap_t *blendInto, position_t p);
+
 static int infoMenuSelection = 0;
 static int infoMenuItemsCount = sizeof(infoMenuItems)/sizeof(infoMenuItems[0]);
 
@@ -378,6 +384,152 @@ static int getEmbeddedImageIndexByName(const char *name)
 }
 #endif
 
+// ====================================================================
+
+// The current theme pack, read whole; its images are used in place.
+static char *themePack = NULL;
+
+static ThemePackImage *getThemePackImage(const char *name, int length)
+{
+	ThemePackHeader *header = (ThemePackHeader *)themePack;
+	ThemePackImage *packImages = (ThemePackImage *)(themePack + sizeof(ThemePackHeader));
+	int lowerLimit = 0;
+	int upperLimit = header->numImages - 1;
+	int compareIndex;
+	int result;
+
+	// The pack keeps its images sorted by name without .png, the key used
+	// here; themepack's compareNames() must keep that order.
+	while (lowerLimit <= upperLimit)
+	{
+		compareIndex = (lowerLimit + upperLimit) >> 1;
+		result = strncmp(name, packImages[compareIndex].name, length);
+		if (result == 0 && packImages[compareIndex].name[length] != '\0')
+		{
+			result = -1; // name is a prefix of this one
+		}
+		if (result == 0)
+		{
+			return &packImages[compareIndex];
+		}
+		if (result > 0)
+		{
+			lowerLimit = compareIndex + 1;
+		}
+		else
+		{
+			upperLimit = compareIndex - 1;
+		}
+	}
+	return NULL;
+}
+
+static bool isThemePackCurrent(const char *dirspec)
+{
+	ThemePackHeader	*header = (ThemePackHeader *)themePack;
+	ThemePackImage	*image;
+	FSDirEntry	*entries;
+	long long	dirIndex = 0;
+	long		count, i, length;
+	unsigned long	found = 0;
+	bool		plistFound = false;
+	bool		current = true;
+
+	if (!(entries = malloc(THEME_DIR_BATCH * sizeof(FSDirEntry))))
+	{
+		return false;
+	}
+
+	// theme.plist and every PNG file must carry the recorded time, and
+	// no PNG file may be missing from the pack.
+	while (current && (count = GetDirEntries(dirspec, &dirIndex, entries, THEME_DIR_BATCH)) > 0)
+	{
+		for (i = 0; i < count && current; i++)
+		{
+			length = strlen(entries[i].name);
+
+			if (strcmp(entries[i].name, "theme.plist") == 0)
+			{
+				plistFound = true;
+				current = (entries[i].time == header->plistTime);
+			}
+			else if (length > 4 && strcmp(entries[i].name + length - 4, ".png") == 0)
+			{
+				image = (length - 4 < kThemePackNameLen) ? getThemePackImage(entries[i].name, length - 4) : NULL;
+				current = (image != NULL && image->time == entries[i].time);
+				found++;
+			}
+		}
+	}
+
+	free(entries);
+
+	return current && plistFound && found == header->numImages;
+}
+
+// Load /Extra/Themes/<theme>/theme.pack, written by the themepack utility,
+// with one read. Returns 1 when there is none or it no longer matches the
+// files of the theme folder; the theme is then loaded from those files.
+static int loadThemePack(void)
+{
+	ThemePackHeader	header;
+	ThemePackImage	*packImages;
+	char		dirspec[256];
+	unsigned long	i, length;
+	int		fd;
+
+	if ((strlen(theme_name) + 27) > sizeof(dirspec)) {
+		return 1;
+	}
+	sprintf(dirspec, "/Extra/Themes/%s/%s", theme_name, kThemePackFileName);
+	if ((fd = open(dirspec, 0)) < 0) {
+		return 1;
+	}
+	if (read(fd, (char *)&header, sizeof(header)) != sizeof(header)
+		|| header.magic != kThemePackMagic || header.version != kThemePackVersion
+		|| header.length < sizeof(header)
+		|| !(themePack = malloc(header.length))) {
+		close(fd);
+		return 1;
+	}
+	memcpy(themePack, &header, sizeof(header));
+	length = header.length - sizeof(header);
+	if (read(fd, themePack + sizeof(header), length) != (int)length) {
+		close(fd);
+		goto failed;
+	}
+	close(fd);
+
+	// Check the bounds of everything the GUI will use.
+	if (header.numImages > length / sizeof(ThemePackImage)
+		|| header.plistOffset >= header.length || header.plistLength >= header.length - header.plistOffset
+		|| header.plistLength >= IO_CONFIG_DATA_SIZE || themePack[header.plistOffset + header.plistLength] != '\0') {
+		goto damaged;
+	}
+	packImages = (ThemePackImage *)(themePack + sizeof(header));
+	for (i = 0; i < header.numImages; i++) {
+		if (packImages[i].name[kThemePackNameLen - 1] != '\0' || (packImages[i].offset & 3)
+			|| packImages[i].offset > header.length
+			|| (unsigned long long)packImages[i].width * packImages[i].height * 4 > header.length - packImages[i].offset) {
+			goto damaged;
+		}
+	}
+
+	sprintf(dirspec, "/Extra/Themes/%s", theme_name);
+	if (!isThemePackCurrent(dirspec)) {
+		DBG("Theme pack of %s is stale.\n", theme_name);
+		goto failed;
+	}
+	return 0;
+
+damaged:
+	DBG("Theme pack of %s is damaged.\n", theme_name);
+failed:
+	free(themePack);
+	themePack = NULL;
+	return 1;
+}
+
 static int loadThemeImage(const char *image, int alt_image)
 {
 	char		dirspec[256];
@@ -388,6 +540,7 @@ static int loadThemeImage(const char *image, int alt_image)
 	uint16_t	width;
 	uint16_t	height;
 	uint8_t		*imagedata;
+	ThemePackImage	*packImage;
 
 	if ((strlen(image) + strlen(theme_name) + 20) > sizeof(dirspec)) {
 		return 1;
@@ -398,6 +551,13 @@ static int loadThemeImage(const char *image, int alt_image)
 	if (!images[i].image && !(images[i].image = malloc(sizeof(pixmap_t)))) {
 		return 1;
 	}
+	// The pack holds the pixels ready to draw.
+	if (themePack && (packImage = getThemePackImage(image, strlen(image)))) {
+		images[i].image->width = packImage->width;
+		images[i].image->height = packImage->height;
+		images[i].image->pixels = (pixel_t *)(themePack + packImage->offset);
+		return 0;
+	}
 	sprintf(dirspec, "/Extra/Themes/%s/%s.png", theme_name, image);
 	width = 0;
 	height = 0;
@@ -589,13 +749,18 @@ static int unloadGraphics(void)
 	destroyFont(&font_small);
 	for (i = 0; i < sizeof(images) / sizeof(images[0]); i++) {
 		if (images[i].image) {
-			if (images[i].image->pixels) {
+			if (images[i].image->pixels && !(themePack && (char *)images[i].image->pixels >= themePack
+				&& (char *)images[i].image->pixels < themePack + ((ThemePackHeader *)themePack)->length)) {
 				free(images[i].image->pixels);
 			}
 			free (images[i].image);
 			images[i].image = 0;
 	    }
 	}
+	if (themePack) {
+		free(themePack);
+		themePack = NULL;
+	}
 	return 0;
 }
 
@@ -739,6 +904,9 @@ void drawBackground()
 	}
 	
 	memcpy( gui.backbuffer->pixels, gui.screen.pixmap->pixels, gui.backbuffer->width * gui.backbuffer->height * 4 );
+	gui.scribble = rect(0, 0, 0, 0);
+
+	invalidateVRAM();
 }
 
 // ====================================================================
@@ -1033,7 +1201,14 @@ int initGUI(void)
 		return 1;
 	}
 	sprintf(dirspec, "/Extra/Themes/%s/theme.plist", theme_name);
-	if (loadConfigFile(dirspec, &bootInfo->themeConfig) != 0) {
+	if (loadThemePack() == 0) {
+		// theme.plist comes with the pack
+		ThemePackHeader *header = (ThemePackHeader *)themePack;
+
+		memcpy(bootInfo->themeConfig.plist, themePack + header->plistOffset, header->plistLength + 1);
+		ParseXMLFile(bootInfo->themeConfig.plist, &bootInfo->themeConfig.dictionary);
+	}
+	else if (loadConfigFile(dirspec, &bootInfo->themeConfig) != 0) {
 #ifdef CONFIG_EMBED_THEME
 	config_file_t	*config;
     
@@ -1092,8 +1267,6 @@ int initGUI(void)
 							{
 								gui.logo.draw = true;
 								drawBackground();
-								// lets copy the screen into the back buffer
-								memcpy( gui.backbuffer->pixels, gui.screen.pixmap->pixels, gui.backbuffer->width * gui.backbuffer->height * 4 );
 
 								setVideoMode( GRAPHICS_MODE );
 
@@ -1237,12 +1410,12 @@ void drawDeviceIcon(BVRef device, pixmap_t *buffer, position_t p, bool isSelecte
 	// Draw the selection image and use the next (device_*_o) image for the selected item.
 	if (isSelected)
 	{
-		blend(images[iSelection].image, buffer, centeredAt(images[iSelection].image, p));
+		drawPixmap(images[iSelection].image, buffer, centeredAt(images[iSelection].image, p));
 		devicetype++; // select override image 
 	}
 
 	// draw icon
-	blend(images[devicetype].image, buffer, centeredAt(images[devicetype].image, p));
+	drawPixmap(images[devicetype].image, buffer, centeredAt(images[devicetype].image, p));
 	
 	p.y += (images[iSelection].image->height / 2) + font_console.chars[0]->height;
 	
@@ -1263,6 +1436,7 @@ void drawDeviceList (int start, int end, int selection)
 	//uint8_t	maxDevices = MIN( gui.maxdevices, menucount );
 
 	fillPixmapWithColor( gui.devicelist.pixmap, gui.devicelist.bgcolor);
+	damageWindow(&gui.devicelist);
 
 	makeRoundedCorners( gui.devicelist.pixmap);
 
@@ -1385,6 +1559,7 @@ void clearGraphicBootPrompt()
 void updateGraphicBootPrompt()
 {
 	fillPixmapWithColor( gui.bootprompt.pixmap, gui.bootprompt.bgcolor);
+	damageWindow(&gui.bootprompt);
 
 	makeRoundedCorners( gui.bootprompt.pixmap);
 
@@ -1409,45 +1584,55 @@ void updateGraphicBootPrompt()
 
 // ====================================================================
 
-static inline void vramwrite (void *data, int width, int height)
+// Layers updateVRAM() composites over the back buffer, bottom first.
+static window_t * const layers[] = { &gui.devicelist, &gui.bootprompt, &gui.menu, &gui.infobox };
+
+#define LAYER_COUNT	(sizeof(layers) / sizeof(layers[0]))
+
+// ====================================================================
+
+static void damageWindow(window_t *window)
 {
-	extern void* memcpy_interruptible(void*, const void*, size_t);
-	if (VIDEO (depth) == 32 && VIDEO (rowBytes) == gui.backbuffer->width * 4)
+	window->damaged = true;
+}
+
+// ====================================================================
+// Record that blendInto changed in the given area. The back buffer is kept
+// equal to the screen pixmap, apart from the text dprintf and vprf draw
+// straight into it, so changes to the screen pixmap are copied over at once.
+
+static void damagePixmap(pixmap_t *blendInto, position_t p, uint32_t width, uint32_t height)
+{
+	rect_t	area = rect(p.x, p.y, width, height);
+	rect_t	bounds = rect(0, 0, blendInto->width, blendInto->height);
+	int	i;
+
+	if (blendInto == gui.screen.pixmap)
+	{
+		if (intersectRect(&area, &bounds))
+		{
+			for (i = 0; i < area.height; i++)
+			{
+				memcpy(&pixel(gui.backbuffer, area.x, area.y + i), &pixel(gui.screen.pixmap, area.x, area.y + i), area.width * 4);
+			}
+			unionRect(&gui.damage, &area);
+		}
+	}
+	else if (blendInto == gui.backbuffer)
 	{
-		memcpy_interruptible((uint8_t *)vram, gui.backbuffer->pixels, VIDEO (rowBytes)*VIDEO (height));
+		if (intersectRect(&area, &bounds))
+		{
+			unionRect(&gui.scribble, &area);
+			unionRect(&gui.damage, &area);
+		}
 	}
 	else
 	{
-		uint32_t r;
-		uint32_t g;
-		uint32_t b;
-		int i, j;
-		for (i = 0; i < VIDEO (height); i++)
+		for (i = 0; i < LAYER_COUNT; i++)
 		{
-			for (j = 0; j < VIDEO (width); j++)
+			if (blendInto == layers[i]->pixmap)
 			{
-				b = ((uint8_t *) data)[4*i*width + 4*j];
-				g = ((uint8_t *) data)[4*i*width + 4*j + 1];
-				r = ((uint8_t *) data)[4*i*width + 4*j + 2];
-				switch (VIDEO (depth))
-				{
-					case 32:
-						*(uint32_t *)(((uint8_t *)vram)+i*VIDEO (rowBytes) + j*4) = (b&0xff) | ((g&0xff)<<8) | ((r&0xff)<<16);
-						break;
-					case 24:
-						*(uint32_t *)(((uint8_t *)vram)+i*VIDEO (rowBytes) + j*3) = ((*(uint32_t *)(((uint8_t *)vram)+i*VIDEO (rowBytes) + j*3))&0xff000000)
-						| (b&0xff) | ((g&0xff)<<8) | ((r&0xff)<<16);
-						break;
-					case 16:
-						// Somehow 16-bit is always 15-bits really
-						//						*(uint16_t *)(((uint8_t *)vram)+i*VIDEO (rowBytes) + j*2) = ((b&0xf8)>>3) | ((g&0xfc)<<3) | ((r&0xf8)<<8);
-						//						break;							
-					case 15:
-						*(uint16_t *)(((uint8_t *)vram)+i*VIDEO (rowBytes) + j*2) = ((b&0xf8)>>3) | ((g&0xf8)<<2) | ((r&0xf8)<<7);
-						break;	
-					default:
-						break;
-				}
+				damageWindow(layers[i]);
 			}
 		}
 	}
@@ -1455,37 +1640,129 @@ static inline void vramwrite (void *data, int width, int height)
 
 // ====================================================================
 
-void updateVRAM()
+static void drawPixmap(const pixmap_t *pm, pixmap_t *blendInto, position_t p)
 {
-	if (gui.redraw)
+	blend(pm, blendInto, p);
+	damagePixmap(blendInto, p, pm->width, pm->height);
+}
+
+// ====================================================================
+
+static inline void vramwrite (const rect_t *area)
+{
+	extern void* memcpy_interruptible(void*, const void*, size_t);
+	vram_writer_t writeRow = getVRAMWriter();
+	uint8_t *row = (uint8_t *)vram + area->y * VIDEO (rowBytes) + area->x * ((VIDEO (depth) + 7) / 8);
+	int i;
+
+	if (VIDEO (depth) == 32 && VIDEO (rowBytes) == gui.backbuffer->width * 4 && area->width == gui.backbuffer->width)
 	{
-		if (gui.devicelist.draw)
+		memcpy_interruptible(row, &pixel(gui.backbuffer, 0, area->y), VIDEO (rowBytes) * area->height);
+	}
+	else if (VIDEO (depth) == 32)
+	{
+		for (i = 0; i < area->height; i++, row += VIDEO (rowBytes))
 		{
-			blend( gui.devicelist.pixmap, gui.backbuffer, gui.devicelist.pos );
+			memcpy_interruptible(row, &pixel(gui.backbuffer, area->x, area->y + i), area->width * 4);
 		}
-		if (gui.bootprompt.draw)
+	}
+	else if (writeRow)
+	{
+		for (i = 0; i < area->height; i++, row += VIDEO (rowBytes))
 		{
-			blend( gui.bootprompt.pixmap, gui.backbuffer, gui.bootprompt.pos );
+			writeRow(row, &pixel(gui.backbuffer, area->x, area->y + i), area->width);
 		}
-		if (gui.menu.draw)
+	}
+}
+
+// ====================================================================
+// Composite and flush only what changed since the last call: gui.damage,
+// plus every layer that was redrawn, moved, shown or hidden. Without
+// gui.redraw no layer is shown, as before.
+
+void updateVRAM()
+{
+	rect_t	screen = rect(0, 0, MIN(gui.backbuffer->width, VIDEO (width)), MIN(gui.backbuffer->height, VIDEO (height)));
+	rect_t	area = gui.damage;
+	rect_t	shown;
+	int	i;
+
+	for (i = 0; i < LAYER_COUNT; i++)
+	{
+		shown = rect(0, 0, 0, 0);
+
+		if (gui.redraw && layers[i]->draw)
 		{
-		blend( gui.menu.pixmap, gui.backbuffer, gui.menu.pos );
+			shown = rect(layers[i]->pos.x, layers[i]->pos.y, layers[i]->pixmap->width, layers[i]->pixmap->height);
 		}
-		if (gui.infobox.draw)
+
+		if (layers[i]->damaged || memcmp(&shown, &layers[i]->shown, sizeof(rect_t)) != 0)
 		{
-			blend( gui.infobox.pixmap, gui.backbuffer, gui.infobox.pos );
+			unionRect(&area, &layers[i]->shown);
+			unionRect(&area, &shown);
 		}
+
+		layers[i]->shown = shown;
+		layers[i]->damaged = false;
+	}
+
+	if (intersectRect(&area, &screen))
+	{
+		if (gui.redraw)
+		{
+			for (i = 0; i < LAYER_COUNT; i++)
+			{
+				if (layers[i]->draw)
+				{
+					blendClipped( layers[i]->pixmap, gui.backbuffer, layers[i]->pos, &area );
+				}
+			}
+		}
+
+		vramwrite ( &area );
 	}
 
-	vramwrite ( gui.backbuffer->pixels, gui.backbuffer->width, gui.backbuffer->height );
+	gui.damage = rect(0, 0, 0, 0);
 
 	if (gui.redraw)
 	{
-		memcpy( gui.backbuffer->pixels, gui.screen.pixmap->pixels, gui.backbuffer->width * gui.backbuffer->height * 4 );
+		// Take the layers and the dprintf/vprf text back out of the back
+		// buffer. The text stays on screen until the next update.
+		unionRect(&area, &gui.scribble);
+		for (i = 0; i < area.height; i++)
+		{
+			memcpy(&pixel(gui.backbuffer, area.x, area.y + i), &pixel(gui.screen.pixmap, area.x, area.y + i), area.width * 4);
+		}
+		gui.damage = gui.scribble;
+		gui.scribble = rect(0, 0, 0, 0);
 		gui.redraw = false;
 	}
 }
 
+// ====================================================================
+// The screen was cleared (e.g. by a mode set); repaint all of it.
+
+void invalidateVRAM()
+{
+	gui.damage = rect(0, 0, gui.screen.width, gui.screen.height);
+}
+
+// ====================================================================
+// Take the dprintf/vprf text back out of the back buffer.
+
+void resetBackBuffer()
+{
+	int i;
+
+	for (i = 0; i < gui.scribble.height; i++)
+	{
+		memcpy(&pixel(gui.backbuffer, gui.scribble.x, gui.scribble.y + i), &pixel(gui.screen.pixmap, gui.scribble.x, gui.scribble.y + i), gui.scribble.width * 4);
+	}
+
+	unionRect(&gui.damage, &gui.scribble);
+	gui.scribble = rect(0, 0, 0, 0);
+}
+
 // ====================================================================
 
 struct putc_info //Azi: exists on console.c & printf.c
@@ -1573,7 +1850,7 @@ int gprintf( window_t * window, const char * fmt, ...)
 			// draw the character
 			if( font->chars[character])
 			{
-				blend(font->chars[character], window->pixmap, cursor);
+				drawPixmap(font->chars[character], window->pixmap, cursor);
 			}
 
 			cursor.x += font->chars[character]->width;
@@ -1666,7 +1943,7 @@ int dprintf( window_t * window, const char * fmt, ...)
 			// draw the character
 			if( font->chars[character])
 			{
-				blend(font->chars[character], gui.backbuffer, cursor);
+				drawPixmap(font->chars[character], gui.backbuffer, cursor);
 			}
 			cursor.x += font->chars[character]->width;
 			
@@ -1768,7 +2045,7 @@ int vprf(const char * fmt, va_list ap)
 			// draw the character
 			if( font->chars[character])
 			{
-				blend(font->chars[character], gui.backbuffer, cursor);
+				drawPixmap(font->chars[character], gui.backbuffer, cursor);
 			}
 		}
 		// save cursor postition
@@ -1800,7 +2077,7 @@ position_t drawChar(unsigned char ch, font_t *font, pixmap_t *blendInto, positio
 	pixmap_t* pm = charToPixmap(ch, font);
 	if (pm && ((p.x + pm->width) < blendInto->width))
 	{
-		blend(pm, blendInto, p);
+		drawPixmap(pm, blendInto, p);
 		return pos(p.x + pm->width, p.y);
 	}
 	else
@@ -2122,6 +2399,7 @@ void showInfoBox(char *title, char *text_orig)
 		}
 
 		fillPixmapWithColor( gui.infobox.pixmap, gui.infobox.bgcolor);
+		damageWindow(&gui.infobox);
 
 		makeRoundedCorners( gui.infobox.pixmap);
 
@@ -2272,7 +2550,7 @@ void drawProgressBar(pixmap_t *blendInto, uint16_t width, position_t p, uint8_t
 		x2=0;
 	}
 
-	blend(&progressbar, blendInto, p);
+	drawPixmap(&progressbar, blendInto, p);
 #if 0
 	animateProgressBar();
 #endif
@@ -2292,6 +2570,7 @@ void drawInfoMenuItems()
 	pixmap_t *pbuff;
 
 	fillPixmapWithColor(gui.menu.pixmap, gui.menu.bgcolor);
+	damageWindow(&gui.menu);
 
 	makeRoundedCorners(gui.menu.pixmap);
 	
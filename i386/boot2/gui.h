@@ -104,6 +104,8 @@ typedef struct
 	uint32_t	font_small_color;	// Color for small  font AARRGGBB
 	uint32_t	font_console_color;	// Color for consle font AARRGGBB
 	bool		draw;			// Draw flag
+	bool		damaged;		// Pixmap changed since updateVRAM() last composited it
+	rect_t		shown;			// Where updateVRAM() last composited it, empty if hidden
 } window_t;
 
 // ====================================================================
@@ -133,6 +135,9 @@ typedef struct
 
 	bool		initialised;		// Initialised
 	bool		redraw;			// Redraw flag
+
+	rect_t		damage;			// Screen area updateVRAM() has to composite and flush
+	rect_t		scribble;		// Back buffer area drawn into directly (dprintf, vprf)
 } gui_t;
 
 
@@ -165,6 +170,8 @@ void clearGraphicBootPrompt();
 void updateGraphicBootPrompt();
 
 void updateVRAM();
+void invalidateVRAM();
+void resetBackBuffer();
 
 position_t drawChar(unsigned char ch, font_t *font, pixmap_t *blendInto, position_t p);
 void drawStr(char *ch, font_t *font, pixmap_t *blendInto, position_t p);
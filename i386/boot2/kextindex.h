@@ -0,0 +1,60 @@
+/*
+ * kextindex.h - On-disk index of the kexts in an Extensions folder.
+ *
+ * Written by the kextindex utility next to the Extensions folder it
+ * describes (e.g. /Extra/Extensions.kextindex) and read by FileLoadDrivers()
+ * instead of walking the folder. All fields are little endian.
+ *
+ * The file is a KextIndexHeader followed by numBundles records. Top level
+ * kexts are sorted by name (strcmp order), each one followed by its
+ * plug-ins. A record is a KextIndexRecord followed by the NUL terminated
+ * parent path (relative to the Extensions folder, empty for top level
+ * kexts), bundle name, CFBundleIdentifier, CFBundleExecutable,
+ * OSBundleRequired, OSBundleLibraries (identifier and version strings in
+ * pairs, ending with an empty string) and the Info.plist bytes, padded to
+ * a multiple of 4 bytes.
+ *
+ * The index is only used while the modification times of the Extensions
+ * folder, of every top level kext folder, of its PlugIns folder and of
+ * every indexed Info.plist (plug-ins included) match the ones recorded.
+ * Editing an Info.plist in place, or adding or removing a plug-in, leaves
+ * the times of the folders above it alone.
+ */
+
+#ifndef __BOOT2_KEXTINDEX_H
+#define __BOOT2_KEXTINDEX_H
+
+#define kKextIndexFileName	"Extensions.kextindex"
+#define kKextIndexMagic		0x5849584B	/* 'KXIX' */
+#define kKextIndexVersion	3
+
+#define kKextIndexFlagContents	0x0001		/* bundle has a Contents folder */
+#define kKextIndexFlagPlugIn	0x0002		/* bundle lives in a PlugIns folder */
+#define kKextIndexFlagPlugIns	0x0004		/* top level bundle has a PlugIns folder */
+
+typedef struct KextIndexHeader {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	length;			/* size of the whole file */
+	uint32_t	dirTime;		/* mtime of the Extensions folder */
+	uint32_t	numBundles;		/* records */
+	uint32_t	numTopLevel;		/* records without kKextIndexFlagPlugIn */
+	uint32_t	reserved[2];
+} KextIndexHeader;
+
+typedef struct KextIndexRecord {
+	uint32_t	recordLength;		/* including strings and plist */
+	uint32_t	dirTime;		/* mtime of the top level kext folder */
+	uint32_t	plistTime;		/* mtime of the bundle's Info.plist */
+	uint32_t	plugInsTime;		/* mtime of its PlugIns folder, if any */
+	uint16_t	flags;
+	uint16_t	parentLength;		/* string lengths, without the NUL */
+	uint16_t	nameLength;
+	uint16_t	identifierLength;
+	uint16_t	executableLength;
+	uint16_t	requiredLength;
+	uint32_t	librariesLength;	/* including every NUL */
+	uint32_t	plistLength;
+} KextIndexRecord;
+
+#endif /* !__BOOT2_KEXTINDEX_H */
@@ -41,6 +41,7 @@
  */
 
 #include <sl.h>
+#include "boot.h"
 
 #define N         4096  /* size of ring buffer - must be power of 2 */
 #define F         18    /* upper limit for match_length */
@@ -64,54 +65,106 @@ struct encode_state {
 	int match_position, match_length;
 };
 
+/*
+ * Unaligned 8 byte moves for the literal and match copies below.
+ */
+typedef u_int64_t lzss_u64 __attribute__((aligned(1), may_alias));
+
+#define LZSS_COPY8(d, s)	(*(lzss_u64 *)(d) = *(const lzss_u64 *)(s))
+
 int
 decompress_lzss(  u_int8_t *dst, u_int32_t dstlen, u_int8_t *src, u_int32_t srclen )
 {
-	/* ring buffer of size N, with extra F-1 bytes to aid string comparison */
-	u_int8_t text_buf[N + F - 1];
-	u_int8_t *dststart = dst;
-	u_int8_t *dstend = dst + dstlen;
+	lzss_stream stream;
+
+	lzss_stream_init(&stream, dst, dstlen);
+	decompress_lzss_stream(&stream, src, srclen, 1);
+
+	return stream.dst - stream.dstBegin;
+}
+
+void
+lzss_stream_init( lzss_stream *stream, u_int8_t *dst, u_int32_t dstlen )
+{
+	stream->dst = stream->dstBegin = dst;
+	stream->dstEnd = dst + dstlen;
+	stream->done = (dstlen == 0);
+}
+
+/*
+ * Decodes one flag byte and its 8 items at a time; a group is only started
+ * when all of it (17 bytes at most) is in src, unless this is the last call.
+ *
+ * The encoder's N byte ring buffer always holds the last N bytes of output,
+ * so a match at ring position i is the output at distance
+ * (r - i) mod N, with r = (N - F + output length) mod N and 0 standing
+ * for N. Matches are therefore copied straight from dst, 8 bytes at a time
+ * when they do not overlap that closely; only the first N bytes of output
+ * can reach back before dst, into the ring's initial spaces.
+ */
+long
+decompress_lzss_stream( lzss_stream *stream, u_int8_t *src, u_int32_t srclen, int last )
+{
+	u_int8_t *srcstart = src;
 	u_int8_t *srcend = src + srclen;
-	int  i, j, k, r, c;
+	u_int8_t *dst = stream->dst;
+	u_int8_t *dststart = stream->dstBegin;
+	u_int8_t *dstend = stream->dstEnd;
+	u_int8_t *from;
+	int  i, j, k, d, bit;
 	unsigned int flags;
 
-	dst = dststart;
-	srcend = src + srclen;
-	for (i = 0; i < N - F; i++)
-		text_buf[i] = ' ';
-	r = N - F;
-	flags = 0;
-	for ( ; ; ) {
-		if (((flags >>= 1) & 0x100) == 0) {
-			if (src < srcend) c = *src++; else break;
-			flags = c | 0xFF00;  /* uses higher byte cleverly */
-		}   /* to count eight */
-		if (flags & 1) {
-			if (src < srcend) c = *src++; else break;
-			*dst++ = c;
-			if (dst >= dstend) {
-				goto finish;
-			}
-			text_buf[r++] = c;
-			r &= (N - 1);
-		} else {
-			if (src < srcend) i = *src++; else break;
-			if (src < srcend) j = *src++; else break;
-			i |= ((j & 0xF0) << 4);
-			j  =  (j & 0x0F) + THRESHOLD;
-			for (k = 0; k <= j; k++) {
-				c = text_buf[(i + k) & (N - 1)];
-				*dst++ = c;
-				if (dst >= dstend) {
+	while (!stream->done) {
+		if (src >= srcend || (!last && srcend - src < 1 + 2 * 8))
+			break;
+		flags = *src++;
+		/* eight literals */
+		if (flags == 0xFF && srcend - src >= 8 && dstend - dst > 8) {
+			LZSS_COPY8(dst, src);
+			dst += 8;
+			src += 8;
+			continue;
+		}
+		for (bit = 0; bit < 8; bit++, flags >>= 1) {
+			if (flags & 1) {
+				if (src >= srcend)
+					goto finish;
+				*dst++ = *src++;
+				if (dst >= dstend)
+					goto finish;
+			} else {
+				if (src + 2 > srcend)
 					goto finish;
+				i = *src++;
+				j = *src++;
+				i |= ((j & 0xF0) << 4);
+				j  =  (j & 0x0F) + THRESHOLD + 1;
+				d = (N - F + (dst - dststart) - i) & (N - 1);
+				if (d == 0)
+					d = N;
+				from = dst - d;
+				if (d >= 8 && from >= dststart && dstend - dst > F + 8) {
+					for (k = 0; k < j; k += 8)
+						LZSS_COPY8(dst + k, from + k);
+					dst += j;
+				} else {
+					for (k = 0; k < j; k++, from++) {
+						*dst++ = (from >= dststart) ? *from : ' ';
+						if (dst >= dstend)
+							goto finish;
+					}
 				}
-				text_buf[r++] = c;
-				r &= (N - 1);
 			}
 		}
 	}
+	if (last)
+		stream->done = 1;
+	stream->dst = dst;
+	return src - srcstart;
 finish:
-	return dst - dststart;
+	stream->done = 1;
+	stream->dst = dst;
+	return src - srcstart;
 }
 
 /*
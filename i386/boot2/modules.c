@@ -9,6 +9,7 @@
 #include "modules.h"
 #include "boot_modules.h"
 #include "mboot.h"
+#include "xml.h"
 #include <vers.h>
 
 #include <string.h>
@@ -36,6 +37,51 @@ moduleList_t *loadedModules = NULL;
 symbolList_t *moduleSymbols = NULL;
 unsigned int (*lookup_symbol)(const char*) = NULL;
 
+/*
+ * Symbols are also kept in an open addressing hash, keyed by the name
+ * without one leading underscore. "_foo" and "foo" thus share a slot, which
+ * records both, since lookup_all_symbols() lets _foo bind to foo. As with
+ * the moduleSymbols list, the latest definition of a name wins.
+ */
+typedef struct symbolSlot_t
+{
+	const char	*key;		/* name without its leading underscore, NULL if free */
+	UInt32		hash;
+	UInt32		addr[2];	/* [1]: the name had the underscore */
+	UInt32		serial[2];	/* order of definition, 0 if undefined */
+} symbolSlot_t;
+
+static symbolSlot_t	*symbolTable = NULL;
+static UInt32		symbolTableSize = 0;	/* power of two */
+static UInt32		symbolCount = 0;
+static UInt32		symbolSerial = 0;
+
+#define HOOK_HASH_SIZE	64
+
+static moduleHook_t	*hookHash[HOOK_HASH_SIZE];
+
+/*
+ * Modules with a manifest (Name.plist next to Name.dylib) are only loaded
+ * once one of the hooks it lists executes or one of the symbols it lists
+ * is looked up.
+ */
+#define MODULE_MANIFEST_HOOKS		"Hooks"
+#define MODULE_MANIFEST_SYMBOLS		"Symbols"
+
+typedef struct lazyModule_t
+{
+	char			*name;		/* file name of the dylib */
+	TagPtr			hooks;		/* array of hook names, or NULL */
+	TagPtr			symbols;	/* array of symbol names, or NULL */
+	int			loaded;
+	struct lazyModule_t	*next;
+} lazyModule_t;
+
+static lazyModule_t	*lazyModules = NULL;	/* in the order they were found */
+
+static moduleHook_t	*find_hook(const char* name, UInt32 hash);
+static int		load_lazy_modules(moduleHook_t* hook, const char* symbol);
+
 char *strrchr(const char *s, int c)
 {
 	const char *found = NULL;
@@ -51,6 +97,89 @@ char *strrchr(const char *s, int c)
 	return (char *)found;
 }
 
+/*
+ * FNV-1a hash of a symbol or hook name.
+ */
+static UInt32 hash_name(const char *name)
+{
+	UInt32 hash = 2166136261U;
+
+	while (*name)
+	{
+		hash = (hash ^ (UInt8)*name++) * 16777619U;
+	}
+
+	return hash;
+}
+
+/*
+ * Return the slot of key, or the free slot where it belongs.
+ */
+static symbolSlot_t *find_symbol_slot(const char *key, UInt32 hash)
+{
+	UInt32 index = hash & (symbolTableSize - 1);
+
+	while (symbolTable[index].key)
+	{
+		if (symbolTable[index].hash == hash && strcmp(symbolTable[index].key, key) == 0)
+		{
+			break;
+		}
+
+		index = (index + 1) & (symbolTableSize - 1);
+	}
+
+	return &symbolTable[index];
+}
+
+/*
+ * Return the slot holding symbol, setting *underscore to the variant it is
+ * stored as, or NULL if no symbol shares its key.
+ */
+static symbolSlot_t *find_symbol(const char *symbol, int *underscore)
+{
+	symbolSlot_t *slot;
+
+	*underscore = (*symbol == '_');
+	symbol += *underscore;
+
+	if (!symbolTable)
+	{
+		return NULL;
+	}
+
+	slot = find_symbol_slot(symbol, hash_name(symbol));
+
+	return slot->key ? slot : NULL;
+}
+
+/*
+ * Double the symbol hash (starting at 1024 slots) and rehash every slot.
+ */
+static void grow_symbol_table()
+{
+	symbolSlot_t *oldTable = symbolTable;
+	UInt32 oldSize = symbolTableSize;
+	UInt32 index;
+
+	symbolTableSize = oldSize ? oldSize * 2 : 1024;
+	symbolTable = malloc(symbolTableSize * sizeof(symbolSlot_t));
+	bzero(symbolTable, symbolTableSize * sizeof(symbolSlot_t));
+
+	for (index = 0; index < oldSize; index++)
+	{
+		if (oldTable[index].key)
+		{
+			*find_symbol_slot(oldTable[index].key, oldTable[index].hash) = oldTable[index];
+		}
+	}
+
+	if (oldTable)
+	{
+		free(oldTable);
+	}
+}
+
 /*
  * Initialize the module system by loading the Symbols.dylib module.
  * Once loaded, locate the _lookup_symbol function so that internal
@@ -177,7 +306,11 @@ void load_all_modules()
 			char *tmp = malloc(strlen(name) + 1);
 			strcpy(tmp, name);
 
-			if(!load_module(tmp))
+			if(add_lazy_module(tmp))
+			{
+				DBG("Module %s will be loaded on demand\n", tmp);
+			}
+			else if(!load_module(tmp))
 			{
 				// failed to load
 				// free(tmp);
@@ -194,6 +327,127 @@ void load_all_modules()
 }
 
 
+/*
+ * Read the manifest of module (e.g. Resolution.plist for Resolution.dylib).
+ * If it lists the hooks or symbols the module services, remember it for
+ * load_lazy_modules() and return 1; otherwise the module is loaded now.
+ */
+int add_lazy_module(char* module)
+{
+	char manifestPath[128];
+	char *buffer;
+	TagPtr manifest = NULL, hooks, symbols;
+	lazyModule_t *lazy, **tail;
+	unsigned int size;
+	int fh, index;
+
+	snprintf(manifestPath, sizeof(manifestPath), MODULE_PATH "%.*s.plist", (int)(strlen(module) - sizeof(".dylib") + 1), module);
+	fh = open(manifestPath, 0);
+	if(fh < 0)
+	{
+		return 0;
+	}
+
+	size = file_size(fh);
+	buffer = malloc(size + 1);
+	if(size && read(fh, buffer, size) == size)
+	{
+		buffer[size] = '\0';
+		if(XMLParseFile(buffer, &manifest) < 0)
+		{
+			manifest = NULL;
+		}
+	}
+	free(buffer);
+	close(fh);
+
+	if(!manifest)
+	{
+		DBG("[WARNING!] Unable to read manifest '%s'.\n", manifestPath);
+		return 0;
+	}
+
+	hooks = XMLCastArray(XMLGetProperty(manifest, MODULE_MANIFEST_HOOKS));
+	symbols = XMLCastArray(XMLGetProperty(manifest, MODULE_MANIFEST_SYMBOLS));
+
+	if(!hooks && !symbols)
+	{
+		DBG("[WARNING!] Ignoring manifest '%s'.\n", manifestPath);
+		XMLFreeTag(manifest);
+		return 0;
+	}
+
+	lazy = malloc(sizeof(lazyModule_t));
+	lazy->name = module;
+	lazy->hooks = hooks;
+	lazy->symbols = symbols;
+	lazy->loaded = 0;
+	lazy->next = NULL;
+
+	for(tail = &lazyModules; *tail; tail = &(*tail)->next);
+	*tail = lazy;
+
+	// Flag the hooks, so executing them loads the module first.
+	for(index = 0; hooks && index < XMLTagCount(hooks); index++)
+	{
+		char *hook = XMLCastString(XMLGetElement(hooks, index));
+
+		if(hook)
+		{
+			intern_hook(hook)->lazy = 1;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Load the modules waiting for hook to execute, or for symbol to be looked
+ * up. Returns the number of modules loaded.
+ */
+static int load_lazy_modules(moduleHook_t* hook, const char* symbol)
+{
+	lazyModule_t *lazy;
+	TagPtr names;
+	char *name;
+	int index, loaded = 0;
+
+	if(hook)
+	{
+		hook->lazy = 0;
+	}
+
+	for(lazy = lazyModules; lazy; lazy = lazy->next)
+	{
+		if(lazy->loaded)
+		{
+			continue;
+		}
+
+		names = hook ? lazy->hooks : lazy->symbols;
+
+		for(index = 0; names && index < XMLTagCount(names); index++)
+		{
+			name = XMLCastString(XMLGetElement(names, index));
+
+			if(!name)
+			{
+				continue;
+			}
+
+			if(hook ? strcmp(name, hook->name) == 0 :
+			   (strcmp(name, symbol) == 0 || (*symbol == '_' && strcmp(name, symbol + 1) == 0)))
+			{
+				DBG("Loading module %s on demand for '%s'\n", lazy->name, hook ? hook->name : symbol);
+				loaded += load_module(lazy->name);
+				break;
+			}
+		}
+	}
+
+	return loaded;
+}
+
 /*
  * Load a module file in /Extra/modules/
  */
@@ -203,6 +457,7 @@ int load_module(char* module)
 	void (*module_start)(void) = NULL;
 	char modString[128];
 	int fh = -1;
+	lazyModule_t *lazy;
 
 	// Check to see if the module has already been loaded
 	if(is_module_loaded(module))
@@ -211,6 +466,16 @@ int load_module(char* module)
 		return 1;
 	}
 
+	// A module loaded as a dependency is no longer waiting for its hooks.
+	for(lazy = lazyModules; lazy; lazy = lazy->next)
+	{
+		if(!lazy->loaded && strcmp(lazy->name, module) == 0)
+		{
+			lazy->loaded = 1;
+			break;
+		}
+	}
+
 	snprintf(modString, sizeof(modString), MODULE_PATH "%s", module);
 	fh = open(modString, 0);
 	if(fh < 0)
@@ -273,6 +538,11 @@ long long add_symbol(char *symbol, long long addr, char is64)
 {
 	// This only can handle 32bit symbols
 	symbolList_t* entry;
+	symbolSlot_t* slot;
+	const char* key = symbol;
+	int underscore = 0;
+	UInt32 hash;
+
 	DBG("Adding symbol %s at 0x%X\n", symbol, addr);
 
 	entry = malloc(sizeof(symbolList_t));
@@ -282,6 +552,31 @@ long long add_symbol(char *symbol, long long addr, char is64)
 	entry->addr = (UInt32)addr;
 	entry->symbol = symbol;
 
+	if(*key == '_')
+	{
+		key++;
+		underscore = 1;
+	}
+
+	// Keep the hash at most 3/4 full.
+	if((symbolCount + 1) * 4 > symbolTableSize * 3)
+	{
+		grow_symbol_table();
+	}
+
+	hash = hash_name(key);
+	slot = find_symbol_slot(key, hash);
+
+	if(!slot->key)
+	{
+		slot->key = key;
+		slot->hash = hash;
+		symbolCount++;
+	}
+
+	slot->addr[underscore] = (UInt32)addr;
+	slot->serial[underscore] = ++symbolSerial;
+
 	if(!is64 && strcmp(symbol, "start") == 0)
 	{
 		return addr;
@@ -350,25 +645,52 @@ int is_module_loaded(const char* name)
  */
 unsigned int lookup_all_symbols(const char* name)
 {
-	symbolList_t* entry = moduleSymbols;
-	while(entry)
+	symbolSlot_t* slot;
+	symbolSlot_t* stripped = NULL;
+	int underscore, strippedUnderscore = 0;
+	UInt32 serial = 0, addr = 0;
+
+	slot = find_symbol(name, &underscore);
+
+	if(underscore)
 	{
-		if(strcmp(entry->symbol, name) == 0)
+		// Allow _strstr to bind to strstr, etc; both share a slot unless
+		// the name starts with two underscores.
+		if(name[1] == '_')
 		{
-			//DBG("External symbol %s located at 0x%X\n", name, entry->addr);
-			return entry->addr;
-		}
-		else if(strcmp(entry->symbol, name + 1) == 0 && *name == '_') // Allow _strstr to bing to strstr, etc
-		{
-			//DBG("External symbol %s located at 0x%X\n", name, entry->addr);
-			return entry->addr;
+			stripped = find_symbol(name + 1, &strippedUnderscore);
 		}
 		else
 		{
-			entry = entry->next;
+			stripped = slot;
 		}
 	}
 
+	// The latest definition wins.
+	if(slot && slot->serial[underscore])
+	{
+		serial = slot->serial[underscore];
+		addr = slot->addr[underscore];
+	}
+
+	if(stripped && stripped->serial[strippedUnderscore] > serial)
+	{
+		serial = stripped->serial[strippedUnderscore];
+		addr = stripped->addr[strippedUnderscore];
+	}
+
+	if(serial)
+	{
+		//DBG("External symbol %s located at 0x%X\n", name, addr);
+		return addr;
+	}
+
+	// A module waiting to be loaded may provide it.
+	if(lazyModules && load_lazy_modules(NULL, name))
+	{
+		return lookup_all_symbols(name);
+	}
+
 #if CONFIG_MODULE_DEBUG
 	printf("[WARNING!] Unable to locate symbol %s.\n", name);
 	getchar();
@@ -1078,9 +1400,23 @@ int execute_hook(const char* name, void* arg1, void* arg2, void* arg3, void* arg
 {
 	DBG("Attempting to execute hook '%s'...\n", name);
 	DBGPAUSE();
-	moduleHook_t* hook = hook_exists(name);
 
-	if(hook)
+	return execute_hook_handle(find_hook(name, hash_name(name)), arg1, arg2, arg3, arg4);
+}
+
+/*
+ *	execute_hook_handle(  moduleHook_t* hook )
+ *		hook - Handle returned by intern_hook(), for hooks executed
+ *			often enough that looking up their name each time shows.
+ */
+int execute_hook_handle(moduleHook_t* hook, void* arg1, void* arg2, void* arg3, void* arg4)
+{
+	if(hook && hook->lazy)
+	{
+		load_lazy_modules(hook, NULL);
+	}
+
+	if(hook && hook->callbacks)
 	{
 		// Loop through all callbacks for this module
 		callbackList_t* callbacks = hook->callbacks;
@@ -1091,14 +1427,14 @@ int execute_hook(const char* name, void* arg1, void* arg2, void* arg3, void* arg
 			callbacks->callback(arg1, arg2, arg3, arg4);
 			callbacks = callbacks->next;
 		}
-		DBG("Hook '%s' executed.\n", name);
+		DBG("Hook '%s' executed.\n", hook->name);
 		DBGPAUSE();
 		return 1;
 	}
 	else
 	{
 		// Callback for this hook doesn't exist;
-		DBG("No callbacks for hook '%s'.\n", name);
+		DBG("No callbacks for hook '%s'.\n", hook ? hook->name : "(null)");
 		return 0;
 	}
 }
@@ -1115,31 +1451,14 @@ void register_hook_callback(const char* name, void(*callback)(void*, void*, void
 	DBG("Adding callback for '%s' hook... ", name);
 	DBGPAUSE();
 
-	moduleHook_t *hook = hook_exists(name);
+	moduleHook_t *hook = intern_hook(name);
 
-	if(hook)
-	{
-		// append
-		callbackList_t *newCallback = malloc(sizeof(callbackList_t));
-		newCallback->next = hook->callbacks;
-		hook->callbacks = newCallback;
-		newCallback->callback = callback;
-		DBG("Added.\n");
-	}
-	else
-	{
-		// create new hook
-		DBG("Hook not exists, creating a new hook.\n");
-		moduleHook_t *newHook = malloc(sizeof(moduleHook_t));
-		newHook->name = name;
-		newHook->callbacks = malloc(sizeof(callbackList_t));
-		newHook->callbacks->callback = callback;
-		newHook->callbacks->next = NULL;
-
-		newHook->next = moduleCallbacks;
-		moduleCallbacks = newHook;
-
-	}
+	// append
+	callbackList_t *newCallback = malloc(sizeof(callbackList_t));
+	newCallback->next = hook->callbacks;
+	hook->callbacks = newCallback;
+	newCallback->callback = callback;
+	DBG("Added.\n");
 
 #if CONFIG_MODULE_DEBUG
 	//print_hook_list();
@@ -1149,24 +1468,65 @@ void register_hook_callback(const char* name, void(*callback)(void*, void*, void
 }
 
 
-moduleHook_t* hook_exists(const char* name)
+static moduleHook_t* find_hook(const char* name, UInt32 hash)
 {
-	moduleHook_t* hooks = moduleCallbacks;
+	moduleHook_t* hooks = hookHash[hash & (HOOK_HASH_SIZE - 1)];
 
-	// look for a hook. If it exists, return the moduleHook_t*,
-	// If not, return NULL.
 	while(hooks)
 	{
 		if(strcmp(name, hooks->name) == 0)
 		{
-			//DBG("Located hook %s\n", name);
 			return hooks;
 		}
-		hooks = hooks->next;
+		hooks = hooks->hashNext;
 	}
-	//DBG("Hook %s does not exist\n", name);
+
 	return NULL;
+}
 
+/*
+ *	intern_hook(  const char* name )
+ *		Return the handle of the named hook, creating it (without any
+ *		callbacks) if needed. The handle stays valid, and picks up callbacks
+ *		registered later, so callers can look it up once and keep it.
+ */
+moduleHook_t* intern_hook(const char* name)
+{
+	UInt32 hash = hash_name(name);
+	moduleHook_t* hook = find_hook(name, hash);
+
+	if(!hook)
+	{
+		DBG("Hook not exists, creating a new hook.\n");
+		hook = malloc(sizeof(moduleHook_t));
+		hook->name = name;
+		hook->callbacks = NULL;
+		hook->lazy = 0;
+
+		hook->next = moduleCallbacks;
+		moduleCallbacks = hook;
+
+		hook->hashNext = hookHash[hash & (HOOK_HASH_SIZE - 1)];
+		hookHash[hash & (HOOK_HASH_SIZE - 1)] = hook;
+	}
+
+	return hook;
+}
+
+moduleHook_t* hook_exists(const char* name)
+{
+	moduleHook_t* hook = find_hook(name, hash_name(name));
+
+	// look for a hook with callbacks. If it exists, return the moduleHook_t*,
+	// If not, return NULL.
+	if(hook && hook->callbacks)
+	{
+		//DBG("Located hook %s\n", name);
+		return hook;
+	}
+
+	//DBG("Hook %s does not exist\n", name);
+	return NULL;
 }
 
 #if CONFIG_MODULE_DEBUG
@@ -1211,6 +1571,16 @@ int execute_hook(const char* name, void* arg1, void* arg2, void* arg3, void* arg
     return 0;
 }
 
+moduleHook_t* intern_hook(const char* name)
+{
+    return NULL;
+}
+
+int execute_hook_handle(moduleHook_t* hook, void* arg1, void* arg2, void* arg3, void* arg4)
+{
+    return 0;
+}
+
 void register_hook_callback(const char* name, void(*callback)(void*, void*, void*, void*))
 {
 	printf("[WARNING!] 'register_hook_callback' is not supported when compiled in.\n");
@@ -40,8 +40,10 @@ typedef struct callbackList_t
 typedef struct moduleHook_t
 {
 	const char *name;
-	callbackList_t *callbacks;
+	callbackList_t *callbacks;	/* NULL until a callback is registered */
 	struct moduleHook_t *next;
+	struct moduleHook_t *hashNext;
+	int lazy;			/* modules waiting for this hook are not loaded yet */
 } moduleHook_t;
 
 typedef struct modulesList_t
@@ -67,6 +69,7 @@ void start_built_in_module(const char	*name,
                            void(*start_function)(void));
 
 int load_module(char* module);
+int add_lazy_module(char* module);
 int is_module_loaded(const char* name);
 void module_loaded(const char *name, void *start, const char *author, const char *description, UInt32 version, UInt32 compat);
 
@@ -103,7 +106,9 @@ void			bind_macho(void *base, UInt8 *bind_stream, UInt32 size);
 /********************************************************************************/
 int		replace_function(const char *symbol, void *newAddress);
 int		execute_hook(const char *name, void*, void*, void*, void*);
+int		execute_hook_handle(moduleHook_t *hook, void*, void*, void*, void*);
 void		register_hook_callback(const char* name, void(*callback)(void*, void*, void*, void*));
+moduleHook_t	*intern_hook(const char* name);
 moduleHook_t	*hook_exists(const char* name);
 
 #if DEBUG_MODULES
@@ -180,7 +180,7 @@ static int countdown( const char * msg, int row, int timeout )
 		drawStrCenteredAt( (char *) msg, &font_small, gui.screen.pixmap, gui.countdown.pos );
 
 		// make this screen the new background
-		memcpy( gui.backbuffer->pixels, gui.screen.pixmap->pixels, gui.backbuffer->width * gui.backbuffer->height * 4 );
+		resetBackBuffer();
 
 	}
 
@@ -1005,7 +1005,7 @@ int getBootOptions(bool firstRun)
 			}
 
 			// redraw background
-			memcpy(gui.backbuffer->pixels, gui.screen.pixmap->pixels, gui.backbuffer->width * gui.backbuffer->height * 4);
+			resetBackBuffer();
 		}
 	} else {
 		// Clear screen and hide the blinking cursor.
@@ -1031,7 +1031,7 @@ int getBootOptions(bool firstRun)
 	do {
 		if (bootArgs->Video.v_display != VGA_TEXT_MODE) {
 			// redraw background
-			memcpy( gui.backbuffer->pixels, gui.screen.pixmap->pixels, gui.backbuffer->width * gui.backbuffer->height * 4 );
+			resetBackBuffer();
 			// reset cursor co-ords
 			gui.debug.cursor = pos( gui.screen.width - 160 , 10 );
 		}
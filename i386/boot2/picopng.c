@@ -23,136 +23,28 @@
 
 /*************************************************************************************************/
 
-typedef struct png_alloc_node
-{
-	struct png_alloc_node *prev, *next;
-	void *addr;
-	size_t size;
-} png_alloc_node_t;
-
-png_alloc_node_t *png_alloc_head = NULL;
-png_alloc_node_t *png_alloc_tail = NULL;
-
-//==============================================================================
-
-png_alloc_node_t *png_alloc_find_node(void *addr)
-{
-	png_alloc_node_t *node;
-
-	for (node = png_alloc_head; node; node = node->next)
-	{
-		if (node->addr == addr)
-		{
-			break;
-		}
-	}
-
-	return node;
-}
-
-
-//==============================================================================
-
-void png_alloc_add_node(void *addr, size_t size)
-{
-	png_alloc_node_t *node;
-
-	if (png_alloc_find_node(addr))
-	{
-		return;
-	}
-
-	node = malloc(sizeof(png_alloc_node_t));
-	node->addr = addr;
-	node->size = size;
-	node->prev = png_alloc_tail;
-	node->next = NULL;
-	png_alloc_tail = node;
-
-	if (node->prev)
-	{
-		node->prev->next = node;
-	}
-
-	if (!png_alloc_head)
-	{
-		png_alloc_head = node;
-	}
-}
-
-//==============================================================================
-
-void png_alloc_remove_node(png_alloc_node_t *node)
-{
-	if (!node) {
-		return;
-	}
-	if (node->prev) {
-		node->prev->next = node->next;
-	}
-	if (node->next) {
-		node->next->prev = node->prev;
-	}
-	if (node == png_alloc_head) {
-		png_alloc_head = node->next;
-	}
-	if (node == png_alloc_tail) {
-		png_alloc_tail = node->prev;
-	}
-	node->prev = node->next = node->addr = NULL;
-	free(node);
-}
+// Everything the decoder allocates lives in one arena that is dropped as a
+// whole by png_alloc_free_all() once the caller has copied the image out.
+static struct arena png_arena = ARENA_INITIALIZER("png", 64 * 1024);
 
 void *png_alloc_malloc(size_t size)
 {
-	void *addr = malloc(size);
-	png_alloc_add_node(addr, size);
-	return addr;
+	return arena_alloc(&png_arena, size);
 }
 
 void *png_alloc_realloc(void *addr, size_t size)
 {
-	void *new_addr = NULL;
-	if (!addr) {
-		return png_alloc_malloc(size);
-	}
-
-	png_alloc_node_t *old_node;
-	old_node = png_alloc_find_node(addr);
-
-	if (old_node)
-	{
-		new_addr = realloc(addr, size);
-		if (new_addr && (new_addr != addr))
-		{
-			png_alloc_remove_node(old_node);
-			png_alloc_add_node(new_addr, size);
-		}
-	}
-
-	return new_addr;
+	return arena_realloc(&png_arena, addr, size);
 }
 
 void png_alloc_free(void *addr)
 {
-	if (!addr) {
-		return;
-	}
-
-	png_alloc_node_t *node = png_alloc_find_node(addr);
-	if (node) {
-		png_alloc_remove_node(node);
-	}
-	free(addr);
+	arena_free(&png_arena, addr);
 }
 
 void png_alloc_free_all()
 {
-	while (png_alloc_tail) {
-		void *addr = png_alloc_tail->addr;
-		png_alloc_remove_node(png_alloc_tail);
-		free(addr);
-	}
+	arena_reset(&png_arena);
 }
 
 /*************************************************************************************************/
@@ -300,91 +192,93 @@ const uint32_t CLCL[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13,
 
 /*************************************************************************************************/
 
+// Decoding works on lookup tables instead of walking a tree a bit at a time: a table indexed by
+// the next rootbits bits of the stream (deflate stores a code with its first bit lowest) gives the
+// symbol in the upper 16 bits of an entry and the code length in the low byte. Codes longer than
+// rootbits go through a second level table instead; its root entry holds the table's offset in the
+// upper 16 bits and the number of bits that index it in bits 8..15. Zero entries are holes left by
+// an incomplete code.
+
+#define HUFFMAN_MAXBITS	15
+#define HUFFMAN_ROOTBITS	10	// literal/length codes
+#define HUFFMAN_ROOTBITSD	8	// distance codes
+#define HUFFMAN_ROOTBITSCL	7	// code length codes, which are never longer
+
 typedef struct {
-	// 2D representation of a huffman tree: The one dimension is "0" or "1", the other contains all
-	// nodes and leaves of the tree.
-	vector32_t *tree2d;
+	uint32_t *table;
+	size_t allocsize; // number of entries table has room for
+	uint32_t rootbits;
 } HuffmanTree;
 
-HuffmanTree *HuffmanTree_new()
-{
-	HuffmanTree *tree = png_alloc_malloc(sizeof (HuffmanTree));
-	if (!tree)
-	{
-		return NULL;
-	}
-	tree->tree2d = NULL;
-	return tree;
-}
-
-int HuffmanTree_makeFromLengths(HuffmanTree *tree, const vector32_t *bitlen, uint32_t maxbitlen)
-{	// make tree given the lengths
-	uint32_t bits, n, i;
-	uint32_t numcodes = (uint32_t) bitlen->size, treepos = 0, nodefilled = 0;
-	vector32_t *tree1d, *blcount, *nextcode;
-	tree1d = vector32_new(numcodes, 0);
-	blcount = vector32_new(maxbitlen + 1, 0);
-	nextcode = vector32_new(maxbitlen + 1, 0);
-	if (!tree1d || !blcount || !nextcode || !nextcode->data)
-	{
-		goto error;
-	}
-	for (bits = 0; bits < numcodes; bits++)
-		blcount->data[bitlen->data[bits]]++; // count number of instances of each code length
-	for (bits = 1; bits <= maxbitlen; bits++)
-		nextcode->data[bits] = (nextcode->data[bits - 1] + blcount->data[bits - 1]) << 1;
+int HuffmanTree_makeFromLengths(HuffmanTree *tree, const uint8_t *bitlen, uint32_t numcodes,
+		uint32_t rootbits)
+{	// make the lookup table given the lengths
+	uint32_t blcount[HUFFMAN_MAXBITS + 1], nextcode[HUFFMAN_MAXBITS + 1];
+	uint16_t reversed[288]; // the codes, first bit lowest
+	uint8_t subbits[1 << HUFFMAN_ROOTBITS];
+	uint32_t rootmask = (1 << rootbits) - 1, bits, n, i, code, size, entry;
+	int32_t left = 1;
+	uint32_t *table;
+	for (bits = 0; bits <= HUFFMAN_MAXBITS; bits++)
+		blcount[bits] = 0;
 	for (n = 0; n < numcodes; n++)
-		if (bitlen->data[n] != 0)
-			tree1d->data[n] = nextcode->data[bitlen->data[n]]++; // generate all the codes
-	// 0x7fff here means the tree2d isn't filled there yet
-	vector32_t *tree2d = vector32_new(numcodes * 2, 0x7fff);
-	tree->tree2d = tree2d;
-	for (n = 0; n < numcodes; n++) // the codes
-		for (i = 0; i < bitlen->data[n]; i++) { // the bits for this code
-			uint32_t bit = (tree1d->data[n] >> (bitlen->data[n] - i - 1)) & 1;
-			if (treepos > numcodes - 2)
-				return 55;
-			if (tree2d->data[2 * treepos + bit] == 0x7fff) { // not yet filled in
-				if (i + 1 == bitlen->data[n]) { // last bit
-					tree2d->data[2 * treepos + bit] = n;
-					treepos = 0;
-				} else { // addresses are encoded as values > numcodes
-					tree2d->data[2 * treepos + bit] = ++nodefilled + numcodes;
-					treepos = nodefilled;
-				}
-			} else // subtract numcodes from address to get address value
-				treepos = tree2d->data[2 * treepos + bit] - numcodes;
-		}
-	return 0;
-error:
-	if (tree1d)
-	{
-		vector32_cleanup(tree1d);
-		png_alloc_free(tree1d);
+		blcount[bitlen[n]]++; // count number of instances of each code length
+	for (bits = 1; bits <= HUFFMAN_MAXBITS; bits++) {
+		left = (left << 1) - blcount[bits];
+		if (left < 0)
+			return 55; // error: the lengths describe more codes than there is room for
 	}
-	if (blcount)
-	{
-		vector32_cleanup(blcount);
-		png_alloc_free(blcount);
+	nextcode[1] = 0;
+	for (bits = 2; bits <= HUFFMAN_MAXBITS; bits++)
+		nextcode[bits] = (nextcode[bits - 1] + blcount[bits - 1]) << 1;
+	for (i = 0; i <= rootmask; i++)
+		subbits[i] = 0;
+	for (n = 0; n < numcodes; n++) { // generate all the codes
+		bits = bitlen[n];
+		if (bits == 0)
+			continue;
+		code = nextcode[bits]++;
+		reversed[n] = 0;
+		for (i = 0; i < bits; i++)
+			reversed[n] |= ((code >> i) & 1) << (bits - i - 1);
+		if (bits > rootbits && bits - rootbits > subbits[reversed[n] & rootmask])
+			subbits[reversed[n] & rootmask] = bits - rootbits;
 	}
-	if (nextcode)
-	{
-		vector32_cleanup(nextcode);
-		png_alloc_free(nextcode);
+	size = rootmask + 1; // the root table, followed by the second level tables
+	for (i = 0; i <= rootmask; i++)
+		if (subbits[i])
+			size += 1 << subbits[i];
+	if (size > tree->allocsize) {
+		table = png_alloc_realloc(tree->table, size * sizeof (uint32_t));
+		if (!table)
+			return 83; // error: not enough memory
+		tree->table = table;
+		tree->allocsize = size;
+	}
+	table = tree->table;
+	tree->rootbits = rootbits;
+	for (i = 0; i < size; i++)
+		table[i] = 0;
+	size = rootmask + 1;
+	for (i = 0; i <= rootmask; i++)
+		if (subbits[i]) {
+			table[i] = (size << 16) | (subbits[i] << 8) | rootbits;
+			size += 1 << subbits[i];
+		}
+	for (n = 0; n < numcodes; n++) { // fill in every index that starts with the code
+		bits = bitlen[n];
+		if (bits == 0)
+			continue;
+		if (bits <= rootbits) {
+			for (i = reversed[n]; i <= rootmask; i += 1 << bits)
+				table[i] = (n << 16) | bits;
+		} else {
+			entry = table[reversed[n] & rootmask];
+			for (i = reversed[n] >> rootbits; i < (1u << ((entry >> 8) & 0xff));
+					i += 1 << (bits - rootbits))
+				table[(entry >> 16) + i] = (n << 16) | (bits - rootbits);
+		}
 	}
-	return 1;
-}
-
-int HuffmanTree_decode(const HuffmanTree *tree, bool *decoded, uint32_t *result, size_t *treepos,
-		uint32_t bit)
-{	// Decodes a symbol from the tree
-	const vector32_t *tree2d = tree->tree2d;
-	uint32_t numcodes = (uint32_t) tree2d->size / 2;
-	if (*treepos >= numcodes)
-		return 11; // error: you appeared outside the codetree
-	*result = tree2d->data[2 * (*treepos) + bit];
-	*decoded = (*result < numcodes);
-	*treepos = *decoded ? 0 : *result - numcodes;
 	return 0;
 }
 
@@ -392,290 +286,288 @@ int HuffmanTree_decode(const HuffmanTree *tree, bool *decoded, uint32_t *result,
 
 int Inflator_error;
 
-uint32_t Zlib_readBitFromStream(size_t *bitp, const uint8_t *bits)
-{
-	uint32_t result = (bits[*bitp >> 3] >> (*bitp & 0x7)) & 1;
-	(*bitp)++;
-	return result;
+typedef struct {
+	const uint8_t *in;
+	size_t inlength;
+	size_t inpos; // next byte to load into bitbuf; runs past inlength when zeros were loaded
+	uint64_t bitbuf; // bits not consumed yet, the next one lowest
+	uint32_t bitcount;
+	HuffmanTree codetree, codetreeD, codelengthcodetree;
+} Inflator;
+
+typedef uint64_t inflate_u64 __attribute__((aligned(1), may_alias));
+
+static inline void Inflator_refill(Inflator *s)
+{	// top up bitbuf to at least 56 bits, enough for a length and distance pair with extra bits.
+	// Past the end of the input zeros are loaded; Inflator_overrun() tells if any got used.
+	if (s->inpos + 8 <= s->inlength) {
+		// bytes only partly loaded are loaded again next time, with the same bits
+		s->bitbuf |= *(const inflate_u64 *)(s->in + s->inpos) << s->bitcount;
+		s->inpos += (63 - s->bitcount) >> 3;
+		s->bitcount |= 56;
+	} else
+		while (s->bitcount <= 56) {
+			if (s->inpos < s->inlength)
+				s->bitbuf |= (uint64_t) s->in[s->inpos] << s->bitcount;
+			s->inpos++;
+			s->bitcount += 8;
+		}
 }
 
-uint32_t Zlib_readBitsFromStream(size_t *bitp, const uint8_t *bits, size_t nbits)
-{
-	uint32_t i, result = 0;
-	for (i = 0; i < nbits; i++)
-		result += (Zlib_readBitFromStream(bitp, bits)) << i;
+static inline bool Inflator_overrun(const Inflator *s)
+{	// have bits past the end of the input been consumed?
+	return s->inpos > s->inlength && s->inpos * 8 - s->bitcount > s->inlength * 8;
+}
+
+static inline uint32_t Inflator_readBits(Inflator *s, uint32_t nbits)
+{	// bitbuf must hold nbits
+	uint32_t result = (uint32_t) s->bitbuf & ((1 << nbits) - 1);
+	s->bitbuf >>= nbits;
+	s->bitcount -= nbits;
 	return result;
 }
 
-void Inflator_generateFixedTrees(HuffmanTree *tree, HuffmanTree *treeD)
+static inline uint32_t Inflator_huffmanDecodeSymbol(Inflator *s, const HuffmanTree *codetree)
+{	// decode a single symbol with the given code table; bitbuf must hold HUFFMAN_MAXBITS bits
+	uint32_t entry = codetree->table[(uint32_t) s->bitbuf & ((1 << codetree->rootbits) - 1)];
+	if (entry & 0xff00) { // second level table
+		Inflator_readBits(s, entry & 0xff);
+		entry = codetree->table[(entry >> 16) +
+				((uint32_t) s->bitbuf & ((1 << ((entry >> 8) & 0xff)) - 1))];
+	}
+	if ((entry & 0xff) == 0) {
+		Inflator_error = 11; // error: you appeared outside the codetree
+		return 0;
+	}
+	Inflator_readBits(s, entry & 0xff);
+	return entry >> 16;
+}
+
+void Inflator_generateFixedTrees(Inflator *s)
 {	// get the tree of a deflated block with fixed tree
+	uint8_t bitlen[288 + 32];
 	size_t i;
-	vector32_t *bitlen, *bitlenD;
-	bitlen = vector32_new(288, 8);
-	bitlenD = vector32_new(32, 5);
+	for (i = 0; i <= 143; i++)
+		bitlen[i] = 8;
 	for (i = 144; i <= 255; i++)
-		bitlen->data[i] = 9;
+		bitlen[i] = 9;
 	for (i = 256; i <= 279; i++)
-		bitlen->data[i] = 7;
-	HuffmanTree_makeFromLengths(tree, bitlen, 15);
-	HuffmanTree_makeFromLengths(treeD, bitlenD, 15);
-}
-
-uint32_t Inflator_huffmanDecodeSymbol(const uint8_t *in, size_t *bp, const HuffmanTree *codetree,
-		size_t inlength)
-{	// decode a single symbol from given list of bits with given code tree. returns the symbol
-	bool decoded = false;
-	uint32_t ct = 0;
-	size_t treepos = 0;
-	for (;;) {
-		if ((*bp & 0x07) == 0 && (*bp >> 3) > inlength) {
-			Inflator_error = 10; // error: end reached without endcode
-			return 0;
-		}
-		Inflator_error = HuffmanTree_decode(codetree, &decoded, &ct, &treepos,
-				Zlib_readBitFromStream(bp, in));
-		if (Inflator_error)
-			return 0; // stop, an error happened
-		if (decoded)
-			return ct;
-	}
+		bitlen[i] = 7;
+	for (i = 280; i <= 287; i++)
+		bitlen[i] = 8;
+	for (i = 288; i < 288 + 32; i++)
+		bitlen[i] = 5;
+	Inflator_error = HuffmanTree_makeFromLengths(&s->codetree, bitlen, 288, HUFFMAN_ROOTBITS);
+	if (!Inflator_error)
+		Inflator_error = HuffmanTree_makeFromLengths(&s->codetreeD, bitlen + 288, 32,
+				HUFFMAN_ROOTBITSD);
 }
 
-void Inflator_getTreeInflateDynamic(HuffmanTree *tree, HuffmanTree *treeD, const uint8_t *in,
-		size_t *bp, size_t inlength)
+void Inflator_getTreeInflateDynamic(Inflator *s)
 {	// get the tree of a deflated block with dynamic tree, the tree itself is also Huffman
 	// compressed with a known tree
-	size_t i, n;
-	size_t HLIT;
-	size_t HDIST;
-	size_t HCLEN;
-	size_t replength;
-	vector32_t *codelengthcode;
-	HuffmanTree *codelengthcodetree = HuffmanTree_new(); // the code tree for code length codes
-	vector32_t *bitlen, *bitlenD;
-	bitlen = vector32_new(288, 0);
-	bitlenD = vector32_new(32, 0);
-	if (*bp >> 3 >= inlength - 2) {
-		Inflator_error = 49; // the bit pointer is or will go past the memory
-		return;
-	}
-	HLIT = Zlib_readBitsFromStream(bp, in, 5) + 257;	// number of literal/length codes + 257
-	HDIST = Zlib_readBitsFromStream(bp, in, 5) + 1;	// number of dist codes + 1
-	HCLEN = Zlib_readBitsFromStream(bp, in, 4) + 4;	// number of code length codes + 4
+	uint8_t codelengthcode[19], bitlen[288 + 32]; // literal/length code lengths, then distance
+	size_t i, n, HLIT, HDIST, HCLEN, replength;
+	uint32_t value;
+	Inflator_refill(s);
+	HLIT = Inflator_readBits(s, 5) + 257;	// number of literal/length codes + 257
+	HDIST = Inflator_readBits(s, 5) + 1;	// number of dist codes + 1
+	HCLEN = Inflator_readBits(s, 4) + 4;	// number of code length codes + 4
 	// lengths of tree to decode the lengths of the dynamic tree
-	codelengthcode = vector32_new(19, 0);
-	for (i = 0; i < 19; i++)
-		codelengthcode->data[CLCL[i]] = (i < HCLEN) ? Zlib_readBitsFromStream(bp, in, 3) : 0;
-	Inflator_error = HuffmanTree_makeFromLengths(codelengthcodetree, codelengthcode, 7);
+	for (i = 0; i < 19; i++) {
+		Inflator_refill(s);
+		codelengthcode[CLCL[i]] = (i < HCLEN) ? Inflator_readBits(s, 3) : 0;
+	}
+	Inflator_error = HuffmanTree_makeFromLengths(&s->codelengthcodetree, codelengthcode, 19,
+			HUFFMAN_ROOTBITSCL);
 	if (Inflator_error)
 		return;
 
 	for (i = 0; i < HLIT + HDIST; ) {
-		uint32_t code = Inflator_huffmanDecodeSymbol(in, bp, codelengthcodetree, inlength);
-		if (Inflator_error) {
+		Inflator_refill(s);
+		if (Inflator_overrun(s)) {
+			Inflator_error = 50; // error, bit pointer jumps past memory
 			return;
 		}
+		uint32_t code = Inflator_huffmanDecodeSymbol(s, &s->codelengthcodetree);
+		if (Inflator_error)
+			return;
 		if (code <= 15) { // a length code
-			if (i < HLIT) {
-				bitlen->data[i++] = code;
-			} else {
-				bitlenD->data[i++ - HLIT] = code;
-			}
-		} else if (code == 16)
-		{ // repeat previous
-			uint32_t value; // set value to the previous code
-			if (*bp >> 3 >= inlength)
-			{
-				Inflator_error = 50; // error, bit pointer jumps past memory
+			bitlen[i++] = code;
+			continue;
+		} else if (code == 16) { // repeat previous
+			if (i == 0) {
+				Inflator_error = 54; // error: there is no previous length to repeat
 				return;
 			}
-			replength = 3 + Zlib_readBitsFromStream(bp, in, 2);
-
-			if ((i - 1) < HLIT) {
-				value = bitlen->data[i - 1];
-			} else {
-				value = bitlenD->data[i - HLIT - 1];
-			}
-			for (n = 0; n < replength; n++) { // repeat this value in the next lengths
-				if (i >= HLIT + HDIST) {
-					Inflator_error = 13; // error: i is larger than the amount of codes
-					return;
-				}
-				if (i < HLIT) {
-					bitlen->data[i++] = value;
-				} else {
-					bitlenD->data[i++ - HLIT] = value;
-				}
-			}
+			value = bitlen[i - 1];
+			replength = 3 + Inflator_readBits(s, 2);
 		} else if (code == 17) { // repeat "0" 3-10 times
-			if (*bp >> 3 >= inlength) {
-				Inflator_error = 50; // error, bit pointer jumps past memory
-				return;
-			}
-			replength = 3 + Zlib_readBitsFromStream(bp, in, 3);
-			for (n = 0; n < replength; n++) { // repeat this value in the next lengths
-				if (i >= HLIT + HDIST) {
-					Inflator_error = 14; // error: i is larger than the amount of codes
-					return;
-				}
-				if (i < HLIT)
-				{
-					bitlen->data[i++] = 0;
-				}
-				else
-				{
-					bitlenD->data[i++ - HLIT] = 0;
-				}
-			}
+			value = 0;
+			replength = 3 + Inflator_readBits(s, 3);
 		} else if (code == 18) { // repeat "0" 11-138 times
-			if (*bp >> 3 >= inlength) {
-				Inflator_error = 50; // error, bit pointer jumps past memory
-				return;
-			}
-			replength = 11 + Zlib_readBitsFromStream(bp, in, 7);
-			for (n = 0; n < replength; n++) { // repeat this value in the next lengths
-				if (i >= HLIT + HDIST) {
-					Inflator_error = 15; // error: i is larger than the amount of codes
-					return;
-				}
-				if (i < HLIT)
-				{
-					bitlen->data[i++] = 0;
-				}
-				else
-				{
-					bitlenD->data[i++ - HLIT] = 0;
-				}
-			}
+			value = 0;
+			replength = 11 + Inflator_readBits(s, 7);
 		} else {
 			Inflator_error = 16; // error: an nonexitent code appeared. This can never happen.
 			return;
 		}
+		for (n = 0; n < replength; n++) { // repeat this value in the next lengths
+			if (i >= HLIT + HDIST) {
+				Inflator_error = 13 + (code - 16); // error: i is larger than the amount of codes
+				return;
+			}
+			bitlen[i++] = value;
+		}
 	}
-	if (bitlen->data[256] == 0) {
+	if (Inflator_overrun(s)) {
+		Inflator_error = 50; // error, bit pointer jumps past memory
+		return;
+	}
+	if (bitlen[256] == 0) {
 		Inflator_error = 64; // the length of the end code 256 must be larger than 0
 		return;
 	}
 	// now we've finally got HLIT and HDIST, so generate the code trees, and the function is done
-	Inflator_error = HuffmanTree_makeFromLengths(tree, bitlen, 15);
+	Inflator_error = HuffmanTree_makeFromLengths(&s->codetree, bitlen, HLIT, HUFFMAN_ROOTBITS);
 	if (Inflator_error)
 		return;
-	Inflator_error = HuffmanTree_makeFromLengths(treeD, bitlenD, 15);
-	if (Inflator_error)
+	Inflator_error = HuffmanTree_makeFromLengths(&s->codetreeD, bitlen + HLIT, HDIST,
+			HUFFMAN_ROOTBITSD);
+}
+
+#define INFLATE_COPY8(d, s)	(*(inflate_u64 *)(d) = *(const inflate_u64 *)(s))
+
+static inline void Inflator_copyMatch(uint8_t *dst, size_t dist, size_t length, size_t room)
+{	// copy length bytes from dist bytes back; up to room bytes may be written at dst
+	const uint8_t *from = dst - dist;
+	uint8_t *end = dst + length;
+	size_t period, n;
+	if (length + 8 > room) {
+		while (dst < end)
+			*dst++ = *from++;
 		return;
+	}
+	if (dist < 8) {
+		// short distances repeat a pattern: write its first copies byte by byte until the
+		// pattern can be moved 8 bytes at a time
+		for (period = dist; period < 8; period += dist)
+			;
+		for (n = (period < length) ? period : length; n; n--)
+			*dst++ = *from++;
+		from = dst - period;
+	}
+	while (dst < end) { // may write up to 7 bytes past end
+		INFLATE_COPY8(dst, from);
+		dst += 8;
+		from += 8;
+	}
 }
 
-void Inflator_inflateHuffmanBlock(vector8_t *out, const uint8_t *in, size_t *bp, size_t *pos,
-		size_t inlength, uint32_t btype)
+void Inflator_inflateHuffmanBlock(vector8_t *out, Inflator *s, size_t *pos, uint32_t btype)
 {
-	HuffmanTree *codetree, *codetreeD; // the code tree for Huffman codes, dist codes
-	codetree = HuffmanTree_new();
-	codetreeD = HuffmanTree_new();
 	if (btype == 1)
-		Inflator_generateFixedTrees(codetree, codetreeD);
-	else if (btype == 2) {
-		Inflator_getTreeInflateDynamic(codetree, codetreeD, in, bp, inlength);
-		if (Inflator_error)
-			return;
-	}
+		Inflator_generateFixedTrees(s);
+	else
+		Inflator_getTreeInflateDynamic(s);
+	if (Inflator_error)
+		return;
 	for (;;) {
-		uint32_t code = Inflator_huffmanDecodeSymbol(in, bp, codetree, inlength);
-		if (Inflator_error)
-			return;
-		if (code == 256) // end code
-		{
+		Inflator_refill(s);
+		if (Inflator_overrun(s)) {
+			Inflator_error = 10; // error: end reached without endcode
 			return;
 		}
-		else if (code <= 255) { // literal symbol
-			if (*pos >= out->size)
-			{
-				vector8_resize(out, (*pos + 1) * 2); // reserve more room
-			}
-			out->data[(*pos)++] = (uint8_t) code;
-		} else if (code >= 257 && code <= 285)
-		{ // length code
-			size_t length = LENBASE[code - 257], numextrabits = LENEXTRA[code - 257];
-			if ((*bp >> 3) >= inlength)
-			{
-				Inflator_error = 51; // error, bit pointer will jump past memory
+		uint32_t code = Inflator_huffmanDecodeSymbol(s, &s->codetree);
+		if (Inflator_error)
+			return;
+		if (code <= 255) { // literal symbol
+			if (*pos >= out->size && !vector8_resize(out, (*pos + 1) * 2)) { // reserve more room
+				Inflator_error = 83; // error: not enough memory
 				return;
 			}
-			length += Zlib_readBitsFromStream(bp, in, numextrabits);
-			uint32_t codeD = Inflator_huffmanDecodeSymbol(in, bp, codetreeD, inlength);
+			out->data[(*pos)++] = (uint8_t) code;
+		} else if (code == 256) { // end code
+			if (Inflator_overrun(s))
+				Inflator_error = 10; // error: end reached without endcode
+			return;
+		} else if (code <= 285) { // length code
+			size_t length = LENBASE[code - 257] + Inflator_readBits(s, LENEXTRA[code - 257]);
+			uint32_t codeD = Inflator_huffmanDecodeSymbol(s, &s->codetreeD);
 			if (Inflator_error)
 				return;
 			if (codeD > 29) {
 				Inflator_error = 18; // error: invalid dist code (30-31 are never used)
 				return;
 			}
-			uint32_t dist = DISTBASE[codeD], numextrabitsD = DISTEXTRA[codeD];
-			if ((*bp >> 3) >= inlength) {
-				Inflator_error = 51; // error, bit pointer will jump past memory
+			size_t dist = DISTBASE[codeD] + Inflator_readBits(s, DISTEXTRA[codeD]);
+			if (dist > *pos) {
+				Inflator_error = 52; // error: dist goes back past the start of the output
 				return;
 			}
-			dist += Zlib_readBitsFromStream(bp, in, numextrabitsD);
-			size_t start = *pos, back = start - dist; // backwards
-			if (*pos + length >= out->size)
-				vector8_resize(out, (*pos + length) * 2); // reserve more room
-			size_t i;
-			for (i = 0; i < length; i++) {
-				out->data[(*pos)++] = out->data[back++];
-				if (back >= start)
-					back = start - dist;
+			if (*pos + length >= out->size && !vector8_resize(out, (*pos + length) * 2)) {
+				Inflator_error = 83; // error: not enough memory
+				return;
 			}
-		}
+			Inflator_copyMatch(out->data + *pos, dist, length, out->allocsize - *pos);
+			*pos += length;
+		} // codes 286 and 287 are not used and skipped
 	}
 }
 
-void Inflator_inflateNoCompression(vector8_t *out, const uint8_t *in, size_t *bp, size_t *pos,
-		size_t inlength)
+void Inflator_inflateNoCompression(vector8_t *out, Inflator *s, size_t *pos)
 {
-	while ((*bp & 0x7) != 0)
-		(*bp)++; // go to first boundary of byte
-	size_t p = *bp / 8;
-	if (p >= inlength - 4) {
+	// go to first boundary of byte, and give back the whole bytes still in bitbuf
+	Inflator_readBits(s, s->bitcount & 0x7);
+	size_t p = s->inpos - s->bitcount / 8;
+	s->bitbuf = 0;
+	s->bitcount = 0;
+	if (p + 4 > s->inlength) {
 		Inflator_error = 52; // error, bit pointer will jump past memory
 		return;
 	}
+	const uint8_t *in = s->in;
 	uint32_t LEN = in[p] + 256 * in[p + 1], NLEN = in[p + 2] + 256 * in[p + 3];
 	p += 4;
 	if (LEN + NLEN != 65535) {
 		Inflator_error = 21; // error: NLEN is not one's complement of LEN
 		return;
 	}
-	if (*pos + LEN >= out->size)
-		vector8_resize(out, *pos + LEN);
-	if (p + LEN > inlength) {
+	if (*pos + LEN >= out->size && !vector8_resize(out, *pos + LEN)) {
+		Inflator_error = 83; // error: not enough memory
+		return;
+	}
+	if (p + LEN > s->inlength) {
 		Inflator_error = 23; // error: reading outside of in buffer
 		return;
 	}
-	uint32_t n;
-	for (n = 0; n < LEN; n++)
-		out->data[(*pos)++] = in[p++]; // read LEN bytes of literal data
-	*bp = p * 8;
+	memcpy(out->data + *pos, in + p, LEN); // read LEN bytes of literal data
+	*pos += LEN;
+	s->inpos = p + LEN;
 }
 
 void Inflator_inflate(vector8_t *out, const vector8_t *in, size_t inpos)
 {
-	size_t bp = 0, pos = 0; // bit pointer and byte pointer
+	Inflator s = { &in->data[inpos], in->size - inpos, 0, 0, 0 };
+	size_t pos = 0; // byte pointer
 	Inflator_error = 0;
 	uint32_t BFINAL = 0;
 	while (!BFINAL && !Inflator_error) {
-		if (bp >> 3 >= in->size) {
+		Inflator_refill(&s);
+		if (s.inpos * 8 - s.bitcount >= s.inlength * 8) {
 			Inflator_error = 52; // error, bit pointer will jump past memory
 			return;
 		}
-		BFINAL = Zlib_readBitFromStream(&bp, &in->data[inpos]);
-		uint32_t BTYPE = Zlib_readBitFromStream(&bp, &in->data[inpos]);
-		BTYPE += 2 * Zlib_readBitFromStream(&bp, &in->data[inpos]);
+		BFINAL = Inflator_readBits(&s, 1);
+		uint32_t BTYPE = Inflator_readBits(&s, 2);
 		if (BTYPE == 3) {
 			Inflator_error = 20; // error: invalid BTYPE
 			return;
 		}
 		else if (BTYPE == 0)
-			Inflator_inflateNoCompression(out, &in->data[inpos], &bp, &pos, in->size);
+			Inflator_inflateNoCompression(out, &s, &pos);
 		else
-			Inflator_inflateHuffmanBlock(out, &in->data[inpos], &bp, &pos, in->size, BTYPE);
+			Inflator_inflateHuffmanBlock(out, &s, &pos, BTYPE);
 	}
 	if (!Inflator_error)
 		vector8_resize(out, pos); // Only now we know the true size of out, resize it to that
@@ -1318,9 +1210,7 @@ int main(int argc, char **argv)
 	fclose(outfp);
 
 #ifdef ALLOC_DEBUG
-	png_alloc_node_t *node;
-	for (node = png_alloc_head, n = 1; node; node = node->next, n++)
-		printf("node %d (%p) addr = %p, size = %ld\n", n, node, node->addr, node->size);
+	printf("arena: %lu allocations live, %lu bytes in use, peak %lu\n", png_arena.live, png_arena.bytesInUse, png_arena.peakBytes);
 #endif
 	png_alloc_free_all(); // also frees info and image data from PNG_decode
 
@@ -45,8 +45,6 @@ static void WakeKernel(IOHibernateImageHeader * header)
 	unsigned int 	count;
 	unsigned int 	page;
 	unsigned int 	compressedSize;
-	int32_t   	byteCnt;
-	u_int32_t 	lowHalf, highHalf;
 	u_int32_t 	sum;
 
 	printf("\nWake Kernel!\n");
@@ -65,9 +63,6 @@ static void WakeKernel(IOHibernateImageHeader * header)
 	{
 		compressedSize = 4096;
 
-		lowHalf = 1;
-		highHalf = 0;
-
 		for (cnt = 0; cnt < compressedSize; cnt += 0x20) {
 			dst[0] = src[0];
 			dst[1] = src[1];
@@ -77,17 +72,12 @@ static void WakeKernel(IOHibernateImageHeader * header)
 			dst[5] = src[5];
 			dst[6] = src[6];
 			dst[7] = src[7];
-			for (byteCnt = 0; byteCnt < 0x20; byteCnt++) {
-				lowHalf += ((u_int8_t *) dst)[byteCnt];
-				highHalf += lowHalf;
-			}
 			src += 8;
 			dst += 8;
 		}
 
-		lowHalf  %= 65521L;
-		highHalf %= 65521L;
-		sum += (highHalf << 16) | lowHalf;
+		// Sum the page while it is still in the cache.
+		sum += adler32((u_int8_t *) dst - compressedSize, compressedSize);
 	}
 	header->actualRestore1Sum = sum;
 	startprog (proc, header);
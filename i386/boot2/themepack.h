@@ -0,0 +1,50 @@
+/*
+ * themepack.h - Pre-decoded images of a GUI theme.
+ *
+ * Written by the themepack utility into the theme folder it describes
+ * (e.g. /Extra/Themes/Default/theme.pack) and read by initGUI() instead of
+ * theme.plist and the PNG files. All fields are little endian.
+ *
+ * The file is a ThemePackHeader followed by numImages ThemePackImage
+ * records sorted by name without .png (strcmp order, which the booter's
+ * binary search relies on), the theme.plist bytes with a NUL
+ * added, and the pixels of every image: width * height pixel_t values in
+ * the order the GUI draws them (blue, green, red, alpha), each image
+ * starting on a 16 byte boundary.
+ *
+ * The pack is only used while theme.plist and every PNG file in the theme
+ * folder carry the modification times recorded for them, and no PNG file
+ * has been added since. The folder's own time is not recorded: writing the
+ * pack into it changes that.
+ */
+
+#ifndef __BOOT2_THEMEPACK_H
+#define __BOOT2_THEMEPACK_H
+
+#define kThemePackFileName	"theme.pack"
+#define kThemePackMagic		0x4B504854	/* 'THPK' */
+#define kThemePackVersion	1
+
+#define kThemePackNameLen	32		/* as image_t.name */
+
+typedef struct ThemePackHeader {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	length;			/* size of the whole file */
+	uint32_t	plistTime;		/* mtime of theme.plist */
+	uint32_t	plistOffset;		/* from the start of the file */
+	uint32_t	plistLength;		/* without the NUL */
+	uint32_t	numImages;
+	uint32_t	reserved;
+} ThemePackHeader;
+
+typedef struct ThemePackImage {
+	char		name[kThemePackNameLen];	/* file name without .png */
+	uint32_t	time;			/* mtime of the PNG file */
+	uint16_t	width;
+	uint16_t	height;
+	uint32_t	offset;			/* of the pixels, from the start of the file */
+	uint32_t	reserved;
+} ThemePackImage;
+
+#endif /* !__BOOT2_THEMEPACK_H */
@@ -0,0 +1,122 @@
+/*
+ *  adler32.c - Adler-32 checksum shared by the kernel cache, mkext and
+ *  hibernation image checks.
+ *
+ *  adler32_update() can be fed a buffer in pieces, starting from 1, so a
+ *  decompressor can checksum its output as it goes. Blocks of 16 bytes are
+ *  summed with SSE2 (pmaddwd) when cpuid reports it; the scalar loop is
+ *  used otherwise and for the tail of each block run.
+ */
+
+#include "libsa.h"
+
+#define BASE	65521UL	/* largest prime smaller than 65536 */
+#define NMAX	5552	/* largest n such that 255n(n+1)/2 + (n+1)(BASE-1) <= 2^32-1 */
+
+#define CPUID_FEATURE_SSE2	(1 << 26)	/* edx of leaf 1 */
+
+typedef unsigned char adler_u8x16 __attribute__((vector_size(16), aligned(1), may_alias));
+typedef unsigned short adler_u16x8 __attribute__((vector_size(16)));
+typedef short adler_s16x8 __attribute__((vector_size(16)));
+typedef int adler_s32x4 __attribute__((vector_size(16)));
+
+static int adler32_sse2 = -1;	/* not probed yet */
+
+//==========================================================================
+
+static int adler32_has_sse2(void)
+{
+	unsigned long eax = 1, ebx, ecx = 0, edx;
+
+#ifdef __i386__
+	// ebx may hold the PIC base, so save it around cpuid.
+	__asm__ volatile ("pushl %%ebx; cpuid; movl %%ebx, %1; popl %%ebx"
+			  : "+a" (eax), "=r" (ebx), "+c" (ecx), "=d" (edx));
+#else
+	__asm__ volatile ("cpuid" : "+a" (eax), "=b" (ebx), "+c" (ecx), "=d" (edx));
+#endif
+
+	return (edx & CPUID_FEATURE_SSE2) != 0;
+}
+
+//==========================================================================
+// Add blocks * 16 bytes to s1 and s2; blocks * 16 must not exceed NMAX.
+//
+// For each block s2 gains 16 times the s1 it started with plus the bytes
+// weighted 16, 15, ... 1. The bytes are split into their even and odd
+// halves as 16 bit lanes, so pmaddwd can do the weighting and the sums.
+
+static void adler32_blocks_sse2(unsigned long *s1, unsigned long *s2, const unsigned char *buf, long blocks)
+{
+	const adler_s16x8 ones = { 1, 1, 1, 1, 1, 1, 1, 1 };
+	const adler_s16x8 evenWeights = { 16, 14, 12, 10, 8, 6, 4, 2 };
+	const adler_s16x8 oddWeights = { 15, 13, 11, 9, 7, 5, 3, 1 };
+	adler_s32x4 vs1 = { 0, 0, 0, 0 }, vs1Before = { 0, 0, 0, 0 }, vs2 = { 0, 0, 0, 0 };
+	adler_u16x8 v, even, odd;
+	unsigned long sum1, sum1Before, sum2;
+	long n;
+
+	for (n = 0; n < blocks; n++, buf += 16)
+	{
+		v = (adler_u16x8)*(const adler_u8x16 *)buf;
+		even = v & 0xFF;
+		odd = v >> 8;
+
+		vs1Before += vs1;
+		vs1 += __builtin_ia32_pmaddwd128((adler_s16x8)(even + odd), ones);
+		vs2 += __builtin_ia32_pmaddwd128((adler_s16x8)even, evenWeights);
+		vs2 += __builtin_ia32_pmaddwd128((adler_s16x8)odd, oddWeights);
+	}
+
+	sum1 = (unsigned long)vs1[0] + vs1[1] + vs1[2] + vs1[3];
+	sum1Before = (unsigned long)vs1Before[0] + vs1Before[1] + vs1Before[2] + vs1Before[3];
+	sum2 = (unsigned long)vs2[0] + vs2[1] + vs2[2] + vs2[3];
+
+	*s2 += blocks * 16 * *s1 + 16 * sum1Before + sum2;
+	*s1 += sum1;
+}
+
+//==========================================================================
+
+unsigned long adler32_update(unsigned long adler, const unsigned char *buf, long len)
+{
+	unsigned long s1 = adler & 0xFFFF;
+	unsigned long s2 = (adler >> 16) & 0xFFFF;
+	long k;
+
+	if (adler32_sse2 < 0)
+	{
+		adler32_sse2 = adler32_has_sse2();
+	}
+
+	while (len > 0)
+	{
+		k = len < NMAX ? len : NMAX;
+		len -= k;
+
+		if (adler32_sse2 && k >= 16)
+		{
+			adler32_blocks_sse2(&s1, &s2, buf, k / 16);
+			buf += k & ~15;
+			k &= 15;
+		}
+
+		while (k--)
+		{
+			s1 += *buf++;
+			s2 += s1;
+		}
+
+		s1 %= BASE;
+		s2 %= BASE;
+	}
+
+	return (s2 << 16) | s1;
+}
+
+//==========================================================================
+
+unsigned long adler32(const unsigned char *buf, long len)
+{
+	return adler32_update(1, buf, len);
+}
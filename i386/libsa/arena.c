@@ -0,0 +1,329 @@
+/*
+ *  arena.c - Region allocator for data that lives as long as one boot phase.
+ *
+ *  Allocations are carved from chunks with a bump pointer and are given
+ *  back all at once, either to a mark taken earlier or by resetting the
+ *  arena.  Requests larger than a quarter of the chunk size get a chunk of
+ *  their own, so big buffers can still be freed one by one.
+ */
+
+#include "libsa.h"
+
+#define ARENA_DEFAULT_CHUNK	(64 * 1024)
+#define ARENA_ALIGN		16
+
+#define ARENA_LARGE		1	/* allocation owns its chunk */
+
+struct arena_chunk {
+	struct arena_chunk *	next;
+	char *			top;		/* first free byte */
+	char *			limit;		/* end of the chunk */
+	unsigned long		serial;		/* creation order inside the arena */
+};
+
+// Precedes every allocation; 16 bytes so the data stays aligned.
+struct arena_header {
+	size_t			size;		/* requested size */
+	struct arena_chunk *	chunk;
+	unsigned long		flags;
+	unsigned long		pad;
+};
+
+struct arena *arena_list;
+
+static struct arena_chunk *arena_new_chunk(struct arena *a, size_t size);
+static void arena_free_chunks(struct arena_chunk *chunk);
+
+#define ARENA_ROUND(size)	(((size) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+#define ARENA_HEADER(ptr)	((struct arena_header *)(ptr) - 1)
+
+//==========================================================================
+
+void arena_init(struct arena *a, const char *name, size_t chunkSize)
+{
+	bzero(a, sizeof(*a));
+	a->name = name;
+	a->chunkSize = chunkSize;
+}
+
+//==========================================================================
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_chunk *chunk;
+	struct arena_header *header;
+	size_t need;
+
+	if (a->chunkSize == 0)
+	{
+		a->chunkSize = ARENA_DEFAULT_CHUNK;
+	}
+
+	// Arenas show up in arena_list once they have been used.
+	if (!a->registered)
+	{
+		a->registered = 1;
+		a->next = arena_list;
+		arena_list = a;
+	}
+
+	need = sizeof(struct arena_header) + ARENA_ROUND(size);
+
+	if (need > a->chunkSize / 4)
+	{
+		chunk = arena_new_chunk(a, need);
+		if (chunk == 0)
+		{
+			return 0;
+		}
+
+		chunk->next = a->large;
+		a->large = chunk;
+		header = (struct arena_header *)chunk->top;
+		header->flags = ARENA_LARGE;
+	}
+	else
+	{
+		chunk = a->chunks;
+
+		if (chunk == 0 || chunk->top + need > chunk->limit)
+		{
+			// Reuse the chunk kept by the last reset before asking zalloc.
+			if (a->spare)
+			{
+				chunk = a->spare;
+				a->spare = 0;
+				chunk->top = (char *)(chunk + 1);
+				chunk->serial = ++a->serial;
+			}
+			else
+			{
+				chunk = arena_new_chunk(a, a->chunkSize - sizeof(struct arena_chunk));
+				if (chunk == 0)
+				{
+					return 0;
+				}
+			}
+
+			chunk->next = a->chunks;
+			a->chunks = chunk;
+		}
+
+		header = (struct arena_header *)chunk->top;
+		header->flags = 0;
+	}
+
+	chunk->top += need;
+	header->size = size;
+	header->chunk = chunk;
+
+	a->live++;
+	a->bytesInUse += need;
+	if (a->bytesInUse > a->peakBytes)
+	{
+		a->peakBytes = a->bytesInUse;
+	}
+
+	bzero(header + 1, size);
+
+	return header + 1;
+}
+
+//==========================================================================
+// Grow an allocation, in place when it is the last one in its chunk.
+
+void *arena_realloc(struct arena *a, void *ptr, size_t size)
+{
+	struct arena_header *header;
+	struct arena_chunk *chunk;
+	size_t grow;
+	void *newptr;
+
+	if (ptr == 0)
+	{
+		return arena_alloc(a, size);
+	}
+
+	header = ARENA_HEADER(ptr);
+	chunk = header->chunk;
+
+	if (size <= header->size)
+	{
+		return ptr;
+	}
+
+	grow = ARENA_ROUND(size) - ARENA_ROUND(header->size);
+
+	if (!(header->flags & ARENA_LARGE) && chunk == a->chunks
+		&& (char *)ptr + ARENA_ROUND(header->size) == chunk->top
+		&& chunk->top + grow <= chunk->limit)
+	{
+		bzero((char *)ptr + header->size, size - header->size);
+		chunk->top += grow;
+		header->size = size;
+
+		a->bytesInUse += grow;
+		if (a->bytesInUse > a->peakBytes)
+		{
+			a->peakBytes = a->bytesInUse;
+		}
+
+		return ptr;
+	}
+
+	newptr = arena_alloc(a, size);
+	if (newptr)
+	{
+		bcopy(ptr, newptr, header->size);
+		arena_free(a, ptr);
+	}
+
+	return newptr;
+}
+
+//==========================================================================
+// Large allocations go back to zalloc right away and the most recent small
+// one is rolled back; the space of any other small one is reclaimed by the
+// next release or reset.
+
+void arena_free(struct arena *a, void *ptr)
+{
+	struct arena_header *header;
+	struct arena_chunk *chunk, **link;
+	size_t need;
+
+	if (ptr == 0)
+	{
+		return;
+	}
+
+	header = ARENA_HEADER(ptr);
+	chunk = header->chunk;
+	need = sizeof(struct arena_header) + ARENA_ROUND(header->size);
+
+	a->live--;
+	a->bytesInUse -= need;
+
+	if (header->flags & ARENA_LARGE)
+	{
+		for (link = &a->large; *link; link = &(*link)->next)
+		{
+			if (*link == chunk)
+			{
+				*link = chunk->next;
+				free(chunk);
+				break;
+			}
+		}
+	}
+	else if (chunk == a->chunks && (char *)header + need == chunk->top)
+	{
+		chunk->top = (char *)header;
+	}
+}
+
+//==========================================================================
+
+void arena_mark(struct arena *a, struct arena_mark *mark)
+{
+	mark->chunk = a->chunks;
+	mark->top = a->chunks ? a->chunks->top : 0;
+	mark->serial = a->serial;
+	mark->live = a->live;
+	mark->bytesInUse = a->bytesInUse;
+}
+
+//==========================================================================
+// Free everything allocated since the mark was taken.
+
+void arena_release(struct arena *a, struct arena_mark *mark)
+{
+	struct arena_chunk *chunk;
+
+	while (a->chunks && a->chunks != mark->chunk)
+	{
+		chunk = a->chunks;
+		a->chunks = chunk->next;
+		chunk->next = 0;
+		arena_free_chunks(chunk);
+	}
+
+	if (a->chunks)
+	{
+		a->chunks->top = mark->top;
+	}
+
+	// Large chunks are linked newest first.
+	while (a->large && a->large->serial > mark->serial)
+	{
+		chunk = a->large;
+		a->large = chunk->next;
+		free(chunk);
+	}
+
+	a->live = mark->live;
+	a->bytesInUse = mark->bytesInUse;
+}
+
+//==========================================================================
+// Free everything in the arena, keeping one chunk for the next phase.
+
+void arena_reset(struct arena *a)
+{
+	struct arena_chunk *chunk;
+
+	chunk = a->chunks;
+	if (chunk)
+	{
+		a->chunks = chunk->next;
+		chunk->next = 0;
+
+		if (a->spare)
+		{
+			free(a->spare);
+		}
+		a->spare = chunk;
+	}
+
+	arena_free_chunks(a->chunks);
+	arena_free_chunks(a->large);
+
+	a->chunks = 0;
+	a->large = 0;
+	a->live = 0;
+	a->bytesInUse = 0;
+}
+
+//==========================================================================
+
+static struct arena_chunk *arena_new_chunk(struct arena *a, size_t size)
+{
+	struct arena_chunk *chunk;
+
+	chunk = malloc(sizeof(struct arena_chunk) + size);
+	if (chunk == 0)
+	{
+		return 0;
+	}
+
+	chunk->next = 0;
+	chunk->top = (char *)(chunk + 1);
+	chunk->limit = chunk->top + size;
+	chunk->serial = ++a->serial;
+
+	return chunk;
+}
+
+//==========================================================================
+
+static void arena_free_chunks(struct arena_chunk *chunk)
+{
+	struct arena_chunk *next;
+
+	while (chunk)
+	{
+		next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+}
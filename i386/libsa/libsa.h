@@ -91,6 +91,7 @@ extern void bzero(void * dst, size_t len);
 extern void	*memset(void * dst, int c, size_t n);
 extern void	*memcpy(void * dst, const void * src, size_t len);
 extern int	memcmp(const void * p1, const void * p2, size_t len);
+extern void	*memchr(const void * s, int c, size_t n);
 extern int	strcmp(const char * s1, const char * s2);
 extern int	strncmp(const char * s1, const char * s2, size_t n);
 extern char	*strcpy(char * s1, const char * s2);
@@ -154,6 +155,61 @@ extern void	*safe_malloc(size_t size,const char *file, int line);
 extern void	free(void *start);
 extern void	*realloc(void *ptr, size_t size);
 
+struct malloc_stats {
+	unsigned long	mallocs;		/* successful allocations */
+	unsigned long	frees;
+	unsigned long	slabMallocs;		/* allocations served by the slab layer */
+	unsigned long	slabFrees;
+	unsigned long	slabPages;		/* slab pages carved so far */
+	unsigned long	bytesInUse;
+	unsigned long	peakBytesInUse;
+};
+
+extern void	malloc_get_stats(struct malloc_stats *stats);
+
+/*
+ * arena.c
+ */
+struct arena {
+	const char		*name;
+	size_t			chunkSize;	/* 0 selects the default */
+	struct arena_chunk	*chunks;	/* bump allocation chunks, newest first */
+	struct arena_chunk	*large;		/* dedicated chunks, newest first */
+	struct arena_chunk	*spare;		/* kept by arena_reset() */
+	unsigned long		serial;
+	unsigned long		live;		/* allocations not freed yet */
+	unsigned long		bytesInUse;
+	unsigned long		peakBytes;
+	struct arena		*next;		/* arena_list linkage */
+	int			registered;
+};
+
+struct arena_mark {
+	struct arena_chunk	*chunk;
+	char			*top;
+	unsigned long		serial;
+	unsigned long		live;
+	unsigned long		bytesInUse;
+};
+
+#define ARENA_INITIALIZER(name, chunkSize)	{ name, chunkSize }
+
+extern struct arena *arena_list;	/* every arena used so far */
+
+extern void	arena_init(struct arena *a, const char *name, size_t chunkSize);
+extern void	*arena_alloc(struct arena *a, size_t size);
+extern void	*arena_realloc(struct arena *a, void *ptr, size_t size);
+extern void	arena_free(struct arena *a, void *ptr);
+extern void	arena_mark(struct arena *a, struct arena_mark *mark);
+extern void	arena_release(struct arena *a, struct arena_mark *mark);
+extern void	arena_reset(struct arena *a);
+
+/*
+ * adler32.c
+ */
+extern unsigned long	adler32(const unsigned char *buf, long len);
+extern unsigned long	adler32_update(unsigned long adler, const unsigned char *buf, long len);
+
 /*
  * getsegbyname.c
  */
@@ -132,6 +132,53 @@ int memcmp(const void *p1, const void *p2, size_t len)
     return 0;
 }
 
+//==========================================================================
+// Once p is aligned, 16 bytes are compared at a time with SSE2.
+
+typedef char memchr_v16 __attribute__((vector_size(16)));
+
+void *memchr(const void *s, int c, size_t n)
+{
+	const unsigned char *p = s;
+	memchr_v16 pattern;
+	int mask, i;
+
+	while (n && ((unsigned long)p & 15))
+	{
+		if (*p == (unsigned char)c)
+		{
+			return (void *)p;
+		}
+		p++;
+		n--;
+	}
+
+	for (i = 0; i < 16; i++)
+	{
+		pattern[i] = (char)c;
+	}
+
+	for (; n >= 16; p += 16, n -= 16)
+	{
+		mask = __builtin_ia32_pmovmskb128((memchr_v16)(*(const memchr_v16 *)p == pattern));
+
+		if (mask)
+		{
+			return (void *)(p + __builtin_ctz(mask));
+		}
+	}
+
+	for (; n; p++, n--)
+	{
+		if (*p == (unsigned char)c)
+		{
+			return (void *)p;
+		}
+	}
+
+	return 0;
+}
+
 
 //==========================================================================
 
@@ -44,6 +44,43 @@ typedef struct {
 	size_t size;
 } zmem;
 
+// Slab layer for small objects. Slab pages come from a dedicated region at
+// the top of the heap, so free() recognises a slab object by its address
+// and recovers its size class from the page header in O(1).
+
+#define ZSLAB_PAGE	4096		/* bytes per slab page, power of 2 */
+#define ZSLAB_LEN	0x01000000	/* 16M slab region */
+#define ZSLAB_MAX	512		/* largest size served from slabs */
+#define ZSLAB_CLASSES	10
+
+typedef struct zslab {
+	struct zslab * next;		/* partial list / free page list */
+	struct zslab * prev;
+	char *         freeList;	/* free objects in this page */
+	unsigned short sizeClass;
+	unsigned short inUse;
+	unsigned short total;
+	unsigned short pad[7];		/* header is 32 bytes, keeps objects aligned */
+} zslab;
+
+static const unsigned short zslabSizes[ZSLAB_CLASSES] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512
+};
+
+// Size class for each 16 byte step up to ZSLAB_MAX.
+static const unsigned char zslabClass[ZSLAB_MAX / 16 + 1] = {
+	0, 0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7,
+	8, 8, 8, 8, 8, 8, 8, 8, 9, 9, 9, 9, 9, 9, 9, 9
+};
+
+static zslab * zslabPartial[ZSLAB_CLASSES];	/* pages with free objects */
+static zslab * zslabFreePages;			/* empty pages */
+static char *  zslab_base;
+static char *  zslab_next;			/* first never used page */
+static char *  zslab_end;
+
+static struct malloc_stats zstats;
+
 static zmem * zalloced;
 static zmem * zavailable;
 static short  availableNodes, allocedNodes, totalNodes;
@@ -51,10 +88,12 @@ static char * zalloc_base;
 static char * zalloc_end;
 static void  (*zerror)(char *, size_t, const char *, int);
 
+static void * zslab_alloc(size_t size);
+static void   zslab_free(char * start);
 static void   zallocate(char * start,int size);
-static void   zinsert(zmem * zp, int ndx);
-static void   zdelete(zmem * zp, int ndx);
-static void   zcoalesce(void);
+static int    zsearch(zmem * zp, int count, char * start);
+static void   zinsert(zmem * zp, int ndx, int count);
+static void   zdelete(zmem * zp, int ndx, int count);
 
 #if ZDEBUG
 	size_t zalloced_size;
@@ -72,6 +111,8 @@ static void malloc_error(char *addr, size_t size, const char *file, int line)
 // define the block of memory that the allocator will use
 void malloc_init(char * start, int size, int nodes, void (*malloc_err_fn)(char *, size_t, const char *, int))
 {
+	int i;
+
 	zalloc_base         = start ? start : (char *)ZALLOC_ADDR;
 	totalNodes          = nodes ? nodes : ZALLOC_NODES;
 	zalloced            = (zmem *) zalloc_base;
@@ -83,8 +124,26 @@ void malloc_init(char * start, int size, int nodes, void (*malloc_err_fn)(char *
 		size = ZALLOC_LEN;
 	}
 
-	zavailable[0].size  = size - (zavailable[0].start - zalloc_base);
 	zalloc_end          = zalloc_base + size;
+
+	// Reserve the slab region at the top of large heaps only.
+	zslab_base = zslab_next = zslab_end = 0;
+
+	if (size >= 4 * ZSLAB_LEN)
+	{
+		zslab_end  = (char *)((unsigned long)zalloc_end & ~(ZSLAB_PAGE - 1));
+		zslab_base = zslab_next = zslab_end - ZSLAB_LEN;
+		zalloc_end = zslab_base;
+	}
+
+	for (i = 0; i < ZSLAB_CLASSES; i++)
+	{
+		zslabPartial[i] = 0;
+	}
+	zslabFreePages = 0;
+	bzero(&zstats, sizeof(zstats));
+
+	zavailable[0].size  = zalloc_end - zavailable[0].start;
 	availableNodes      = 1;
 	allocedNodes        = 0;
 	zerror              = malloc_err_fn ? malloc_err_fn : malloc_error;
@@ -113,6 +172,13 @@ void * safe_malloc(size_t size, const char *file, int line)
 	{
 		(*zerror)((char *)0xdeadbeef, 0, file, line);
         }
+
+	// Small objects come from the slabs while there is room for them.
+	if (size <= ZSLAB_MAX && (ret = zslab_alloc(size)) != 0)
+	{
+		return (void *) ret;
+	}
+
 #if BEST_FIT
 	smallestSize = 0;
 	bestFit = -1;
@@ -125,7 +191,7 @@ void * safe_malloc(size_t size, const char *file, int line)
 		if (zavailable[i].size == size)
 		{
 			zallocate(ret = zavailable[i].start, size);
-			zdelete(zavailable, i); availableNodes--;
+			zdelete(zavailable, i, availableNodes); availableNodes--;
 			goto done;
 		}
 #if BEST_FIT
@@ -165,6 +231,13 @@ done:
 	if (ret != 0)
 	{
 		bzero(ret, size);
+
+		zstats.mallocs++;
+		zstats.bytesInUse += size;
+		if (zstats.bytesInUse > zstats.peakBytesInUse)
+		{
+			zstats.peakBytesInUse = zstats.bytesInUse;
+		}
 	}
 #if ZDEBUG
 	zalloced_size += size;
@@ -175,7 +248,7 @@ done:
 void free(void * pointer)
 {
 	unsigned long rp;
-	int i, found = 0;
+	int i;
 	size_t tsize = 0;
 	char * start = pointer;
 
@@ -194,24 +267,27 @@ void free(void * pointer)
 		return;
 	}
 
-	for (i = 0; i < allocedNodes; i++)
+	if (start >= zslab_base && start < zslab_end)
 	{
-		if (zalloced[i].start == start)
-		{
-			tsize = zalloced[i].size;
+		zslab_free(start);
+		return;
+	}
+
+	i = zsearch(zalloced, allocedNodes, start);
+
+	if (i < allocedNodes && zalloced[i].start == start)
+	{
+		tsize = zalloced[i].size;
 #if ZDEBUG
-			zout -= tsize;
-			printf("    zz out %d\n", zout);
+		zout -= tsize;
+		printf("    zz out %d\n", zout);
 #endif
-			zdelete(zalloced, i); allocedNodes--;
-			found = 1;
+		zdelete(zalloced, i, allocedNodes); allocedNodes--;
 #if ZDEBUG
-			memset(pointer, 0x5A, tsize);
+		memset(pointer, 0x5A, tsize);
 #endif
-			break;
-		}
 	}
-	if (!found)
+	else
 	{
 		if (zerror)
 		{
@@ -223,82 +299,244 @@ void free(void * pointer)
 #if ZDEBUG
         zalloced_size -= tsize;
 #endif
+	zstats.frees++;
+	zstats.bytesInUse -= tsize;
 
-	for (i = 0; i < availableNodes; i++)
+	// The free list is address ordered: find the first node above us and
+	// merge with the neighbours on either side.
+	i = zsearch(zavailable, availableNodes, start);
+
+	if ((i > 0) && (zavailable[i-1].start + zavailable[i-1].size == start))
 	{
-		if ((start + tsize) == zavailable[i].start)  // merge it in
+		zavailable[i-1].size += tsize;
+
+		if ((i < availableNodes) && (start + tsize == zavailable[i].start))
 		{
-			zavailable[i].start = start;
-			zavailable[i].size += tsize;
-			zcoalesce();
-			return;
+			zavailable[i-1].size += zavailable[i].size;
+			zdelete(zavailable, i, availableNodes); availableNodes--;
+		}
+		return;
+	}
+
+	if ((i < availableNodes) && (start + tsize == zavailable[i].start))
+	{
+		zavailable[i].start = start;
+		zavailable[i].size += tsize;
+		return;
+	}
+
+	if (availableNodes + 1 > totalNodes)
+	{
+		if (zerror)
+		{
+			(*zerror)((char *)0xf000f000, 0, "free", 0);
 		}
+		return;
+	}
+
+	zinsert(zavailable, i, availableNodes); availableNodes++;
+	zavailable[i].start = start;
+	zavailable[i].size = tsize;
+}
+
+// Return the statistics gathered since malloc_init().
+void malloc_get_stats(struct malloc_stats * stats)
+{
+	*stats = zstats;
+}
+
+static void *
+zslab_alloc(size_t size)
+{
+	int    sizeClass, i;
+	zslab  *slab;
+	char   *obj;
+	size_t objSize;
+
+	sizeClass = zslabClass[size >> 4];
+	objSize = zslabSizes[sizeClass];
+	slab = zslabPartial[sizeClass];
 
-		if ((i > 0) && (zavailable[i-1].start + zavailable[i-1].size == start))
+	if (slab == 0)
+	{
+		// Take an empty page, or a fresh one from the slab region.
+		if (zslabFreePages)
 		{
-			zavailable[i-1].size += tsize;
-			zcoalesce();
-			return;
+			slab = zslabFreePages;
+			zslabFreePages = slab->next;
+		}
+		else if (zslab_next && zslab_next < zslab_end)
+		{
+			slab = (zslab *)zslab_next;
+			zslab_next += ZSLAB_PAGE;
+			zstats.slabPages++;
+		}
+		else
+		{
+			return 0;
 		}
 
-		if ((start + tsize) < zavailable[i].start)
+		slab->sizeClass = sizeClass;
+		slab->inUse     = 0;
+		slab->total     = (ZSLAB_PAGE - sizeof(zslab)) / objSize;
+		slab->freeList  = 0;
+
+		// Thread the free list through the objects, lowest address first.
+		for (i = slab->total - 1; i >= 0; i--)
 		{
-                        if (++availableNodes > totalNodes)
-			{
-				if (zerror)
-				{
-					(*zerror)((char *)0xf000f000, 0, "free", 0);
-				}
-			}
-			zinsert(zavailable, i); 
-			zavailable[i].start = start;
-			zavailable[i].size = tsize;
-			return;
+			obj = (char *)slab + sizeof(zslab) + i * objSize;
+			*(char **)obj = slab->freeList;
+			slab->freeList = obj;
+		}
+
+		slab->prev = 0;
+		slab->next = 0;
+		zslabPartial[sizeClass] = slab;
+	}
+
+	obj = slab->freeList;
+	slab->freeList = *(char **)obj;
+
+	// A full page leaves the partial list until something is freed.
+	if (++slab->inUse == slab->total)
+	{
+		zslabPartial[sizeClass] = slab->next;
+		if (slab->next)
+		{
+			slab->next->prev = 0;
 		}
+		slab->next = slab->prev = 0;
+	}
+
+	bzero(obj, objSize);
+
+	zstats.mallocs++;
+	zstats.slabMallocs++;
+	zstats.bytesInUse += objSize;
+	if (zstats.bytesInUse > zstats.peakBytesInUse)
+	{
+		zstats.peakBytesInUse = zstats.bytesInUse;
 	}
 
-	if (++availableNodes > totalNodes)
+	return obj;
+}
+
+static void
+zslab_free(char * start)
+{
+	zslab *slab;
+	int   sizeClass;
+
+	slab = (zslab *)((unsigned long)start & ~(ZSLAB_PAGE - 1));
+	sizeClass = slab->sizeClass;
+
+	if ((start >= zslab_next) || (slab->inUse == 0) || (((start - (char *)slab - sizeof(zslab)) % zslabSizes[sizeClass]) != 0))
 	{
 		if (zerror)
 		{
-			(*zerror)((char *)0xf000f000, 1, "free", 0);
+			(*zerror)(start, 0, "free", 0);
 		}
+		return;
 	}
-	zavailable[i].start = start;
-	zavailable[i].size  = tsize;
-	zcoalesce();
 
-	return;
+	zstats.frees++;
+	zstats.slabFrees++;
+	zstats.bytesInUse -= zslabSizes[sizeClass];
+
+	*(char **)start = slab->freeList;
+	slab->freeList = start;
+
+	// A full page becomes partial again.
+	if (slab->inUse-- == slab->total)
+	{
+		slab->prev = 0;
+		slab->next = zslabPartial[sizeClass];
+		if (slab->next)
+		{
+			slab->next->prev = slab;
+		}
+		zslabPartial[sizeClass] = slab;
+	}
+
+	// Hand empty pages back so any size class can reuse them.
+	if (slab->inUse == 0)
+	{
+		if (slab->prev)
+		{
+			slab->prev->next = slab->next;
+		}
+		else
+		{
+			zslabPartial[sizeClass] = slab->next;
+		}
+
+		if (slab->next)
+		{
+			slab->next->prev = slab->prev;
+		}
+
+		slab->next = zslabFreePages;
+		zslabFreePages = slab;
+	}
 }
 
 static void
 zallocate(char * start,int size)
 {
+	int i;
 
 #if ZDEBUG
 	zout += size;
 	printf("    alloc %d, total 0x%x\n",size,zout);
 #endif
 
-	zalloced[allocedNodes].start = start;
-	zalloced[allocedNodes].size  = size;
-
-	if (++allocedNodes > totalNodes)
+	if (allocedNodes + 1 > totalNodes)
 	{
 		if (zerror)
 		{
 			(*zerror)((char *)0xf000f000, 2, "zallocate", 0);
 		}
-	};
+		return;
+	}
+
+	// Keep the allocated list address ordered so free() can search it.
+	i = zsearch(zalloced, allocedNodes, start);
+	zinsert(zalloced, i, allocedNodes);
+	zalloced[i].start = start;
+	zalloced[i].size  = size;
+	allocedNodes++;
+}
+
+// Index of the first node whose start is not below the given address.
+static int
+zsearch(zmem * zp, int count, char * start)
+{
+	int low = 0, high = count, mid;
+
+	while (low < high)
+	{
+		mid = (low + high) / 2;
+
+		if (zp[mid].start < start)
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+
+	return low;
 }
 
 static void
-zinsert(zmem * zp, int ndx)
+zinsert(zmem * zp, int ndx, int count)
 {
 	int i;
 	zmem *z1, *z2;
 
-	i  = totalNodes-2;
+	i  = count - 1;
 	z1 = zp + i;
 	z2 = z1 + 1;
 
@@ -309,7 +547,7 @@ zinsert(zmem * zp, int ndx)
 }
 
 static void
-zdelete(zmem * zp, int ndx)
+zdelete(zmem * zp, int ndx, int count)
 {
 	int i;
 	zmem *z1, *z2;
@@ -317,33 +555,44 @@ zdelete(zmem * zp, int ndx)
 	z1 = zp + ndx;
 	z2 = z1 + 1;
 
-	for (i = ndx; i < totalNodes - 1; i++, z1++, z2++)
+	for (i = ndx; i < count - 1; i++, z1++, z2++)
 	{
 		*z1 = *z2;
 	}
 }
 
-static void
-zcoalesce(void)
+// Usable size of an allocated block, or 0 if it is unknown.
+static size_t
+zsize(char * start)
 {
 	int i;
 
-	for (i = 0; i < availableNodes-1; i++)
+	if (start >= zslab_base && start < zslab_end)
 	{
-		if ( zavailable[i].start + zavailable[i].size == zavailable[i + 1].start )
-		{
-			zavailable[i].size += zavailable[i + 1].size;
-			zdelete(zavailable, i + 1); availableNodes--;
-			return;
-		}
-	}	
+		return zslabSizes[((zslab *)((unsigned long)start & ~(ZSLAB_PAGE - 1)))->sizeClass];
+	}
+
+	i = zsearch(zalloced, allocedNodes, start);
+
+	if (i < allocedNodes && zalloced[i].start == start)
+	{
+		return zalloced[i].size;
+	}
+
+	return 0;
 }
 
-/* This is the simplest way possible.  Should fix this. */
 void * realloc(void * start, size_t newsize)
 {
-    void * newstart = safe_malloc(newsize, __FILE__, __LINE__);
-    bcopy(start, newstart, newsize);
-    free(start);
-    return newstart;
+	size_t oldsize;
+	void * newstart = safe_malloc(newsize, __FILE__, __LINE__);
+
+	if (start)
+	{
+		oldsize = zsize(start);
+		bcopy(start, newstart, (oldsize && oldsize < newsize) ? oldsize : newsize);
+		free(start);
+	}
+
+	return newstart;
 }
@@ -86,3 +86,21 @@ long AllocateKernelMemory(long inSize)
 
 	return addr;
 }
+
+
+//==============================================================================
+// Return the number of bytes AllocateKernelMemory() can still hand out and
+// the address the next allocation will get, so callers can fill the range
+// before they know its final size.
+
+long AvailableKernelMemory(long *nextAddr)
+{
+	if (gImageLastKernelAddr == 0)
+	{
+		gImageLastKernelAddr = RoundPage(bootArgs->kaddr + bootArgs->ksize);
+	}
+
+	*nextAddr = gImageLastKernelAddr;
+
+	return (KERNEL_ADDR + KERNEL_LEN) - gImageLastKernelAddr;
+}
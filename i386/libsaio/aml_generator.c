@@ -10,6 +10,14 @@
 
 #include "aml_generator.h"
 
+// Nodes and their buffers only live until the table has been written out.
+static struct arena aml_arena = ARENA_INITIALIZER("aml", 16 * 1024);
+
+static void *aml_alloc(size_t size)
+{
+	return arena_alloc(&aml_arena, size);
+}
+
 bool aml_add_to_parent(AML_CHUNK* parent, AML_CHUNK* node)
 {
 	if (parent && node)
@@ -51,7 +59,7 @@ bool aml_add_to_parent(AML_CHUNK* parent, AML_CHUNK* node)
 
 AML_CHUNK* aml_create_node(AML_CHUNK* parent)
 {
-	AML_CHUNK* node = (AML_CHUNK*)malloc(sizeof(AML_CHUNK));
+	AML_CHUNK* node = (AML_CHUNK*)aml_alloc(sizeof(AML_CHUNK));
 
 	aml_add_to_parent(parent, node);
 
@@ -67,22 +75,24 @@ void aml_destroy_node(AML_CHUNK* node)
 	{
 		AML_CHUNK* next = child->Next;
 
-		if (child->Buffer)
-		{
-			free(child->Buffer);
-		}
-		free(child);
-		
+		aml_destroy_node(child);
+
 		child = next;
 	}
 
 	// Free node
 	if (node->Buffer)
 	{
-		free(node->Buffer);
+		arena_free(&aml_arena, node->Buffer);
 	}
 
-	free(node);
+	arena_free(&aml_arena, node);
+
+	// Once the last tree is gone its chunks go back to the heap in one step.
+	if (aml_arena.live == 0)
+	{
+		arena_reset(&aml_arena);
+	}
 }
 
 AML_CHUNK* aml_add_buffer(AML_CHUNK* parent, const char* buffer, uint32_t size)
@@ -93,7 +103,7 @@ AML_CHUNK* aml_add_buffer(AML_CHUNK* parent, const char* buffer, uint32_t size)
 	{
 		node->Type = AML_CHUNK_NONE;
 		node->Length = (uint16_t)size;
-		node->Buffer = malloc(node->Length);
+		node->Buffer = aml_alloc(node->Length);
 		memcpy(node->Buffer, buffer, node->Length);
 	}
 
@@ -108,7 +118,7 @@ AML_CHUNK* aml_add_byte(AML_CHUNK* parent, uint8_t value)
 	{
 		node->Type = AML_CHUNK_BYTE;
 		node->Length = 1;
-		node->Buffer = malloc(node->Length);
+		node->Buffer = aml_alloc(node->Length);
 		node->Buffer[0] = value;
 	}
 	return node;
@@ -122,7 +132,7 @@ AML_CHUNK* aml_add_word(AML_CHUNK* parent, uint16_t value)
 	{
 		node->Type = AML_CHUNK_WORD;
 		node->Length = 2;
-		node->Buffer = malloc(node->Length);
+		node->Buffer = aml_alloc(node->Length);
 		node->Buffer[0] = value & 0xff;
 		node->Buffer[1] = value >> 8;
 	}
@@ -137,7 +147,7 @@ AML_CHUNK* aml_add_dword(AML_CHUNK* parent, uint32_t value)
 	{
 		node->Type = AML_CHUNK_DWORD;
 		node->Length = 4;
-		node->Buffer = malloc(node->Length);
+		node->Buffer = aml_alloc(node->Length);
 		node->Buffer[0] = value & 0xff;
 		node->Buffer[1] = (value >> 8) & 0xff;
 		node->Buffer[2] = (value >> 16) & 0xff;
@@ -154,7 +164,7 @@ AML_CHUNK* aml_add_qword(AML_CHUNK* parent, uint64_t value)
 	{
 		node->Type = AML_CHUNK_QWORD;
 		node->Length = 8;
-		node->Buffer = malloc(node->Length);
+		node->Buffer = aml_alloc(node->Length);
 		node->Buffer[0] = value & 0xff;
 		node->Buffer[1] = (value >> 8) & 0xff;
 		node->Buffer[2] = (value >> 16) & 0xff;
@@ -206,7 +216,7 @@ uint32_t aml_fill_name(AML_CHUNK* node, char* name)
 	if (count == 1)
 	{
 		node->Length = (uint16_t)(4 + root);
-		node->Buffer = malloc(node->Length+4);
+		node->Buffer = aml_alloc(node->Length+4);
 		memcpy(node->Buffer, name, 4 + root);
 		offset += 4 + root;
 		return (uint32_t)offset;
@@ -215,7 +225,7 @@ uint32_t aml_fill_name(AML_CHUNK* node, char* name)
 	if (count == 2)
 	{
 		node->Length = 2 + 8;
-		node->Buffer = malloc(node->Length+4);
+		node->Buffer = aml_alloc(node->Length+4);
 		node->Buffer[offset++] = 0x5c; // Root Char
 		node->Buffer[offset++] = 0x2e; // Double name
 		memcpy(node->Buffer+offset, name + root, 8);
@@ -224,7 +234,7 @@ uint32_t aml_fill_name(AML_CHUNK* node, char* name)
 	}
 
 	node->Length = (uint16_t)(3 + (count << 2));
-	node->Buffer = malloc(node->Length+4);
+	node->Buffer = aml_alloc(node->Length+4);
 	node->Buffer[offset++] = 0x5c; // Root Char
 	node->Buffer[offset++] = 0x2f; // Multi name
 	node->Buffer[offset++] = (char)count; // Names count
@@ -284,7 +294,7 @@ AML_CHUNK* aml_add_package(AML_CHUNK* parent)
 		node->Type = AML_CHUNK_PACKAGE;
 
 		node->Length = 1;
-		node->Buffer = malloc(node->Length);
+		node->Buffer = aml_alloc(node->Length);
 	}
 	return node;
 }
@@ -298,7 +308,7 @@ AML_CHUNK* aml_add_alias(AML_CHUNK* parent, char* name1, char* name2)
 		node->Type = AML_CHUNK_ALIAS;
 
 		node->Length = 8;
-		node->Buffer = malloc(node->Length);
+		node->Buffer = aml_alloc(node->Length);
 		aml_fill_simple_name(node->Buffer, name1);
 		aml_fill_simple_name(node->Buffer+4, name2);
 	}
@@ -380,7 +390,7 @@ AML_CHUNK* aml_add_byte_buffer(AML_CHUNK* parent, char* data, uint32_t size)
 		int offset = 0;
 		node->Type = AML_CHUNK_BUFFER;
 		node->Length = (uint8_t)(size + 2);
-		node->Buffer = malloc (node->Length);
+		node->Buffer = aml_alloc(node->Length);
 		node->Buffer[offset++] = AML_CHUNK_BYTE;  //0x0A
 		node->Buffer[offset++] = (char)size;
 		memcpy(node->Buffer+offset,data, node->Length);
@@ -399,7 +409,7 @@ AML_CHUNK* aml_add_string_buffer(AML_CHUNK* parent, char* StringBuf)
 		unsigned int len = strlen(StringBuf);
 		node->Type = AML_CHUNK_BUFFER;
 		node->Length = (uint8_t)(len + 3);
-		node->Buffer = malloc (node->Length);
+		node->Buffer = aml_alloc(node->Length);
 		node->Buffer[offset++] = AML_CHUNK_BYTE;
 		node->Buffer[offset++] = (char)(len+1);
 		memcpy(node->Buffer+offset, StringBuf, len);
@@ -418,7 +428,7 @@ AML_CHUNK* aml_add_string(AML_CHUNK* parent, char* StringBuf)
 		int len = strlen(StringBuf);
 		node->Type = AML_CHUNK_STRING;
 		node->Length = (uint8_t)(len + 1);
-		node->Buffer = malloc (len+1);
+		node->Buffer = aml_alloc(len+1);
 		memcpy(node->Buffer, StringBuf, len);
 //		node->Buffer[len] = '\0';
 	}
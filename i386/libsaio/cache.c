@@ -30,121 +30,286 @@
 #include <sl.h>
 // #include <fs.h>
 
+#if defined(CONFIG_CACHE_STATS) && !defined(CACHE_STATS)
+	#define CACHE_STATS 1
+#endif
+
+typedef struct CacheEntry CacheEntry;
+
 struct CacheEntry {
-	CICell    ih;
-	long      time;
-	long long offset;
+	CacheEntry *hashNext;	// next entry in the same hash bucket
+	CacheEntry *lruPrev;	// towards the most recently used entry
+	CacheEntry *lruNext;	// towards the least recently used entry
+	long long  offset;
+	char       *data;
 };
-typedef struct CacheEntry CacheEntry;
 
-#define kCacheSize            (0x100000)
-#define kCacheMinBlockSize    (0x200)
-#define kCacheMaxBlockSize    (0x8000)
-#define kCacheMaxEntries      (kCacheSize / kCacheMinBlockSize)
+/*
+ * One partition of the cache per volume, so that switching between
+ * bt(0,0), the root volume and rd(0,0) doesn't throw the others away.
+ */
+struct CacheVolume {
+	CICell     ih;
+	u_int32_t  blockSize;
+	long       numEntries;
+	long       numUsed;
+	long       time;		// last use, to pick a partition to recycle
+	CacheEntry lru;			// list head: lru.lruNext is the MRU entry, lru.lruPrev the LRU one
+	CacheEntry *entries;
+	CacheEntry **hash;
+	char       *buffer;
+#if CACHE_STATS
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evicts;
+#endif
+};
+typedef struct CacheVolume CacheVolume;
 
-static CICell     gCacheIH;
-static u_int32_t  gCacheBlockSize;
-static long       gCacheNumEntries;
-static long       gCacheTime;
+#ifdef CONFIG_CACHE_SIZE_KB
+	#define kCacheSize        (CONFIG_CACHE_SIZE_KB * 1024)
+#else
+	#define kCacheSize        (0x100000)
+#endif
 
-#ifdef __i386__
-	static CacheEntry *gCacheEntries;
-	static char       *gCacheBuffer;
+#ifdef CONFIG_CACHE_VOLUMES
+	#define kCacheMaxVolumes  (CONFIG_CACHE_VOLUMES)
 #else
-	static CacheEntry gCacheEntries[kCacheMaxEntries];
-	static char       gCacheBuffer[kCacheSize];
+	#define kCacheMaxVolumes  (4)
 #endif
 
+#define kCacheMinBlockSize    (0x200)
+#define kCacheMaxBlockSize    (0x8000)
+#define kCacheMaxEntries      (kCacheSize / kCacheMinBlockSize)
+#define kCacheHashBits        (12)
+#define kCacheHashSize        (1 << kCacheHashBits)
+
+static CacheVolume gCacheVolumes[kCacheMaxVolumes];
+static CacheVolume *gCacheCurrent;
+static long        gCacheTime;
+
 #if CACHE_STATS
 	unsigned long     gCacheHits;
 	unsigned long     gCacheMisses;
 	unsigned long     gCacheEvicts;
 #endif
 
+//==============================================================================
+
+static inline u_int32_t CacheHash(long long offset)
+{
+	// Offsets are always multiples of the minimum block size.
+	return ((u_int32_t)(offset >> 9) * 2654435761U) >> (32 - kCacheHashBits);
+}
+
+//==============================================================================
+
+static inline void CacheLRURemove(CacheEntry *entry)
+{
+	entry->lruPrev->lruNext = entry->lruNext;
+	entry->lruNext->lruPrev = entry->lruPrev;
+}
+
+//==============================================================================
+
+static inline void CacheLRUInsertHead(CacheVolume *vol, CacheEntry *entry)
+{
+	entry->lruPrev = &vol->lru;
+	entry->lruNext = vol->lru.lruNext;
+	vol->lru.lruNext->lruPrev = entry;
+	vol->lru.lruNext = entry;
+}
+
+//==============================================================================
+
+static void CacheHashRemove(CacheVolume *vol, CacheEntry *entry)
+{
+	CacheEntry **link = &vol->hash[CacheHash(entry->offset)];
+
+	while (*link != NULL)
+	{
+		if (*link == entry)
+		{
+			*link = entry->hashNext;
+			break;
+		}
+
+		link = &(*link)->hashNext;
+	}
+}
+
+//==============================================================================
+
+static CacheVolume *CacheFindVolume(CICell ih)
+{
+	int cnt;
+
+	if (gCacheCurrent && (gCacheCurrent->ih == ih))
+	{
+		return gCacheCurrent;
+	}
+
+	for (cnt = 0; cnt < kCacheMaxVolumes; cnt++)
+	{
+		if (gCacheVolumes[cnt].ih == ih)
+		{
+			return &gCacheVolumes[cnt];
+		}
+	}
+
+	return NULL;
+}
+
+//==============================================================================
+
+static void CacheVolumeFlush(CacheVolume *vol)
+{
+	vol->numUsed = 0;
+	vol->lru.lruNext = vol->lru.lruPrev = &vol->lru;
+
+	if (vol->hash)
+	{
+		bzero(vol->hash, kCacheHashSize * sizeof(CacheEntry *));
+	}
+}
+
+//==============================================================================
+
 void CacheReset()
 {
-	gCacheIH = NULL;
+	int cnt;
+
+	for (cnt = 0; cnt < kCacheMaxVolumes; cnt++)
+	{
+		gCacheVolumes[cnt].ih = NULL;
+		CacheVolumeFlush(&gCacheVolumes[cnt]);
+	}
+
+	gCacheCurrent = NULL;
 }
 
+//==============================================================================
+
 void CacheInit( CICell ih, u_int32_t blockSize )
 {
-#ifdef __i386__
-	if ((ih == gCacheIH) && (blockSize == gCacheBlockSize))
+	CacheVolume *vol;
+	int cnt;
+
+	vol = CacheFindVolume(ih);
+
+	if (vol && (vol->blockSize == blockSize))
 	{
+		vol->time = ++gCacheTime;
+		gCacheCurrent = vol;
 		return;
 	}
-#endif
 
 	if ((blockSize  < kCacheMinBlockSize) || (blockSize > kCacheMaxBlockSize))
 	{
 		return;
 	}
 
-	gCacheBlockSize = blockSize;
-	gCacheNumEntries = kCacheSize / gCacheBlockSize;
-	gCacheTime = 0;
-    
-#if CACHE_STATS
-	gCacheHits	= 0;
-	gCacheMisses	= 0;
-	gCacheEvicts	= 0;
-#endif
+	// Not cached yet: take a free partition, or recycle the least recently used one.
+	if (vol == NULL)
+	{
+		vol = &gCacheVolumes[0];
 
-    gCacheIH = ih;
+		for (cnt = 0; cnt < kCacheMaxVolumes; cnt++)
+		{
+			if (gCacheVolumes[cnt].ih == NULL)
+			{
+				vol = &gCacheVolumes[cnt];
+				break;
+			}
 
-#ifdef __i386__
-	if (!gCacheBuffer)
+			if (gCacheVolumes[cnt].time < vol->time)
+			{
+				vol = &gCacheVolumes[cnt];
+			}
+		}
+	}
+
+	if (!vol->buffer)
 	{
-		gCacheBuffer = (char *) malloc(kCacheSize);
+		vol->buffer = (char *) malloc(kCacheSize);
 	}
 
-	if (!gCacheEntries)
+	if (!vol->entries)
 	{
-		gCacheEntries = (CacheEntry *) malloc(kCacheMaxEntries * sizeof(CacheEntry));
+		vol->entries = (CacheEntry *) malloc(kCacheMaxEntries * sizeof(CacheEntry));
 	}
 
-	if (!gCacheBuffer || !gCacheEntries)
+	if (!vol->hash)
 	{
-		gCacheIH = 0;  // invalidate cache
+		vol->hash = (CacheEntry **) malloc(kCacheHashSize * sizeof(CacheEntry *));
+	}
+
+	if (!vol->buffer || !vol->entries || !vol->hash)
+	{
+		vol->ih = NULL;  // invalidate cache
+		gCacheCurrent = NULL;
 		return;
 	}
+
+	vol->ih = ih;
+	vol->blockSize = blockSize;
+	vol->numEntries = kCacheSize / blockSize;
+	vol->time = ++gCacheTime;
+	CacheVolumeFlush(vol);
+
+#if CACHE_STATS
+	vol->hits	= 0;
+	vol->misses	= 0;
+	vol->evicts	= 0;
 #endif
 
-	bzero(gCacheEntries, kCacheMaxEntries * sizeof(CacheEntry));
+	gCacheCurrent = vol;
 }
 
+//==============================================================================
+
 u_int32_t CacheRead(CICell ih, char * buffer, long long offset, u_int32_t length, long cache)
 {
-	long cnt, oldestEntry = 0, oldestTime, loadCache = 0;
+	CacheVolume *vol = NULL;
 	CacheEntry *entry;
 
 	// See if the data can be cached.
-	if (cache && (gCacheIH == ih) && (length == gCacheBlockSize))
+	if (cache)
 	{
-		// Look for the data in the cache.
-		for (cnt = 0; cnt < gCacheNumEntries; cnt++)
+		vol = CacheFindVolume(ih);
+
+		if (vol && (length != vol->blockSize))
 		{
-			entry = &gCacheEntries[cnt];
+			vol = NULL;
+		}
+	}
+
+	if (vol)
+	{
+		gCacheCurrent = vol;
+		vol->time = ++gCacheTime;
 
-			if ((entry->ih == ih) && (entry->offset == offset))
+		// Look for the data in the cache.
+		for (entry = vol->hash[CacheHash(offset)]; entry != NULL; entry = entry->hashNext)
+		{
+			if (entry->offset == offset)
 			{
-				entry->time = ++gCacheTime;
 				break;
 			}
 		}
 
 		// If the data was found copy it to the caller.
-		if (cnt != gCacheNumEntries)
+		if (entry != NULL)
 		{
-			bcopy(gCacheBuffer + cnt * gCacheBlockSize, buffer, gCacheBlockSize);
+			CacheLRURemove(entry);
+			CacheLRUInsertHead(vol, entry);
+			bcopy(entry->data, buffer, vol->blockSize);
 #if CACHE_STATS
+			vol->hits++;
 			gCacheHits++;
 #endif
-			return gCacheBlockSize;
+			return vol->blockSize;
 		}
-
-		// Could not find the data in the cache.
-		loadCache = 1;
 	}
 
 	// Read the data from the disk.
@@ -155,48 +320,66 @@ u_int32_t CacheRead(CICell ih, char * buffer, long long offset, u_int32_t length
 	if (cache)
 	{
 		gCacheMisses++;
+
+		if (vol)
+		{
+			vol->misses++;
+		}
 	}
 #endif
 
 	// Put the data from the disk in the cache if needed.
-	if (loadCache)
+	if (vol)
 	{
-		// Find a free entry.
-		oldestTime = gCacheTime;
-
-		for (cnt = 0; cnt < gCacheNumEntries; cnt++)
+		if (vol->numUsed < vol->numEntries)
 		{
-			entry = &gCacheEntries[cnt];
-
-			// Found a free entry.
-			if (entry->ih == 0)
-			{
-				break;
-			}
-
-			if (entry->time < oldestTime)
-			{
-				oldestTime = entry->time;
-				oldestEntry = cnt;
-			}
+			// Use a free entry.
+			entry = &vol->entries[vol->numUsed];
+			entry->data = vol->buffer + vol->numUsed * vol->blockSize;
+			vol->numUsed++;
 		}
-
-		// If no free entry was found, use the oldest.
-		if (cnt == gCacheNumEntries)
+		else
 		{
-			cnt = oldestEntry;
+			// No free entry, recycle the least recently used one.
+			entry = vol->lru.lruPrev;
+			CacheLRURemove(entry);
+			CacheHashRemove(vol, entry);
 #if CACHE_STATS
+			vol->evicts++;
 			gCacheEvicts++;
 #endif
 		}
 
 		// Copy the data from disk to the new entry.
-		entry = &gCacheEntries[cnt];
-		entry->ih = ih;
-		entry->time = ++gCacheTime;
 		entry->offset = offset;
-		bcopy(buffer, gCacheBuffer + cnt * gCacheBlockSize, gCacheBlockSize);
+		entry->hashNext = vol->hash[CacheHash(offset)];
+		vol->hash[CacheHash(offset)] = entry;
+		CacheLRUInsertHead(vol, entry);
+		bcopy(buffer, entry->data, vol->blockSize);
 	}
 
 	return length;
 }
+
+//==============================================================================
+
+void CachePrintStats()
+{
+#if CACHE_STATS
+	int cnt;
+	CacheVolume *vol;
+
+	verbose("Cache: %lu hits, %lu misses, %lu evictions\n", gCacheHits, gCacheMisses, gCacheEvicts);
+
+	for (cnt = 0; cnt < kCacheMaxVolumes; cnt++)
+	{
+		vol = &gCacheVolumes[cnt];
+
+		if (vol->ih)
+		{
+			verbose("Cache: volume %d: block size %u, %ld/%ld blocks used, %lu hits, %lu misses, %lu evictions\n",
+				cnt, vol->blockSize, vol->numUsed, vol->numEntries, vol->hits, vol->misses, vol->evicts);
+		}
+	}
+#endif
+}
@@ -86,6 +86,7 @@ typedef struct gpt_ent gpt_ent;
 #define PROBEFS_SIZE     BPS * 4 /* buffer size for filesystem probe */
 #define CD_BPS           2048    /* CD-ROM block size */
 #define N_CACHE_SECS     (BIOS_LEN / BPS)  /* Must be a multiple of 4 for CD-ROMs */
+#define N_MIN_READAHEAD  8                 /* Initial read-ahead for random access, also a multiple of 4 */
 #define UFS_FRONT_PORCH  0
 #define kAPMSector       2       /* Sector number of Apple partition map */
 #define kAPMCDSector     8       /* Translated sector of Apple partition map on a CD */
@@ -124,10 +125,12 @@ struct DiskBVMap {
  * will store the sectors read from disk to this memory area.
  *
  * biosbuf points to a sector within the track cache, and is
- * updated by Biosread().
+ * updated by Biosread(). biosbufLen is the number of valid bytes
+ * in the track cache from biosbuf onwards.
  */
 static char *const trackbuf = (char *) ptov(BIOS_ADDR);
 static char *biosbuf;
+static unsigned int biosbufLen;
 
 static struct DiskBVMap *gDiskBVMap  = NULL;
 static struct disk_blk0 *gBootSector = NULL;
@@ -272,10 +275,12 @@ static const char *bios_error(int errnum)
 // Return:
 //   0 on success, or an error code from INT13/F2 or INT13/F42 BIOS call.
 
-static int Biosread( int biosdev, unsigned long long secno )
+static int Biosread( int biosdev, unsigned long long secno, unsigned int nsecs )
 {
 	static int xbiosdev, xcyl, xhead;
 	static unsigned int xsec, xnsecs;
+	static unsigned long long xnextsec;
+	static unsigned int readAhead = N_MIN_READAHEAD;
 	struct driveInfo di;
 
 	int  rc = -1;
@@ -314,11 +319,28 @@ static int Biosread( int biosdev, unsigned long long secno )
 		if (cache_valid && (biosdev == xbiosdev) && (secno >= xsec) && ((unsigned int)secno < (xsec + xnsecs)))
 		{
 			biosbuf = trackbuf + (BPS * (secno - xsec));
+			biosbufLen = BPS * (xsec + xnsecs - secno);
 			return 0;
 		}
 
-		xnsecs = N_CACHE_SECS;
+		// Grow the read-ahead while the caller streams through the disk,
+		// fall back to a small one as soon as the access pattern is random.
+		if ((biosdev == xbiosdev) && (secno == xnextsec))
+		{
+			readAhead = (readAhead * 2 > N_CACHE_SECS) ? N_CACHE_SECS : readAhead * 2;
+		}
+		else
+		{
+			readAhead = N_MIN_READAHEAD;
+		}
+
 		xsec = (secno / divisor) * divisor;
+
+		// Always fetch everything the caller asked for, up to a full track buffer.
+		xnsecs = IORound(nsecs + (unsigned int)(secno - xsec), divisor);
+		xnsecs = (xnsecs < readAhead) ? readAhead : xnsecs;
+		xnsecs = (xnsecs > N_CACHE_SECS) ? N_CACHE_SECS : xnsecs;
+		xnextsec = xsec + xnsecs;
 		cache_valid = false;
 
 		while ((rc = ebiosread(biosdev, secno / divisor, xnsecs / divisor)) && (++tries < 5))
@@ -333,6 +355,8 @@ static int Biosread( int biosdev, unsigned long long secno )
 			error("    Block 0x%x Sectors %d\n", secno, xnsecs);
 			sleep(1);
 		}
+
+		biosbufLen = BPS * (xsec + xnsecs - secno);
 	}
 
 	else
@@ -349,6 +373,7 @@ static int Biosread( int biosdev, unsigned long long secno )
 		{
 			// this sector is in trackbuf cache
 			biosbuf = trackbuf + (BPS * (sec - xsec));
+			biosbufLen = BPS * (xsec + xnsecs - sec);
 			return 0;
 		}
 
@@ -358,6 +383,7 @@ static int Biosread( int biosdev, unsigned long long secno )
 		xhead  = head;
 		xsec   = sec;
 		xnsecs = ((unsigned int)(sec + N_CACHE_SECS) > di.di.params.phys_spt) ? (di.di.params.phys_spt - sec) : N_CACHE_SECS;
+		xnextsec = 0;
 
 		cache_valid = false;
 
@@ -373,6 +399,8 @@ static int Biosread( int biosdev, unsigned long long secno )
 			error("  Block %d, Cyl %d Head %d Sector %d\n", secno, cyl, head, sec);
 			sleep(1);
 		}
+
+		biosbufLen = BPS * xnsecs;
 	}
 
 	// If the BIOS reported success, mark the sector cache as valid.
@@ -393,7 +421,7 @@ static int Biosread( int biosdev, unsigned long long secno )
 //==============================================================================
 int testBiosread(int biosdev, unsigned long long secno)
 {
-	return Biosread(biosdev, secno);
+	return Biosread(biosdev, secno, 1);
 }
 
 //==============================================================================
@@ -407,13 +435,16 @@ static int readBytes(int biosdev, unsigned long long blkno, unsigned int byteoff
 
 	char * cbuf = (char *) buffer;
 	int error;
-	int copy_len;
+	unsigned int copy_len;
 
 	DEBUG_DISK(("%s: dev %X block %X [%d] -> 0x%X...", __FUNCTION__, biosdev, blkno, byteCount, (unsigned)cbuf));
 
-	for (; byteCount; cbuf += copy_len, blkno++)
+	// Each Biosread() is asked for the whole remaining range, so a large
+	// request turns into as few maximal BIOS transfers as the track buffer
+	// allows, and every transfer is copied out with a single bcopy().
+	for (; byteCount; cbuf += copy_len)
 	{
-		error = Biosread(biosdev, blkno);
+		error = Biosread(biosdev, blkno, (byteoff + byteCount + BPS - 1) / BPS);
 
 		if (error)
 		{
@@ -422,9 +453,11 @@ static int readBytes(int biosdev, unsigned long long blkno, unsigned int byteoff
 			return (-1);
 		}
 
-		copy_len = ((byteCount + byteoff) > BPS) ? (BPS - byteoff) : byteCount;
+		copy_len = biosbufLen - byteoff;
+		copy_len = (copy_len > byteCount) ? byteCount : copy_len;
 		bcopy( biosbuf + byteoff, cbuf, copy_len );
 		byteCount -= copy_len;
+		blkno += (byteoff + copy_len) / BPS;
 		byteoff = 0;
 	}
 
@@ -638,6 +671,25 @@ exit:
 	return result;
 }
 
+//==============================================================================
+// Pick the direct path lookup matching a filesystem's directory iterator.
+// Filesystems without one fall back to iterating the parent directory.
+
+static FSGetFileInfo getFileInfoFunc(FSGetDirEntry getdirFunc)
+{
+	if (getdirFunc == HFSGetDirEntry)
+	{
+		return HFSGetFileInfo;
+	}
+
+	if (getdirFunc == MSDOSGetDirEntry)
+	{
+		return MSDOSGetFileInfo;
+	}
+
+	return 0;
+}
+
 //==============================================================================
 static BVRef newFDiskBVRef( int biosdev,
                             int partno,
@@ -665,6 +717,7 @@ static BVRef newFDiskBVRef( int biosdev,
 		bvr->fs_loadfile    = loadFunc;
 		bvr->fs_readfile    = readFunc;
 		bvr->fs_getdirentry = getdirFunc;
+		bvr->fs_getfileinfo = getFileInfoFunc(getdirFunc);
 		bvr->fs_getfileblock= getBlockFunc;
 		bvr->fs_getuuid     = getUUIDFunc;
 		bvr->description    = getDescriptionFunc;
@@ -709,6 +762,7 @@ static BVRef newFDiskBVRef( int biosdev,
 				bvr->fs_loadfile    = EXFATLoadFile;
 				bvr->fs_readfile    = EXFATReadFile;
 				bvr->fs_getdirentry = EXFATGetDirEntry;
+				bvr->fs_getfileinfo = 0;
 				bvr->fs_getfileblock= EXFATGetFileBlock;
 				bvr->fs_getuuid     = EXFATGetUUID;
 				bvr->description    = EXFATGetDescription;
@@ -757,6 +811,7 @@ static BVRef newAPMBVRef( int biosdev, int partno, unsigned int blkoff,
 		bvr->fs_loadfile    = loadFunc;
 		bvr->fs_readfile    = readFunc;
 		bvr->fs_getdirentry = getdirFunc;
+		bvr->fs_getfileinfo = getFileInfoFunc(getdirFunc);
 		bvr->fs_getfileblock= getBlockFunc;
 		bvr->fs_getuuid     = getUUIDFunc;
 		bvr->description    = getDescriptionFunc;
@@ -864,6 +919,7 @@ static BVRef newGPTBVRef( int biosdev,
 		bvr->fs_loadfile        = loadFunc;
 		bvr->fs_readfile        = readFunc;
 		bvr->fs_getdirentry     = getdirFunc;
+		bvr->fs_getfileinfo     = getFileInfoFunc(getdirFunc);
 		bvr->fs_getfileblock    = getBlockFunc;
 		bvr->fs_getuuid         = getUUIDFunc;
 		bvr->description        = getDescriptionFunc;
@@ -2108,7 +2164,7 @@ static void scanFSLevelBVRSettings(BVRef chain)
 		{
 			snprintf(dirSpec, sizeof(dirSpec), "hd(%d,%d)/System/Library/CoreServices/", BIOS_DEV_UNIT(bvr), bvr->part_no);
 			strlcpy(fileSpec, ".disk_label.contentDetails", sizeof(fileSpec));
-			ret = GetFileInfo(dirSpec, fileSpec, &flags, &time);
+			ret = GetVolumeFileInfo(bvr, "/System/Library/CoreServices/.disk_label.contentDetails", &flags, &time);
 			if (!ret)
 			{
 				strlcat(dirSpec, fileSpec, sizeof(dirSpec));
@@ -38,6 +38,7 @@
 #include "config.h"
 #include "libsaio.h"
 #include "sl.h"
+#include "msdos.h"
 
 #pragma mark -
 #pragma mark Preprocessor Definitions
@@ -524,8 +525,9 @@ int ExtractDirEntry(struct exfat_dir_iterator* iterator, char** name, long* flag
 			continue;
 		if (flags)
 			*flags = (OSSwapLittleToHostInt16(u.fe->attributes) & ATTR_DIRECTORY) ? kFileTypeDirectory : kFileTypeFlat;
-		if (time)
-			*time = OSSwapLittleToHostInt32(u.fe->mod_time);
+		if (time)	/* DOS date << 16 | time, plus the 10ms field for odd seconds */
+			*time = MSDOSTimeToUnix(OSSwapLittleToHostInt32(u.fe->mod_time) >> 16,
+						OSSwapLittleToHostInt32(u.fe->mod_time) & 0xFFFF) + u.fe->mod_10ms / 100;
 		if (!name)
 			goto info_valid;
 		u.nde = nextDirEntry(iterator);
@@ -570,6 +572,8 @@ int PathToInode(char const* path, struct exfat_inode* out_file, uint8_t* buffer
 	uint16_t path_utf16le[COMPONENT_MAX_CHARS];
 	uint16_t numChars;
 	char have_prev_inode;
+	uint32_t parent;
+	long found;
 
 	InitIteratorFromRoot(&iterator);
 	iterator.buffer = buffer;
@@ -598,13 +602,22 @@ int PathToInode(char const* path, struct exfat_inode* out_file, uint8_t* buffer
 			break;
 		} while (1);
 		*slash = 0;
-		utf_decodestr(ptr, &path_utf16le[0], &numChars, sizeof path_utf16le, OSLittleEndian);
-		numChars = OSSwapLittleToHostInt16(numChars);
+		/*
+		 * Directories are identified by their first cluster in the name cache
+		 */
+		parent = have_prev_inode ? out_file->first_cluster : gRDCl;
+		found = NameCacheLookup(gCurrentIH, parent, (char const*) ptr, out_file, sizeof *out_file);
+		if (found < 0) {
+			utf_decodestr(ptr, &path_utf16le[0], &numChars, sizeof path_utf16le, OSLittleEndian);
+			numChars = OSSwapLittleToHostInt16(numChars);
+			if (have_prev_inode)
+				InitIteratorFromInode(&iterator, out_file);
+			found = (ComponentToInode(&iterator, &path_utf16le[0], numChars, out_file) < 0) ? 0 : 1;
+			NameCacheEnter(gCurrentIH, parent, (char const*) ptr, found ? out_file : NULL, sizeof *out_file);
+		}
 		*slash = ch;
 		ptr = slash + 1;
-		if (have_prev_inode)
-			InitIteratorFromInode(&iterator, out_file);
-		if (ComponentToInode(&iterator, &path_utf16le[0], numChars, out_file) < 0)
+		if (!found)
 			break;
 		if (!ch)	/* was last component - done */
 			return 0;
@@ -626,6 +639,7 @@ EXFATFree(CICell ih)
 		gCurrentIH = NULL;
 		FATCacheInvalidate();
 	}
+	NameCacheFlush(ih);
 	free(ih);
 }
 
@@ -39,6 +39,54 @@
 #define kBTreeCatalog (0)
 #define kBTreeExtents (1)
 
+// Largest catalog record ReadBTreeEntry() copies out.
+#define kCatalogEntrySize (264)
+
+#define kExtentMapCount (8)
+#define kBTNodeCount    (32)
+
+/*
+ * Extent map of a file: every extent, inline or from the extents
+ * overflow B-tree, flattened into runs sorted by logical block.
+ */
+struct HFSExtentRun {
+	u_int32_t logicalBlock;
+	u_int32_t startBlock;
+	u_int32_t blockCount;
+};
+typedef struct HFSExtentRun HFSExtentRun;
+
+struct HFSExtentMap {
+	CICell       ih;
+	u_int32_t    fileID;
+	u_int32_t    numRuns;
+	u_int32_t    maxRuns;
+	u_int32_t    lastRun;	// hint for sequential reads
+	long         time;
+	HFSExtentRun *runs;
+};
+typedef struct HFSExtentMap HFSExtentMap;
+
+/*
+ * Cached B-tree node, with its record offsets already byte-swapped.
+ * Index nodes are only recycled when no leaf node is left to recycle,
+ * so the upper levels of the trees stay resident.
+ */
+struct HFSBTNode {
+	CICell           ih;
+	long             btree;
+	u_int32_t        nodeNum;
+	long             valid;
+	long             loading;
+	long             time;
+	u_int16_t        nodeSize;
+	u_int16_t        numRecords;
+	BTNodeDescriptor *desc;
+	u_int16_t        *offsets;
+	char             *buffer;
+};
+typedef struct HFSBTNode HFSBTNode;
+
 #ifdef __i386__
 
 static CICell                  gCurrentIH;
@@ -56,6 +104,11 @@ static HFSPlusVolumeHeader     *gHFSPlus;
 static char                    *gLinkTemp;
 static long long               gVolID;
 static char                    *gTempStr;
+static HFSExtentMap            gExtentMaps[kExtentMapCount];
+static long                    gExtentMapTime;
+static HFSBTNode               gBTNodes[kBTNodeCount];
+static HFSBTNode               *gBTLastLeaf[2];
+static long                    gBTNodeTime;
 
 #else  /* !__i386__ */
 
@@ -73,12 +126,18 @@ static char			gHFSPlusHeader[kBlockSize];
 static HFSPlusVolumeHeader	*gHFSPlus =(HFSPlusVolumeHeader*)gHFSPlusHeader;
 static char			gLinkTemp[64];
 static long long		gVolID;
+static HFSExtentMap		gExtentMaps[kExtentMapCount];
+static long			gExtentMapTime;
+static HFSBTNode		gBTNodes[kBTNodeCount];
+static HFSBTNode		*gBTLastLeaf[2];
+static long			gBTNodeTime;
 
 #endif /* !__i386__ */
 
 static long ReadFile(void *file, u_int64_t *length, void *base, u_int64_t offset);
 static long GetCatalogEntryInfo(void *entry, long *flags, u_int32_t *time,
                                 FinderInfo *finderInfo, long *infoValid);
+static long LookupCatalogEntry(char *fileName, u_int32_t dirID, void *entry);
 static long ResolvePathToCatalogEntry(char *filePath, long *flags,
                 void *entry, u_int32_t dirID, long long *dirIndex);
 
@@ -90,11 +149,17 @@ static long ReadCatalogEntry(char *fileName, u_int32_t dirID, void *entry,
 static long ReadExtentsEntry(u_int32_t fileID, long startBlock, void *entry);
 
 static long ReadBTreeEntry(long btree, void *key, char *entry, long long *dirIndex);
-static void GetBTreeRecord(u_int16_t index, char *nodeBuffer, u_int16_t nodeSize,
-                char **key, char **data);
+static HFSBTNode *GetBTreeNode(long btree, u_int32_t nodeNum);
+static void GetBTreeRecord(HFSBTNode *node, u_int16_t index, char **key, char **data);
+static long SearchBTreeNode(long btree, HFSBTNode *node, void *key, u_int16_t *index);
+static void GetBTreeFile(long btree, void **extent, u_int64_t *extentSize, u_int32_t *extentFile);
 
 static long ReadExtent(char *extent, u_int64_t extentSize, u_int32_t extentFile,
                 u_int64_t offset, u_int64_t size, void *buffer, long cache);
+static HFSExtentMap *GetExtentMap(char *extent, u_int64_t extentSize, u_int32_t extentFile);
+static HFSExtentRun *FindExtentRun(HFSExtentMap *map, u_int32_t blockNumber);
+static void FreeExtentMaps(CICell ih);
+static void FreeBTreeNodes(CICell ih);
 
 static u_int32_t GetExtentStart(void *extents, u_int32_t index);
 static u_int32_t GetExtentSize(void *extents, u_int32_t index);
@@ -126,6 +191,9 @@ void HFSFree(CICell ih)
 	{
 		gCurrentIH = 0;
 	}
+	FreeExtentMaps(ih);
+	FreeBTreeNodes(ih);
+	NameCacheFlush(ih);
 	free(ih);
 }
 
@@ -203,6 +271,8 @@ long HFSInitPartition(CICell ih)
 	gCaseSensitive = 0;
 	gBTHeaders[0] = 0;
 	gBTHeaders[1] = 0;
+	gBTLastLeaf[0] = 0;
+	gBTLastLeaf[1] = 0;
 
 	// Look for the HFS MDB
 	Seek(ih, kMDBBaseOffset);
@@ -435,6 +505,99 @@ long HFSGetDirEntry(CICell ih, char * dirPath, long long * dirIndex, char ** nam
 	return 0;
 }
 
+//==============================================================================
+// Look up a single path without iterating its parent directory.
+// Unlike ResolvePathToCatalogEntry this reports directories as such
+// instead of returning their thread record.
+
+long HFSGetFileInfo(CICell ih, char *filePath, long *flags, u_int32_t *time)
+{
+	char entry[512];
+	char name[kDirEntryNameLen];
+	u_int32_t dirID;
+	long cnt;
+
+	if (HFSInitPartition(ih) == -1)
+	{
+		return -1;
+	}
+
+	dirID = kHFSRootFolderID;
+
+	// Skip a lead '/'.  Start in the system folder if there are two.
+	if (filePath[0] == '/')
+	{
+		if (filePath[1] == '/')
+		{
+			if (gIsHFSPlus)
+			{
+				dirID = SWAP_BE32(((long *)gHFSPlus->finderInfo)[5]);
+			}
+			else
+			{
+				dirID = SWAP_BE32(gHFSMDB->drFndrInfo[5]);
+			}
+
+			if (dirID == 0)
+			{
+				return -1;
+			}
+
+			filePath++;
+		}
+
+		filePath++;
+	}
+
+	if (filePath[0] == '\0')
+	{
+		return -1;
+	}
+
+	while (1)
+	{
+		for (cnt = 0; (filePath[cnt] != '/') && (filePath[cnt] != '\0'); cnt++) {}
+
+		if (cnt >= kDirEntryNameLen)
+		{
+			return -1;
+		}
+
+		strlcpy(name, filePath, cnt + 1);
+
+		if (LookupCatalogEntry(name, dirID, entry) == -1)
+		{
+			return -1;
+		}
+
+		GetCatalogEntryInfo(entry, flags, time, 0, 0);
+
+		filePath += cnt;
+
+		// Done at the last component; a trailing '/' names the directory itself.
+		if ((filePath[0] == '\0') || (filePath[1] == '\0'))
+		{
+			return ((*flags & kFileTypeMask) == kFileTypeUnknown) ? -1 : 0;
+		}
+
+		if ((*flags & kFileTypeMask) != kFileTypeDirectory)
+		{
+			return -1;
+		}
+
+		if (gIsHFSPlus)
+		{
+			dirID = SWAP_BE32(((HFSPlusCatalogFolder *)entry)->folderID);
+		}
+		else
+		{
+			dirID = SWAP_BE32(((HFSCatalogFolder *)entry)->folderID);
+		}
+
+		filePath++;
+	}
+}
+
 //==============================================================================
 
 void HFSGetDescription(CICell ih, char *str, long strMaxLen)
@@ -472,8 +635,11 @@ long HFSGetFileBlock(CICell ih, char *filePath, u_int64_t *firstBlock)
 {
 	char entry[512];
 	long result, flags;
-	u_int32_t dirID;
+	u_int32_t dirID, fileID;
+	u_int64_t fileLength;
 	void               *extents;
+	HFSExtentMap       *map;
+	HFSExtentRun       *run;
 
 	HFSCatalogFile     *hfsFile     = (void *)entry;
 	HFSPlusCatalogFile *hfsPlusFile = (void *)entry;
@@ -517,19 +683,31 @@ long HFSGetFileBlock(CICell ih, char *filePath, u_int64_t *firstBlock)
 
 	if (gIsHFSPlus)
 	{
-		extents = &hfsPlusFile->dataFork.extents;
+		fileID     = SWAP_BE32(hfsPlusFile->fileID);
+		fileLength = SWAP_BE64(hfsPlusFile->dataFork.logicalSize);
+		extents    = &hfsPlusFile->dataFork.extents;
 	}
 	else
 	{
-		extents = &hfsFile->dataExtents;
+		fileID     = SWAP_BE32(hfsFile->fileID);
+		fileLength = SWAP_BE32(hfsFile->dataLogicalSize);
+		extents    = &hfsFile->dataExtents;
+	}
+
+	map = GetExtentMap(extents, fileLength, fileID);
+	run = map ? FindExtentRun(map, 0) : 0;
+
+	if (run == 0)
+	{
+		return -1L;
 	}
 
 #if DEBUG
-	printf("extent start 0x%x\n", GetExtentStart(extents, 0));
+	printf("extent start 0x%x\n", run->startBlock);
 	printf("block size 0x%x\n", gBlockSize);
 	printf("Allocation offset 0x%x\n", (unsigned long)gAllocationOffset);
 #endif
-	*firstBlock = ((u_int64_t) GetExtentStart(extents, 0) * (u_int64_t) gBlockSize + gAllocationOffset) / 512ULL;
+	*firstBlock = ((u_int64_t) run->startBlock * (u_int64_t) gBlockSize + gAllocationOffset) / 512ULL;
 	return 0L;
 }
 
@@ -706,7 +884,15 @@ static long ResolvePathToCatalogEntry(char * filePath, long * flags, void * entr
 	// gTempStr is a name in the current Dir.
 	// restPath is the rest of the path if any.
 
-	result = ReadCatalogEntry(gTempStr, dirID, entry, dirIndex);
+	// Directory iteration needs the position of the entry, which isn't cached.
+	if (dirIndex != 0)
+	{
+		result = ReadCatalogEntry(gTempStr, dirID, entry, dirIndex);
+	}
+	else
+	{
+		result = LookupCatalogEntry(gTempStr, dirID, entry);
+	}
 
 	if (result == -1)
 	{
@@ -748,37 +934,50 @@ static long ResolvePathToCatalogEntry(char * filePath, long * flags, void * entr
 
 //==============================================================================
 
-static long GetCatalogEntry(long long * dirIndex, char ** name, long * flags, u_int32_t * time, FinderInfo * finderInfo, long * infoValid)
+static long LookupCatalogEntry(char * fileName, u_int32_t dirID, void * entry)
 {
-	u_int64_t         extentSize;
-	void              *extent;
-	char              *nodeBuf, *testKey, *entry;
-	BTNodeDescriptor  *node;
-	u_int32_t         curNode;
-	u_int16_t         nodeSize, index;
+	long result;
 
-	if (gIsHFSPlus)
-	{
-		extent     = &gHFSPlus->catalogFile.extents;
-		extentSize = SWAP_BE64(gHFSPlus->catalogFile.logicalSize);
-	}
-	else
+	result = NameCacheLookup(gCurrentIH, dirID, fileName, entry, kCatalogEntrySize);
+
+	if (result < 0)
 	{
-		extent     = (HFSExtentDescriptor *)&gHFSMDB->drCTExtRec;
-		extentSize = SWAP_BE32(gHFSMDB->drCTFlSize);
+		result = ReadCatalogEntry(fileName, dirID, entry, 0);
+		NameCacheEnter(gCurrentIH, dirID, fileName, (result == -1) ? 0 : entry, kCatalogEntrySize);
+
+		return result;
 	}
 
+	return result ? 0 : -1;
+}
+
+//==============================================================================
+
+static long GetCatalogEntry(long long * dirIndex, char ** name, long * flags, u_int32_t * time, FinderInfo * finderInfo, long * infoValid)
+{
+	char              *testKey, *entry;
+	HFSBTNode         *node;
+	u_int32_t         curNode;
+	u_int16_t         nodeSize, index;
+
 	nodeSize = SWAP_BE16(gBTHeaders[kBTreeCatalog]->nodeSize);
-	nodeBuf  = (char *)malloc(nodeSize);
-	node     = (BTNodeDescriptor *)nodeBuf;
 
 	index   = (u_int16_t) (*dirIndex % nodeSize);
 	curNode = (u_int32_t) (*dirIndex / nodeSize);
 
-	// Read the BTree node and get the record for index.
-	ReadExtent(extent, extentSize, kHFSCatalogFileID, (long long) curNode * nodeSize, nodeSize, nodeBuf, 1);
+	// Get the BTree node, usually still cached from the previous entry, and the record for index.
+	node = GetBTreeNode(kBTreeCatalog, curNode);
+
+	if ((node == 0) || (index >= node->numRecords))
+	{
+		gTempStr[0] = '\0';
+		*name = gTempStr;
+		*flags = kFileTypeUnknown;
+		*dirIndex = 0;
+		return -1;
+	}
 
-	GetBTreeRecord(index, nodeBuf, nodeSize, &testKey, &entry);
+	GetBTreeRecord(node, index, &testKey, &entry);
 
 	GetCatalogEntryInfo(entry, flags, time, finderInfo, infoValid);
 
@@ -801,16 +1000,14 @@ static long GetCatalogEntry(long long * dirIndex, char ** name, long * flags, u_
 	// Update dirIndex.
 	index++;
 
-	if (index == SWAP_BE16(node->numRecords))
+	if (index == node->numRecords)
 	{
 		index = 0;
-		curNode = SWAP_BE32(node->fLink);
+		curNode = SWAP_BE32(node->desc->fLink);
 	}
 
 	*dirIndex = (long long) curNode * nodeSize + index;
 
-	free(nodeBuf);
-
 	return 0;
 }
 
@@ -878,51 +1075,56 @@ static long ReadExtentsEntry(u_int32_t fileID, long startBlock, void * entry)
 
 //==============================================================================
 
-static long ReadBTreeEntry(long btree, void * key, char * entry, long long * dirIndex)
+static void GetBTreeFile(long btree, void ** extent, u_int64_t * extentSize, u_int32_t * extentFile)
 {
-	u_int64_t        extentSize;
-	void             *extent;
-	u_int16_t        extentFile;
-	char             *nodeBuf;
-	BTNodeDescriptor *node;
-	long             result = 0, entrySize = 0;
-	u_int32_t        curNode;
-	char             *testKey, *recordData;
-	u_int16_t        nodeSize, index = 0, lowerBound, upperBound;
-
-	// Figure out which tree is being looked at.
 	if (btree == kBTreeCatalog)
 	{
-		if (gIsHFSPlus) 
+		if (gIsHFSPlus)
 		{
-			extent     = &gHFSPlus->catalogFile.extents;
-			extentSize = SWAP_BE64(gHFSPlus->catalogFile.logicalSize);
+			*extent     = &gHFSPlus->catalogFile.extents;
+			*extentSize = SWAP_BE64(gHFSPlus->catalogFile.logicalSize);
 		}
 		else
 		{
-			extent     = (HFSExtentDescriptor *)&gHFSMDB->drCTExtRec;
-			extentSize = SWAP_BE32(gHFSMDB->drCTFlSize);
+			*extent     = (HFSExtentDescriptor *)&gHFSMDB->drCTExtRec;
+			*extentSize = SWAP_BE32(gHFSMDB->drCTFlSize);
 		}
-		extentFile = kHFSCatalogFileID;
+		*extentFile = kHFSCatalogFileID;
 	}
 	else
 	{
 		if (gIsHFSPlus)
 		{
-			extent     = &gHFSPlus->extentsFile.extents;
-			extentSize = SWAP_BE64(gHFSPlus->extentsFile.logicalSize);
+			*extent     = &gHFSPlus->extentsFile.extents;
+			*extentSize = SWAP_BE64(gHFSPlus->extentsFile.logicalSize);
 		}
 		else
 		{
-			extent     = (HFSExtentDescriptor *)&gHFSMDB->drXTExtRec;
-			extentSize = SWAP_BE32(gHFSMDB->drXTFlSize);
+			*extent     = (HFSExtentDescriptor *)&gHFSMDB->drXTExtRec;
+			*extentSize = SWAP_BE32(gHFSMDB->drXTFlSize);
 		}
-		extentFile = kHFSExtentsFileID;
+		*extentFile = kHFSExtentsFileID;
 	}
+}
+
+//==============================================================================
+
+static long ReadBTreeEntry(long btree, void * key, char * entry, long long * dirIndex)
+{
+	u_int64_t        extentSize;
+	void             *extent;
+	u_int32_t        extentFile;
+	HFSBTNode        *node;
+	long             result = 0, entrySize = 0;
+	u_int32_t        curNode;
+	char             *testKey, *recordData = 0;
+	u_int16_t        nodeSize, index = 0;
 
 	// Read the BTree Header if needed.
 	if (gBTHeaders[btree] == 0)
 	{
+		GetBTreeFile(btree, &extent, &extentSize, &extentFile);
+
 		ReadExtent(extent, extentSize, extentFile, 0, 256, gBTreeHeaderBuffer + btree * 256, 0);
 		gBTHeaders[btree] = (BTHeaderRec *)(gBTreeHeaderBuffer + btree * 256 + sizeof(BTNodeDescriptor));
 
@@ -932,93 +1134,65 @@ static long ReadBTreeEntry(long btree, void * key, char * entry, long long * dir
 		}
 	}
 
-	curNode  = SWAP_BE32(gBTHeaders[btree]->rootNode);
 	nodeSize = SWAP_BE16(gBTHeaders[btree]->nodeSize);
-	nodeBuf  = (char *)malloc(nodeSize);
 
-	if (!nodeBuf) 
-	{
-		return -1;
-	}
+	// Lookups tend to stay in the same directory: if the key falls between
+	// the first and last keys of the last leaf visited it can only be there.
+	node = gBTLastLeaf[btree];
 
-	node     = (BTNodeDescriptor *)nodeBuf;
+	if (node && node->valid && (node->ih == gCurrentIH) && (node->btree == btree) && (node->numRecords > 0))
+	{
+		node->time = ++gBTNodeTime;
+		result = SearchBTreeNode(btree, node, key, &index);
 
-	while (1)
+		if ((result < 0) || ((result > 0) && (index == node->numRecords - 1)))
+		{
+			node = 0;
+		}
+	}
+	else
 	{
-		// Read the current node.
-        	ReadExtent(extent, extentSize, extentFile, (long long) curNode * nodeSize, nodeSize, nodeBuf, 1);
+		node = 0;
+	}
 
-		// Find the matching key.
-		lowerBound = 0;
-		upperBound = SWAP_BE16(node->numRecords) - 1;
+	if (node == 0)
+	{
+		curNode = SWAP_BE32(gBTHeaders[btree]->rootNode);
 
-		while (lowerBound <= upperBound)
+		while (1)
 		{
-			index = (lowerBound + upperBound) / 2;
-
-			GetBTreeRecord(index, nodeBuf, nodeSize, &testKey, &recordData);
+			// Get the current node.
+			node = GetBTreeNode(btree, curNode);
 
-			if (gIsHFSPlus)
+			if ((node == 0) || (node->numRecords == 0))
 			{
-				if (btree == kBTreeCatalog)
-				{
-					result = CompareHFSPlusCatalogKeys(key, testKey);
-				}
-				else
-				{
-					result = CompareHFSPlusExtentsKeys(key, testKey);
-				}
-			}
-			else
-			{
-				if (btree == kBTreeCatalog)
-				{
-					result = CompareHFSCatalogKeys(key, testKey);
-				}
-				else
-				{
-					result = CompareHFSExtentsKeys(key, testKey);
-				}
+				return -1;
 			}
 
-			if (result < 0)
-			{
-				upperBound = index - 1;	// search < trial
-			}
-			else if (result > 0)
-			{
-				lowerBound = index + 1;	// search > trial
-			}
-			else
+			// Find the closest key.
+			result = SearchBTreeNode(btree, node, key, &index);
+
+			// Recurse on it if this is an index node.
+			if (node->desc->kind != kBTIndexNode)
 			{
-				break;			// search = trial
+				break;
 			}
-		}
 
-		if (result < 0)
-		{
-			index = upperBound;
-			GetBTreeRecord(index, nodeBuf, nodeSize, &testKey, &recordData);
-		}
-
-		// Found the closest key... Recurse on it if this is an index node.
-		if (node->kind == kBTIndexNode)
-		{
+			GetBTreeRecord(node, index, &testKey, &recordData);
 			curNode = SWAP_BE32( *((long *)recordData) );
 		}
-		else
-		{
-			break;
-		}
+
+		gBTLastLeaf[btree] = node;
 	}
 
 	// Return error if the file was not found.
-	if (result != 0 || !recordData)
+	if (result != 0 || node->numRecords == 0)
 	{
-		free(nodeBuf);
 		return -1;
 	}
 
+	GetBTreeRecord(node, index, &testKey, &recordData);
+
 	if (btree == kBTreeCatalog)
 	{
 		switch (SWAP_BE16(*(short *)recordData))
@@ -1060,30 +1234,207 @@ static long ReadBTreeEntry(long btree, void * key, char * entry, long long * dir
 	// Update dirIndex.
 	if (dirIndex != 0)
 	{
+		curNode = node->nodeNum;
 		index++;
 
-		if (index == SWAP_BE16(node->numRecords))
+		if (index == node->numRecords)
 		{
 			index = 0;
-			curNode = SWAP_BE32(node->fLink);
+			curNode = SWAP_BE32(node->desc->fLink);
 		}
 
 		*dirIndex = (long long) curNode * nodeSize + index;
 	}
 
-	free(nodeBuf);
-
 	return 0;
 }
 
+//==============================================================================
+// Binary search of a node. Returns the comparison result for the closest
+// record whose key is not greater than key (or the first record).
+
+static long SearchBTreeNode(long btree, HFSBTNode * node, void * key, u_int16_t * index)
+{
+	long result = -1;
+	int  lowerBound, upperBound, trial = 0;
+	char *testKey, *recordData;
+
+	lowerBound = 0;
+	upperBound = node->numRecords - 1;
+
+	while (lowerBound <= upperBound)
+	{
+		trial = (lowerBound + upperBound) / 2;
+
+		GetBTreeRecord(node, trial, &testKey, &recordData);
+
+		if (gIsHFSPlus)
+		{
+			if (btree == kBTreeCatalog)
+			{
+				result = CompareHFSPlusCatalogKeys(key, testKey);
+			}
+			else
+			{
+				result = CompareHFSPlusExtentsKeys(key, testKey);
+			}
+		}
+		else
+		{
+			if (btree == kBTreeCatalog)
+			{
+				result = CompareHFSCatalogKeys(key, testKey);
+			}
+			else
+			{
+				result = CompareHFSExtentsKeys(key, testKey);
+			}
+		}
+
+		if (result < 0)
+		{
+			upperBound = trial - 1;	// search < trial
+		}
+		else if (result > 0)
+		{
+			lowerBound = trial + 1;	// search > trial
+		}
+		else
+		{
+			*index = trial;		// search = trial
+			return 0;
+		}
+	}
+
+	if (upperBound < 0)
+	{
+		*index = 0;
+		return -1;
+	}
+
+	*index = upperBound;
+
+	return 1;
+}
+
+//==============================================================================
+// Returns a B-tree node of the current volume, reading it on a cache miss.
+
+static HFSBTNode *GetBTreeNode(long btree, u_int32_t nodeNum)
+{
+	u_int64_t  extentSize;
+	void       *extent;
+	u_int32_t  extentFile, cnt, maxRecords;
+	u_int16_t  nodeSize;
+	HFSBTNode  *node = 0, *leaf = 0;
+
+	nodeSize = SWAP_BE16(gBTHeaders[btree]->nodeSize);
+
+	for (cnt = 0; cnt < kBTNodeCount; cnt++)
+	{
+		if (gBTNodes[cnt].valid && (gBTNodes[cnt].ih == gCurrentIH) && (gBTNodes[cnt].btree == btree) && (gBTNodes[cnt].nodeNum == nodeNum))
+		{
+			gBTNodes[cnt].time = ++gBTNodeTime;
+			return &gBTNodes[cnt];
+		}
+
+		if (gBTNodes[cnt].loading)
+		{
+			continue;
+		}
+
+		// Pick the least recently used node, preferring leaves.
+		if ((node == 0) || (gBTNodes[cnt].time < node->time))
+		{
+			node = &gBTNodes[cnt];
+		}
+
+		if (!gBTNodes[cnt].valid || (gBTNodes[cnt].desc->kind != kBTIndexNode))
+		{
+			if ((leaf == 0) || (gBTNodes[cnt].time < leaf->time))
+			{
+				leaf = &gBTNodes[cnt];
+			}
+		}
+	}
+
+	if (leaf)
+	{
+		node = leaf;
+	}
+
+	if (node->buffer && (node->nodeSize != nodeSize))
+	{
+		free(node->buffer);
+		node->buffer = 0;
+	}
+
+	// The record offset table never needs more room than the node itself.
+	if (node->buffer == 0)
+	{
+		node->buffer = malloc(2 * nodeSize);
+
+		if (node->buffer == 0)
+		{
+			return 0;
+		}
+	}
+
+	if (gBTLastLeaf[0] == node)
+	{
+		gBTLastLeaf[0] = 0;
+	}
+
+	if (gBTLastLeaf[1] == node)
+	{
+		gBTLastLeaf[1] = 0;
+	}
+
+	// Claim the node before reading, ReadExtent may need nodes of the extents tree.
+	node->valid    = 0;
+	node->loading  = 1;
+	node->ih       = gCurrentIH;
+	node->btree    = btree;
+	node->nodeNum  = nodeNum;
+	node->nodeSize = nodeSize;
+	node->time     = ++gBTNodeTime;
+	node->desc     = (BTNodeDescriptor *)node->buffer;
+	node->offsets  = (u_int16_t *)(node->buffer + nodeSize);
+
+	GetBTreeFile(btree, &extent, &extentSize, &extentFile);
+
+	if (ReadExtent(extent, extentSize, extentFile, (long long) nodeNum * nodeSize, nodeSize, node->buffer, 1) != nodeSize)
+	{
+		node->loading = 0;
+		return 0;
+	}
+
+	maxRecords = (nodeSize - sizeof(BTNodeDescriptor)) / sizeof(u_int16_t);
+	node->numRecords = SWAP_BE16(node->desc->numRecords);
+
+	if (node->numRecords > maxRecords)
+	{
+		node->numRecords = maxRecords;
+	}
+
+	for (cnt = 0; cnt < node->numRecords; cnt++)
+	{
+		node->offsets[cnt] = SWAP_BE16(*((u_int16_t *)(node->buffer + (nodeSize - 2 * cnt - 2))));
+	}
+
+	node->loading = 0;
+	node->valid = 1;
+
+	return node;
+}
+
 //==============================================================================
 
-static void GetBTreeRecord(u_int16_t index, char * nodeBuffer, u_int16_t nodeSize, char ** key, char ** data)
+static void GetBTreeRecord(HFSBTNode * node, u_int16_t index, char ** key, char ** data)
 {
-	u_int16_t recordOffset, keySize;
+	u_int16_t keySize;
 
-	recordOffset = SWAP_BE16(*((u_int16_t *)(nodeBuffer + (nodeSize - 2 * index - 2))));
-	*key = nodeBuffer + recordOffset;
+	*key = node->buffer + node->offsets[index];
 
 	if (gIsHFSPlus)
 	{
@@ -1099,30 +1450,40 @@ static void GetBTreeRecord(u_int16_t index, char * nodeBuffer, u_int16_t nodeSiz
 
 //==============================================================================
 
+static void FreeBTreeNodes(CICell ih)
+{
+	u_int32_t cnt;
+
+	for (cnt = 0; cnt < kBTNodeCount; cnt++)
+	{
+		if (gBTNodes[cnt].ih == ih)
+		{
+			gBTNodes[cnt].valid = 0;
+		}
+	}
+}
+
+//==============================================================================
+
 static long ReadExtent(char * extent, u_int64_t extentSize, u_int32_t extentFile, u_int64_t offset, u_int64_t size, void * buffer, long cache)
 {
-	u_int64_t lastOffset;
-	u_int64_t blockNumber, countedBlocks = 0;
-	u_int64_t nextExtent = 0, sizeRead = 0, readSize;
-	u_int64_t nextExtentBlock, currentExtentBlock = 0;
-	u_int64_t readOffset;
-	u_int64_t extentDensity, sizeofExtent, currentExtentSize;
-	char      *currentExtent, *extentBuffer = 0, *bufferPos = buffer;
+	u_int64_t    lastOffset;
+	u_int64_t    blockNumber, sizeRead = 0, readSize;
+	u_int64_t    readOffset;
+	char         *bufferPos = buffer;
+	HFSExtentMap *map;
+	HFSExtentRun *run;
 
 	if (offset >= extentSize)
 	{
 		return 0;
 	}
 
-	if (gIsHFSPlus)
-	{
-		extentDensity = kHFSPlusExtentDensity;
-		sizeofExtent  = sizeof(HFSPlusExtentDescriptor);
-	}
-	else
+	map = GetExtentMap(extent, extentSize, extentFile);
+
+	if (map == 0)
 	{
-		extentDensity = kHFSExtentDensity;
-		sizeofExtent  = sizeof(HFSExtentDescriptor);
+		return -1;
 	}
 
 	lastOffset = offset + size;
@@ -1132,73 +1493,211 @@ static long ReadExtent(char * extent, u_int64_t extentSize, u_int32_t extentFile
 		blockNumber = offset / gBlockSize;
 
 		// Find the extent for the offset.
-		for (; ; nextExtent++)
+		run = FindExtentRun(map, (u_int32_t)blockNumber);
+
+		if (run == 0)
 		{
-			if (nextExtent < extentDensity)
-			{
-				if ((countedBlocks + GetExtentSize(extent, nextExtent) -1) < blockNumber)
-				{
-					countedBlocks += GetExtentSize(extent, nextExtent);
-					continue;
-				}
+			break;
+		}
 
-				currentExtent = extent + nextExtent * sizeofExtent;
-				break;
-			}
+		readOffset = ((blockNumber - run->logicalBlock) * gBlockSize) + (offset % gBlockSize);
 
-			if (extentBuffer == 0)
-			{
-				extentBuffer = malloc(sizeofExtent * extentDensity);
+		readSize = (long long)run->blockCount * gBlockSize - readOffset;
 
-				if (extentBuffer == 0)
-				{
-					return -1;
-				}
-			}
+		if (readSize > (size - sizeRead))
+		{
+			readSize = size - sizeRead;
+		}
 
-			nextExtentBlock = nextExtent / extentDensity;
+		readOffset += (long long)run->startBlock * gBlockSize;
 
-			if (currentExtentBlock != nextExtentBlock)
-			{
-				ReadExtentsEntry(extentFile, countedBlocks, extentBuffer);
-				currentExtentBlock = nextExtentBlock;
-			}
+		CacheRead(gCurrentIH, bufferPos, gAllocationOffset + readOffset, readSize, cache);
+
+		sizeRead += readSize;
+		offset += readSize;
+		bufferPos += readSize;
+	}
+
+	return sizeRead;
+}
+
+//==============================================================================
+
+static long AddExtentRuns(HFSExtentMap *map, void *extents, u_int32_t *countedBlocks)
+{
+	u_int32_t    cnt, blockCount, extentDensity;
+	HFSExtentRun *runs;
+
+	extentDensity = gIsHFSPlus ? kHFSPlusExtentDensity : kHFSExtentDensity;
+
+	for (cnt = 0; cnt < extentDensity; cnt++)
+	{
+		blockCount = GetExtentSize(extents, cnt);
+
+		if (blockCount == 0)
+		{
+			break;
+		}
 
-			currentExtentSize = GetExtentSize(extentBuffer, nextExtent % extentDensity);
+		if (map->numRuns == map->maxRuns)
+		{
+			runs = malloc(2 * map->maxRuns * sizeof(HFSExtentRun));
 
-			if ((countedBlocks + currentExtentSize - 1) >= blockNumber)
+			if (runs == 0)
 			{
-				currentExtent = extentBuffer + sizeofExtent * (nextExtent % extentDensity);
-				break;
+				return -1;
 			}
 
-			countedBlocks += currentExtentSize;
+			bcopy(map->runs, runs, map->numRuns * sizeof(HFSExtentRun));
+			free(map->runs);
+			map->runs = runs;
+			map->maxRuns *= 2;
 		}
 
-		readOffset = ((blockNumber - countedBlocks) * gBlockSize) + (offset % gBlockSize);
+		map->runs[map->numRuns].logicalBlock = *countedBlocks;
+		map->runs[map->numRuns].startBlock   = GetExtentStart(extents, cnt);
+		map->runs[map->numRuns].blockCount   = blockCount;
+		map->numRuns++;
 
-		readSize = (long long)GetExtentSize(currentExtent, 0) * gBlockSize - readOffset;
+		*countedBlocks += blockCount;
+	}
 
-		if (readSize > (size - sizeRead))
+	return cnt;
+}
+
+//==============================================================================
+// Returns the extent map of a file, building it the first time the file is read.
+
+static HFSExtentMap *GetExtentMap(char * extent, u_int64_t extentSize, u_int32_t extentFile)
+{
+	char         extentBuffer[sizeof(HFSPlusExtentRecord)];
+	u_int32_t    cnt, countedBlocks = 0, totalBlocks;
+	HFSExtentMap *map = 0;
+
+	for (cnt = 0; cnt < kExtentMapCount; cnt++)
+	{
+		if ((gExtentMaps[cnt].ih == gCurrentIH) && (gExtentMaps[cnt].fileID == extentFile) && gExtentMaps[cnt].runs)
 		{
-			readSize = size - sizeRead;
+			gExtentMaps[cnt].time = ++gExtentMapTime;
+			return &gExtentMaps[cnt];
 		}
 
-		readOffset += (long long)GetExtentStart(currentExtent, 0) * gBlockSize;
+		if ((map == 0) || (gExtentMaps[cnt].time < map->time))
+		{
+			map = &gExtentMaps[cnt];
+		}
+	}
 
-		CacheRead(gCurrentIH, bufferPos, gAllocationOffset + readOffset, readSize, cache);
+	// Recycle the least recently used map. Claim it before reading the
+	// extents overflow file, which needs a map of its own.
+	if (map->runs == 0)
+	{
+		map->maxRuns = gIsHFSPlus ? kHFSPlusExtentDensity : kHFSExtentDensity;
+		map->runs = malloc(map->maxRuns * sizeof(HFSExtentRun));
 
-		sizeRead += readSize;
-		offset += readSize;
-		bufferPos += readSize;
+		if (map->runs == 0)
+		{
+			return 0;
+		}
 	}
 
-	if (extentBuffer)
+	map->ih      = gCurrentIH;
+	map->fileID  = extentFile;
+	map->numRuns = 0;
+	map->lastRun = 0;
+	map->time    = ++gExtentMapTime;
+
+	totalBlocks = (u_int32_t)((extentSize + gBlockSize - 1) / gBlockSize);
+
+	if (AddExtentRuns(map, extent, &countedBlocks) < 0)
 	{
-		free(extentBuffer);
+		map->ih = 0;
+		return 0;
 	}
 
-	return sizeRead;
+	// The extents overflow file itself never has overflow extents.
+	while ((countedBlocks < totalBlocks) && (extentFile != kHFSExtentsFileID))
+	{
+		if (ReadExtentsEntry(extentFile, countedBlocks, extentBuffer) == -1)
+		{
+			break;
+		}
+
+		cnt = countedBlocks;
+
+		if (AddExtentRuns(map, extentBuffer, &countedBlocks) < 0)
+		{
+			map->ih = 0;
+			return 0;
+		}
+
+		if (cnt == countedBlocks)
+		{
+			break;
+		}
+	}
+
+	return map;
+}
+
+//==============================================================================
+
+static HFSExtentRun *FindExtentRun(HFSExtentMap *map, u_int32_t blockNumber)
+{
+	HFSExtentRun *run;
+	u_int32_t    lowerBound, upperBound, index;
+
+	// Sequential reads usually stay in the same run, or move to the next one.
+	for (index = map->lastRun; (index < map->numRuns) && (index <= map->lastRun + 1); index++)
+	{
+		run = &map->runs[index];
+
+		if ((blockNumber >= run->logicalBlock) && (blockNumber - run->logicalBlock < run->blockCount))
+		{
+			map->lastRun = index;
+			return run;
+		}
+	}
+
+	lowerBound = 0;
+	upperBound = map->numRuns;
+
+	while (lowerBound < upperBound)
+	{
+		index = (lowerBound + upperBound) / 2;
+		run = &map->runs[index];
+
+		if (blockNumber < run->logicalBlock)
+		{
+			upperBound = index;
+		}
+		else if (blockNumber - run->logicalBlock >= run->blockCount)
+		{
+			lowerBound = index + 1;
+		}
+		else
+		{
+			map->lastRun = index;
+			return run;
+		}
+	}
+
+	return 0;
+}
+
+//==============================================================================
+
+static void FreeExtentMaps(CICell ih)
+{
+	u_int32_t cnt;
+
+	for (cnt = 0; cnt < kExtentMapCount; cnt++)
+	{
+		if (gExtentMaps[cnt].ih == ih)
+		{
+			gExtentMaps[cnt].ih = 0;
+		}
+	}
 }
 
 //==============================================================================
@@ -28,6 +28,7 @@ extern long HFSReadFile(CICell ih, char * filePath, void *base, u_int64_t offset
 extern long HFSGetDirEntry(CICell ih, char * dirPath, long long * dirIndex,
                            char ** name, long * flags, u_int32_t * time,
                            FinderInfo * finderInfo, long * infoValid);
+extern long HFSGetFileInfo(CICell ih, char * filePath, long * flags, u_int32_t * time);
 extern void HFSGetDescription(CICell ih, char *str, long strMaxLen);
 extern long HFSGetFileBlock(CICell ih, char *str, u_int64_t *firstBlock);
 extern long HFSGetUUID(CICell ih, char *uuidStr);
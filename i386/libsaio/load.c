@@ -27,6 +27,7 @@
 
 #include <mach-o/fat.h>
 #include <mach-o/loader.h>
+#include <mach-o/nlist.h>
 #include <mach/machine/thread_status.h>
 
 #include <sl.h>
@@ -41,6 +42,8 @@
 static long DecodeSegment(long cmdBase, unsigned int*load_addr, unsigned int *load_size);
 static long DecodeUnixThread(long cmdBase, unsigned int *entry);
 static long DecodeSymbolTable(long cmdBase);
+static unsigned long MachOCommands(void *binary, unsigned long *ncmds);
+static void *MachOFileAddress(void *binary, uint64_t addr);
 
 
 static unsigned long gBinaryAddress;
@@ -243,6 +246,144 @@ long DecodeMachO(void *binary, entry_t *rentry, char **raddr, int *rsize)
 }
 
 
+//==============================================================================
+// Return the file data of section segname,sectname of a thin Mach-O image,
+// or of the whole segment if sectname is 0. Returns 0 if there is no such
+// section or it has no file data.
+
+void *GetMachOSection(void *binary, const char *segname, const char *sectname, unsigned long *size)
+{
+	unsigned long ncmds, cmdBase, cnt, sect;
+
+	cmdBase = MachOCommands(binary, &ncmds);
+
+	for (cnt = 0; cnt < ncmds; cnt++, cmdBase += ((long *)cmdBase)[1])
+	{
+		if (((long *)cmdBase)[0] == LC_SEGMENT_64)
+		{
+			struct segment_command_64 *segCmd = (struct segment_command_64 *)cmdBase;
+			struct section_64 *section = (struct section_64 *)(segCmd + 1);
+
+			if (strncmp(segCmd->segname, segname, sizeof(segCmd->segname)) != 0)
+			{
+				continue;
+			}
+
+			if (!sectname)
+			{
+				if (segCmd->filesize == 0)
+				{
+					continue;
+				}
+
+				*size = segCmd->filesize;
+				return (char *)binary + segCmd->fileoff;
+			}
+
+			for (sect = 0; sect < segCmd->nsects; sect++, section++)
+			{
+				if (strncmp(section->sectname, sectname, sizeof(section->sectname)) == 0 && section->offset && section->size)
+				{
+					*size = section->size;
+					return (char *)binary + section->offset;
+				}
+			}
+		}
+		else if (((long *)cmdBase)[0] == LC_SEGMENT)
+		{
+			struct segment_command *segCmd = (struct segment_command *)cmdBase;
+			struct section *section = (struct section *)(segCmd + 1);
+
+			if (strncmp(segCmd->segname, segname, sizeof(segCmd->segname)) != 0)
+			{
+				continue;
+			}
+
+			if (!sectname)
+			{
+				if (segCmd->filesize == 0)
+				{
+					continue;
+				}
+
+				*size = segCmd->filesize;
+				return (char *)binary + segCmd->fileoff;
+			}
+
+			for (sect = 0; sect < segCmd->nsects; sect++, section++)
+			{
+				if (strncmp(section->sectname, sectname, sizeof(section->sectname)) == 0 && section->offset && section->size)
+				{
+					*size = section->size;
+					return (char *)binary + section->offset;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+//==============================================================================
+// Return the file data of the defined symbol name of a thin Mach-O image,
+// or 0 if the image has no symbol table or no such symbol.
+
+void *GetMachOSymbol(void *binary, const char *name)
+{
+	unsigned long ncmds, cmdBase, cnt, sym;
+	struct symtab_command *symTab;
+	const char *strings;
+	uint64_t value;
+	uint32_t strx;
+	uint8_t type;
+
+	cmdBase = MachOCommands(binary, &ncmds);
+
+	for (cnt = 0; cnt < ncmds; cnt++, cmdBase += ((long *)cmdBase)[1])
+	{
+		if (((long *)cmdBase)[0] != LC_SYMTAB)
+		{
+			continue;
+		}
+
+		symTab = (struct symtab_command *)cmdBase;
+		strings = (const char *)binary + symTab->stroff;
+
+		for (sym = 0; sym < symTab->nsyms; sym++)
+		{
+			if (((struct mach_header *)binary)->magic == MH_MAGIC_64)
+			{
+				struct nlist_64 *symbol = (struct nlist_64 *)((char *)binary + symTab->symoff) + sym;
+
+				strx = symbol->n_un.n_strx;
+				type = symbol->n_type;
+				value = symbol->n_value;
+			}
+			else
+			{
+				struct nlist *symbol = (struct nlist *)((char *)binary + symTab->symoff) + sym;
+
+				strx = symbol->n_un.n_strx;
+				type = symbol->n_type;
+				value = symbol->n_value;
+			}
+
+			if ((type & N_STAB) || (type & N_TYPE) != N_SECT || strx >= symTab->strsize)
+			{
+				continue;
+			}
+
+			if (strcmp(strings + strx, name) == 0)
+			{
+				return MachOFileAddress(binary, value);
+			}
+		}
+	}
+
+	return 0;
+}
+
+
 //==============================================================================
 // Private function.
 
@@ -395,3 +536,69 @@ static long DecodeSymbolTable(long cmdBase)
 
 	return 0;
 }
+
+//==============================================================================
+// Return the first load command of a thin Mach-O image, or 0 (with *ncmds
+// cleared) if binary is not one.
+
+static unsigned long MachOCommands(void *binary, unsigned long *ncmds)
+{
+	struct mach_header *mH = (struct mach_header *)binary;
+
+	*ncmds = mH->ncmds;
+
+	switch (mH->magic)
+	{
+		case MH_MAGIC:
+			return (unsigned long)binary + sizeof(struct mach_header);
+
+		case MH_MAGIC_64:
+			return (unsigned long)binary + sizeof(struct mach_header_64);
+
+		default:
+			*ncmds = 0;
+			return 0;
+	}
+}
+
+//==============================================================================
+// Map a virtual address of a thin Mach-O image to its file data, or 0.
+
+static void *MachOFileAddress(void *binary, uint64_t addr)
+{
+	unsigned long ncmds, cmdBase, cnt;
+	uint64_t vmaddr, fileoff, filesize;
+
+	cmdBase = MachOCommands(binary, &ncmds);
+
+	for (cnt = 0; cnt < ncmds; cnt++, cmdBase += ((long *)cmdBase)[1])
+	{
+		if (((long *)cmdBase)[0] == LC_SEGMENT_64)
+		{
+			struct segment_command_64 *segCmd = (struct segment_command_64 *)cmdBase;
+
+			vmaddr = segCmd->vmaddr;
+			fileoff = segCmd->fileoff;
+			filesize = segCmd->filesize;
+		}
+		else if (((long *)cmdBase)[0] == LC_SEGMENT)
+		{
+			struct segment_command *segCmd = (struct segment_command *)cmdBase;
+
+			vmaddr = segCmd->vmaddr;
+			fileoff = segCmd->fileoff;
+			filesize = segCmd->filesize;
+		}
+		else
+		{
+			continue;
+		}
+
+		if (addr >= vmaddr && addr - vmaddr < filesize)
+		{
+			return (char *)binary + (unsigned long)(fileoff + (addr - vmaddr));
+		}
+	}
+
+	return 0;
+}
@@ -107,6 +107,7 @@ void MSDOSFree(CICell ih)
 {
 	if(msdoscurrent == ih)
         msdoscurrent = 0;
+	NameCacheFlush(ih);
     free(ih);
 }
 
@@ -617,54 +618,111 @@ static struct direntry *getdirpfrompath (CICell ih, char *dirspec, uint8_t *buf)
 	uint16_t ucsname[WIN_MAXLEN+1];
 	uint16_t ucslen;
 	int ucslenhost;
+	uint32_t parent;
+	long cached;
 	initRoot (&st);
 	st.buf = (struct direntry *)buf;
+	// Directories are identified by their first cluster in the name cache.
+	parent = st.cluster;
 	ptr=(uint8_t*)dirspec;
-	for (slash=ptr;*slash && *slash!='/';slash++);
-	c=*slash;
-	*slash=0;
-	utf_decodestr (ptr, ucsname, &ucslen, WIN_MAXLEN, OSLittleEndian);
-	ucslenhost = OSReadLittleInt16 (&ucslen,0);
-	ucsname[ucslenhost]=0;
-	*slash=c;	
-	while ((dirp = getnextdirent (ih, vfatname, &st)))
+	while (1)
 	{
-		if (checkname (ucsname, ucslenhost, dirp, vfatname))
+		for (slash=ptr;*slash && *slash!='/';slash++);
+		c=*slash;
+		*slash=0;
+		cached = NameCacheLookup(ih, parent, (char *)ptr, buf, sizeof (struct direntry));
+		if (cached < 0)
 		{
-			for (;*ptr && *ptr!='/';ptr++);
-			if (!*ptr)
-			{
-				return dirp;
-			}
-
-			ptr++;
-			if (!*ptr)
-			{
-				return dirp;
-			}
-
-			for (slash=ptr;*slash && *slash!='/';slash++);
-			c=*slash;
-			*slash=0;
 			utf_decodestr (ptr, ucsname, &ucslen, WIN_MAXLEN, OSLittleEndian);
 			ucslenhost = OSReadLittleInt16 (&ucslen,0);
 			ucsname[ucslenhost]=0;
-			*slash=c;
-			if (!(dirp->deAttributes & ATTR_DIRECTORY))
+			while ((dirp = getnextdirent (ih, vfatname, &st)))
 			{
-				return 0;
+				if (checkname (ucsname, ucslenhost, dirp, vfatname))
+				{
+					break;
+				}
 			}
+			NameCacheEnter(ih, parent, (char *)ptr, dirp, sizeof (struct direntry));
+		}
+		else
+		{
+			dirp = cached ? (struct direntry *)buf : 0;
+		}
+		*slash=c;
 
-			st.root16 = 0;
-			st.vfatchecksum = 0;
-			st.nument = 0;
-			st.cluster = OSReadLittleInt16 ((dirp->deStartCluster),0);
-			if (msdosfatbits == 32)
-				st.cluster |= ((uint32_t)OSReadLittleInt16 ((dirp->deHighClust),0)) <<16;
-			st.vfatnumber = 0;
+		if (!dirp)
+		{
+			return 0;
+		}
+
+		ptr = slash;
+		if (!*ptr)
+		{
+			return dirp;
+		}
+
+		ptr++;
+		if (!*ptr)
+		{
+			return dirp;
+		}
+
+		if (!(dirp->deAttributes & ATTR_DIRECTORY))
+		{
+			return 0;
 		}
+
+		st.root16 = 0;
+		st.vfatchecksum = 0;
+		st.nument = 0;
+		st.cluster = OSReadLittleInt16 ((dirp->deStartCluster),0);
+		if (msdosfatbits == 32)
+			st.cluster |= ((uint32_t)OSReadLittleInt16 ((dirp->deHighClust),0)) <<16;
+		st.vfatnumber = 0;
+		parent = st.cluster;
 	}
-	return 0;
+}
+
+/*
+ * Convert a DOS date and time to seconds since 1970, like the times HFS
+ * returns. DOS times are local wall clock times without a time zone, so
+ * they are taken as UTC; times only have a 2 second granularity.
+ */
+u_int32_t MSDOSTimeToUnix (u_int16_t date, u_int16_t time)
+{
+	static const u_int16_t daysBeforeMonth[12] = {
+		0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334
+	};
+	u_int32_t year = 1980 + (date >> 9);
+	u_int32_t month = (date >> 5) & 0x0F;
+	u_int32_t day = date & 0x1F;
+	u_int32_t days;
+
+	if (month < 1 || month > 12)
+	{
+		month = 1;
+	}
+	if (day < 1)
+	{
+		day = 1;
+	}
+
+	// Days from 1970 to the start of the year, with the leap days in between.
+	days = (year - 1970) * 365 + (year - 1969) / 4 - (year - 1901) / 100 + (year - 1601) / 400;
+	days += daysBeforeMonth[month - 1] + day - 1;
+
+	if (month > 2 && (year % 4) == 0 && ((year % 100) != 0 || (year % 400) == 0))
+	{
+		days++;
+	}
+
+	return days * 86400 + (time >> 11) * 3600 + ((time >> 5) & 0x3F) * 60 + (time & 0x1F) * 2;
+}
+
+static u_int32_t getdirptime (struct direntry *dirp)
+{
+	return MSDOSTimeToUnix (OSReadLittleInt16 (&dirp->deMDate, 0), OSReadLittleInt16 (&dirp->deMTime, 0));
 }
 
 long MSDOSGetDirEntry(CICell ih, char * dirPath, long long * dirIndex,
@@ -806,8 +864,7 @@ long MSDOSGetDirEntry(CICell ih, char * dirPath, long long * dirIndex,
 		*flags = kFileTypeFlat;
 	}
 
-	// Calculate a fake timestamp using modification date and time values.
-	*time = (dirp->deMDate & 0x7FFF) << (16 + dirp->deMTime);
+	*time = getdirptime (dirp);
 	
 	if (infoValid)
 	{
@@ -817,6 +874,57 @@ long MSDOSGetDirEntry(CICell ih, char * dirPath, long long * dirIndex,
 	return 0;
 }
 
+long MSDOSGetFileInfo(CICell ih, char * filePath, long * flags, u_int32_t * time)
+{
+	uint8_t *buf;
+	struct direntry *dirp;
+
+	if (MSDOSInitPartition (ih)<0)
+	{
+		return -1;
+	}
+
+	if (filePath[0] == '/')
+	{
+		filePath++;
+	}
+
+	if (!filePath[0])
+	{
+		return -1;
+	}
+
+	buf = malloc(msdosclustersize);
+
+	if (!buf)
+	{
+		return -1;
+	}
+
+	bzero(buf,msdosclustersize);
+	dirp = getdirpfrompath (ih, filePath, buf);
+
+	if (!dirp)
+	{
+		free (buf);
+		return -1;
+	}
+
+	if (dirp->deAttributes & ATTR_DIRECTORY)
+	{
+		*flags = kFileTypeDirectory;
+	}
+	else
+	{
+		*flags = kFileTypeFlat;
+	}
+
+	*time = getdirptime (dirp);
+
+	free (buf);
+	return 0;
+}
+
 long MSDOSReadFile(CICell ih, char * filePath, void *base, uint64_t offset, uint64_t length)
 {
 	uint8_t *buf;
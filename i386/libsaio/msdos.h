@@ -27,7 +27,9 @@ extern long MSDOSReadFile(CICell ih, char * filePath, void *base, uint64_t offse
 extern long MSDOSGetDirEntry(CICell ih, char * dirPath, long long * dirIndex,
                            char ** name, long * flags, u_int32_t * time,
                            FinderInfo * finderInfo, long * infoValid);
+extern long MSDOSGetFileInfo(CICell ih, char * filePath, long * flags, u_int32_t * time);
 extern long MSDOSGetFileBlock(CICell ih, char *str, unsigned long long *firstBlock);
 extern long MSDOSGetUUID(CICell ih, char *uuidStr);
 extern void MSDOSFree(CICell ih);
 extern int MSDOSProbe (const void *buf);
+extern u_int32_t MSDOSTimeToUnix (u_int16_t date, u_int16_t time);
@@ -0,0 +1,245 @@
+/*
+ *  namecache.c - Volume scoped cache of directory lookups.
+ *
+ *  Maps (volume, parent directory id, name) to the entry the file system
+ *  found for that name, or to "no such name", so that resolving the same
+ *  paths over and over (kext scanning...) doesn't walk the directories again.
+ *  The meaning of the parent id and of the entry is up to each file system.
+ */
+
+#include "libsaio.h"
+
+#define kNameCacheEntries     (1024)
+#define kNameCacheHashBits    (10)
+#define kNameCacheHashSize    (1 << kNameCacheHashBits)
+
+typedef struct NameCacheEntry NameCacheEntry;
+
+struct NameCacheEntry {
+	NameCacheEntry *hashNext;
+	NameCacheEntry *lruPrev;
+	NameCacheEntry *lruNext;
+	CICell         ih;
+	u_int32_t      parentID;
+	u_int32_t      hash;
+	u_int32_t      dataSize;	// 0 for a negative entry
+	char           name[kNameCacheMaxName];
+	char           data[kNameCacheMaxData];
+};
+
+static NameCacheEntry *gNameCacheEntries;
+static NameCacheEntry **gNameCacheHash;
+static NameCacheEntry gNameCacheLRU;	// list head: lruNext is the MRU entry, lruPrev the LRU one
+static long           gNameCacheUsed;
+
+static unsigned long  gNameCacheHits;
+static unsigned long  gNameCacheNegativeHits;
+static unsigned long  gNameCacheMisses;
+
+//==============================================================================
+
+static u_int32_t NameCacheHash(CICell ih, u_int32_t parentID, const char *name)
+{
+	u_int32_t hash = 2166136261U ^ parentID ^ (u_int32_t)ih;
+
+	while (*name)
+	{
+		hash = (hash ^ (u_int8_t)*name++) * 16777619U;
+	}
+
+	return hash;
+}
+
+//==============================================================================
+
+static bool NameCacheSetup(void)
+{
+	if (gNameCacheEntries)
+	{
+		return true;
+	}
+
+	gNameCacheEntries = (NameCacheEntry *) malloc(kNameCacheEntries * sizeof(NameCacheEntry));
+	gNameCacheHash = (NameCacheEntry **) malloc(kNameCacheHashSize * sizeof(NameCacheEntry *));
+
+	if (!gNameCacheEntries || !gNameCacheHash)
+	{
+		if (gNameCacheEntries)
+		{
+			free(gNameCacheEntries);
+		}
+
+		if (gNameCacheHash)
+		{
+			free(gNameCacheHash);
+		}
+
+		gNameCacheEntries = NULL;
+		gNameCacheHash = NULL;
+		return false;
+	}
+
+	bzero(gNameCacheHash, kNameCacheHashSize * sizeof(NameCacheEntry *));
+	gNameCacheLRU.lruNext = gNameCacheLRU.lruPrev = &gNameCacheLRU;
+	gNameCacheUsed = 0;
+
+	return true;
+}
+
+//==============================================================================
+
+static void NameCacheUnlink(NameCacheEntry *entry)
+{
+	NameCacheEntry **link = &gNameCacheHash[entry->hash & (kNameCacheHashSize - 1)];
+
+	while (*link != NULL)
+	{
+		if (*link == entry)
+		{
+			*link = entry->hashNext;
+			break;
+		}
+
+		link = &(*link)->hashNext;
+	}
+
+	entry->lruPrev->lruNext = entry->lruNext;
+	entry->lruNext->lruPrev = entry->lruPrev;
+}
+
+//==============================================================================
+
+static inline void NameCacheMakeMRU(NameCacheEntry *entry)
+{
+	entry->lruPrev = &gNameCacheLRU;
+	entry->lruNext = gNameCacheLRU.lruNext;
+	gNameCacheLRU.lruNext->lruPrev = entry;
+	gNameCacheLRU.lruNext = entry;
+}
+
+//==============================================================================
+// Returns 1 and copies the entry if name is known to exist, 0 if it is known
+// not to exist, and -1 if the file system has to look it up.
+
+long NameCacheLookup(CICell ih, u_int32_t parentID, const char *name, void *data, u_int32_t dataSize)
+{
+	NameCacheEntry *entry;
+	u_int32_t hash;
+
+	if (!gNameCacheEntries || (strlen(name) >= kNameCacheMaxName))
+	{
+		gNameCacheMisses++;
+		return -1;
+	}
+
+	hash = NameCacheHash(ih, parentID, name);
+
+	for (entry = gNameCacheHash[hash & (kNameCacheHashSize - 1)]; entry != NULL; entry = entry->hashNext)
+	{
+		if ((entry->hash == hash) && (entry->ih == ih) && (entry->parentID == parentID) && (strcmp(entry->name, name) == 0))
+		{
+			break;
+		}
+	}
+
+	if (entry == NULL)
+	{
+		gNameCacheMisses++;
+		return -1;
+	}
+
+	entry->lruPrev->lruNext = entry->lruNext;
+	entry->lruNext->lruPrev = entry->lruPrev;
+	NameCacheMakeMRU(entry);
+
+	if (entry->dataSize == 0)
+	{
+		gNameCacheNegativeHits++;
+		return 0;
+	}
+
+	bcopy(entry->data, data, MIN(dataSize, entry->dataSize));
+	gNameCacheHits++;
+
+	return 1;
+}
+
+//==============================================================================
+// Records the result of a lookup, data is NULL when name doesn't exist.
+
+void NameCacheEnter(CICell ih, u_int32_t parentID, const char *name, const void *data, u_int32_t dataSize)
+{
+	NameCacheEntry *entry;
+
+	if ((strlen(name) >= kNameCacheMaxName) || (dataSize > kNameCacheMaxData) || !NameCacheSetup())
+	{
+		return;
+	}
+
+	if (gNameCacheUsed < kNameCacheEntries)
+	{
+		entry = &gNameCacheEntries[gNameCacheUsed++];
+	}
+	else
+	{
+		entry = gNameCacheLRU.lruPrev;
+		NameCacheUnlink(entry);
+	}
+
+	entry->ih = ih;
+	entry->parentID = parentID;
+	entry->hash = NameCacheHash(ih, parentID, name);
+	entry->dataSize = data ? dataSize : 0;
+	strlcpy(entry->name, name, kNameCacheMaxName);
+
+	if (data)
+	{
+		bcopy(data, entry->data, dataSize);
+	}
+
+	entry->hashNext = gNameCacheHash[entry->hash & (kNameCacheHashSize - 1)];
+	gNameCacheHash[entry->hash & (kNameCacheHashSize - 1)] = entry;
+	NameCacheMakeMRU(entry);
+}
+
+//==============================================================================
+// Forgets every entry of a volume, called when the volume goes away.
+
+void NameCacheFlush(CICell ih)
+{
+	NameCacheEntry *entry, *next;
+
+	if (!gNameCacheEntries)
+	{
+		return;
+	}
+
+	for (entry = gNameCacheLRU.lruNext; entry != &gNameCacheLRU; entry = next)
+	{
+		next = entry->lruNext;
+
+		if (entry->ih == ih)
+		{
+			NameCacheUnlink(entry);
+
+			// Park it at the LRU end so it gets reused first.
+			entry->ih = NULL;
+			entry->name[0] = '\0';
+			entry->lruNext = &gNameCacheLRU;
+			entry->lruPrev = gNameCacheLRU.lruPrev;
+			gNameCacheLRU.lruPrev->lruNext = entry;
+			gNameCacheLRU.lruPrev = entry;
+		}
+	}
+}
+
+//==============================================================================
+
+void NameCachePrintStats(void)
+{
+	unsigned long lookups = gNameCacheHits + gNameCacheNegativeHits + gNameCacheMisses;
+
+	verbose("Name cache: %lu lookups, %lu hits, %lu negative hits, %lu misses (%lu percent hit rate)\n",
+		lookups, gNameCacheHits, gNameCacheNegativeHits, gNameCacheMisses,
+		lookups ? ((gNameCacheHits + gNameCacheNegativeHits) * 100) / lookups : 0);
+}
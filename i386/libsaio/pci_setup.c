@@ -25,6 +25,7 @@ extern pci_dt_t *dram_controller_dev;
 
 void setup_pci_devs(pci_dt_t *pci_dt)
 {
+	static moduleHook_t *pciDeviceHook;
 	char *devicepath;
 
 	bool do_gfx_devprop = false;
@@ -168,7 +169,12 @@ void setup_pci_devs(pci_dt_t *pci_dt)
 
 			}
 
-		execute_hook("PCIDevice", current, NULL, NULL, NULL);
+		if (!pciDeviceHook)
+		{
+			pciDeviceHook = intern_hook("PCIDevice");
+		}
+
+		execute_hook_handle(pciDeviceHook, current, NULL, NULL, NULL);
 		DBG("setup_pci_devs current device ID = [%04x:%04x]\n", current->vendor_id, current->device_id);
 		setup_pci_devs(current->children);
 		current = current->next;
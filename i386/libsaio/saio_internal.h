@@ -84,6 +84,7 @@ extern void   finalizeBootStruct(void);
 extern void      CacheReset();
 extern void      CacheInit(CICell ih, u_int32_t blockSize);
 extern u_int32_t CacheRead(CICell ih, char *buffer, long long offset, u_int32_t length, long cache);
+extern void      CachePrintStats();
 
 /* console.c */
 extern bool   gVerboseMode;
@@ -132,9 +133,12 @@ extern void utf_decodestr(const u_int8_t *utf8p, u_int16_t *ucsp,
 extern bool gHaveKernelCache;
 extern long ThinFatFile(void **binary, unsigned long *length);
 extern long DecodeMachO(void *binary, entry_t *rentry, char **raddr, int *rsize);
+extern void *GetMachOSection(void *binary, const char *segname, const char *sectname, unsigned long *size);
+extern void *GetMachOSymbol(void *binary, const char *name);
 
 /* memory.c */
 long AllocateKernelMemory( long inSize );
+long AvailableKernelMemory( long *nextAddr );
 long AllocateMemoryRange(char *rangeName, long start, long length, long type);
 
 /* misc.c */
@@ -142,6 +146,15 @@ extern int    checkForSupportedHardware();
 extern int	  isLaptop();
 extern void   getPlatformName(char *nameBuf, int size);
 
+/* namecache.c */
+#define kNameCacheMaxName     128	// longer names are never cached
+#define kNameCacheMaxData     264	// largest entry a file system may cache
+
+extern long   NameCacheLookup(CICell ih, u_int32_t parentID, const char *name, void *data, u_int32_t dataSize);
+extern void   NameCacheEnter(CICell ih, u_int32_t parentID, const char *name, const void *data, u_int32_t dataSize);
+extern void   NameCacheFlush(CICell ih);
+extern void   NameCachePrintStats(void);
+
 /* nbp.c */
 extern UInt32 nbpUnloadBaseCode();
 extern BVRef  nbpScanBootVolumes(int biosdev, int *count);
@@ -175,8 +188,13 @@ extern long   LoadVolumeFile(BVRef bvr, const char *fileSpec);
 extern long   LoadFile(const char *fileSpec);
 extern long   ReadFileAtOffset(const char * fileSpec, void *buffer, uint64_t offset, uint64_t length);
 extern long   LoadThinFatFile(const char *fileSpec, void **binary);
+extern long   LoadThinFatFileAt(const char *fileSpec, void *base, unsigned long maxLength);
 extern long   GetDirEntry(const char *dirSpec, long long *dirIndex, const char **name,
                           long *flags, u_int32_t *time);
+extern long   GetDirEntries(const char *dirSpec, long long *dirIndex,
+                            FSDirEntry *entries, long maxEntries);
+extern long   GetVolumeFileInfo(BVRef bvr, const char *filePath,
+                                long *flags, u_int32_t *time);
 extern long   GetFileInfo(const char *dirSpec, const char *name,
                           long *flags, u_int32_t *time);
 extern long   GetFileBlock(const char *fileSpec, unsigned long long *firstBlock);
@@ -158,6 +158,7 @@ typedef long (*FSGetDirEntry)(CICell ih, char * dirPath, long long *dirIndex,
 							  char **name, long * flags, u_int32_t *time,
 							  FinderInfo *finderInfo, long *infoValid);
 typedef long (*FSGetUUID)(CICell ih, char *uuidStr);
+typedef long (*FSGetFileInfo)(CICell ih, char *filePath, long *flags, u_int32_t *time);
 typedef void (*BVGetDescription)(CICell ih, char * str, long strMaxLen);
 // Can be just pointed to free or a special free function
 typedef void (*BVFree)(CICell ih);
@@ -178,6 +179,17 @@ struct iob {
 #define F_SSI	   0x40				/* set skip sector inhibit */
 #define F_MEM	   0x80				/* memory instead of file or device */
 
+#define kDirEntryNameLen 256
+
+/* One record of a batched directory read, see GetDirEntries(). */
+typedef struct FSDirEntry {
+	char		name[kDirEntryNameLen];	/* entry name */
+	long		flags;			/* kFileType* and permission bits */
+	u_int32_t	time;			/* modification time */
+	FinderInfo	finderInfo;		/* Finder info (HFS only) */
+	long		infoValid;		/* finderInfo is valid */
+} FSDirEntry;
+
 struct dirstuff {
 	char *		   dir_path;		/* directory path */
 	long long	   dir_index;		/* directory entry index */
@@ -203,6 +215,7 @@ struct BootVolume {
 	FSGetDirEntry		fs_getdirentry;		/* FSGetDirEntry function */
 	FSGetFileBlock		fs_getfileblock;	/* FSGetFileBlock function */
 	FSGetUUID		fs_getuuid;		/* FSGetUUID function */
+	FSGetFileInfo		fs_getfileinfo;		/* FSGetFileInfo function (optional) */
 	unsigned int		bps;			/* bytes per sector for this device */
 	char			name[BVSTRLEN];		/* (name of partition) */
 	char			type_name[BVSTRLEN];	/* (type of partition, eg. Apple_HFS) */
@@ -62,6 +62,7 @@
 #include "xml.h"
 #include "sl.h"
 
+#include <mach-o/fat.h>
 #include <libkern/crypto/md5.h>
 //#include <uuid/uuid.h>
 
@@ -272,6 +273,83 @@ long LoadThinFatFile(const char *fileSpec, void **binary)
 	return length;
 }
 
+//==========================================================================
+// LoadThinFatFileAt
+// Like LoadThinFatFile(), but reads the file (only its i386 part if it is
+// fat) straight to base instead of the load buffer. Fails when the file
+// does not fit in maxLength bytes or the filesystem can't read at an offset.
+
+long LoadThinFatFileAt(const char *fileSpec, void *base, unsigned long maxLength)
+{
+	const char	*filePath = "";
+	FSReadFile	readFile;
+	BVRef		bvr;
+	void		*binary;
+	unsigned long	length;
+	unsigned long	length2;
+	unsigned long	first;
+
+	if ((bvr = getBootVolumeRef(fileSpec, &filePath)) == NULL)
+	{
+		return -1;
+	}
+
+	readFile = bvr->fs_readfile;
+
+	if (readFile == NULL)
+	{
+		return -1;
+	}
+
+	first = (maxLength < 0x1000) ? maxLength : 0x1000;
+
+	// Read the first 4096 bytes (fat header)
+	length = readFile(bvr, (char *)filePath, base, 0, first);
+
+	if (length == -1)
+	{
+		return -1;
+	}
+
+	binary = base;
+
+	if ((length >= sizeof(struct fat_header)) && (ThinFatFile(&binary, &length2) == 0) && (length2 != 0))
+	{
+		// Read only the thin part, over the fat header.
+		if (length2 > maxLength)
+		{
+			return -1;
+		}
+
+		return readFile(bvr, (char *)filePath, base, (unsigned long)binary - (unsigned long)base, length2);
+	}
+
+	if (length == first)
+	{
+		// Read the rest of the file; filling the whole range means it did not fit.
+		if (length == maxLength)
+		{
+			return -1;
+		}
+
+		length2 = readFile(bvr, (char *)filePath, (char *)base + length, length, maxLength - length);
+
+		if (length2 == -1)
+		{
+			return -1;
+		}
+
+		length += length2;
+
+		if (length == maxLength)
+		{
+			return -1;
+		}
+	}
+
+	return length;
+}
+
 //==========================================================================
 
 #if UNUSED
@@ -395,51 +473,114 @@ long GetDirEntry(const char * dirSpec, long long * dirIndex, const char ** name,
 }
 
 //==========================================================================
-// GetFileInfo - LOW-LEVEL FILESYSTEM FUNCTION.
-// Get attributes for the specified file.
+// GetDirEntries - LOW-LEVEL FILESYSTEM FUNCTION.
+// Fetch up to maxEntries directory entries in one call. The volume is
+// resolved once per batch and each name is copied into the caller's
+// record, so entries stay valid while other file operations run.
+// Returns the number of records filled, 0 at the end of the directory
+// or -1 if the volume cannot be resolved.
+
+long GetDirEntries(const char *dirSpec, long long *dirIndex, FSDirEntry *entries, long maxEntries)
+{
+	const char	*dirPath;
+	char		*name;
+	BVRef		bvr;
+	long		count;
+
+	// Resolve the boot volume from the dir spec.
+
+	if ((bvr = getBootVolumeRef(dirSpec, &dirPath)) == NULL)
+	{
+		return -1;
+	}
+
+	if (!bvr->fs_getdirentry)
+	{
+		return -1;
+	}
+
+	for (count = 0; count < maxEntries; count++)
+	{
+		entries[count].infoValid = 0;
+
+		if (bvr->fs_getdirentry( bvr,
+			/* dirPath */   (char *)dirPath,
+			/* dirIndex */  dirIndex,
+			/* dirEntry */  &name,
+			&entries[count].flags,
+			&entries[count].time,
+			&entries[count].finderInfo,
+			&entries[count].infoValid ) != 0)
+		{
+			break;
+		}
+
+		strlcpy(entries[count].name, name, kDirEntryNameLen);
+	}
+
+	return count;
+}
+
+//==========================================================================
+// GetVolumeFileInfo - LOW-LEVEL FILESYSTEM FUNCTION.
+// Get attributes for the specified file on the specified volume.
+// Uses the filesystem's direct lookup when it has one, otherwise
+// searches the parent directory.
 
 static char *gMakeDirSpec;
 
-long GetFileInfo(const char *dirSpec, const char *name, long *flags, u_int32_t *time)
+long GetVolumeFileInfo(BVRef bvr, const char *filePath, long *flags, u_int32_t *time)
 {
-	long long index = 0;
-	const char *entryName;
+	long long	index = 0;
+	char		*name;
+	char		*entryName;
+	long		len;
 
 	if (gMakeDirSpec == 0)
 	{
 		gMakeDirSpec = (char *)malloc(1024);
 	}
 
-	if (!dirSpec)
+	len = strlen(filePath);
+
+	if (len >= 1024)
 	{
-		long	idx;
-		long	len;
-		len = strlen(name);
+		return -1;
+	}
 
-		for (idx = len; idx && (name[idx] != '/' && name[idx] != '\\'); idx--) {}
+	// The filesystem may modify the path while walking it.
+	strlcpy(gMakeDirSpec, filePath, 1024);
 
-		if (idx == 0)
-		{
-			if(name[idx] == '/' || name[idx] == '\\')
-			{
-				++name;   // todo: ensure other functions handel \ properly
-			}
-			gMakeDirSpec[0] = '/';
-			gMakeDirSpec[1] = '\0';
-			gMakeDirSpec[idx] = '\0';
-		}
-		else
-		{
-			idx++;
-			strncpy(gMakeDirSpec, name, idx);
-			gMakeDirSpec[idx] = '\0'; // ISSUE: http://forge.voodooprojects.org/p/chameleon/issues/270/
-			name += idx;
-		}
+	if (bvr->fs_getfileinfo)
+	{
+		return bvr->fs_getfileinfo(bvr, gMakeDirSpec, flags, time);
+	}
 
-		dirSpec = gMakeDirSpec;
+	if (!bvr->fs_getdirentry)
+	{
+		return -1;
 	}
 
-	while (GetDirEntry(dirSpec, &index, &entryName, flags, time) == 0)
+	// Split off the last component and scan its directory.
+	for (name = gMakeDirSpec + len; name > gMakeDirSpec && name[-1] != '/'; name--) {}
+
+	if (name == gMakeDirSpec)
+	{
+		name = (char *)filePath;
+		gMakeDirSpec[0] = '\0';
+	}
+	else if (name == gMakeDirSpec + 1)
+	{
+		// Entry in the root directory; keep the '/' for the directory path.
+		name = (char *)filePath + 1;
+		gMakeDirSpec[1] = '\0';
+	}
+	else
+	{
+		name[-1] = '\0';
+	}
+
+	while (bvr->fs_getdirentry(bvr, gMakeDirSpec, &index, &entryName, flags, time, 0, 0) == 0)
 	{
 		if (strcmp(entryName, name) == 0)
 		{
@@ -450,6 +591,36 @@ long GetFileInfo(const char *dirSpec, const char *name, long *flags, u_int32_t *
 	return -1;  // file not found
 }
 
+//==========================================================================
+// GetFileInfo - LOW-LEVEL FILESYSTEM FUNCTION.
+// Get attributes for the specified file.
+
+long GetFileInfo(const char *dirSpec, const char *name, long *flags, u_int32_t *time)
+{
+	const char	*filePath;
+	BVRef		bvr;
+	char		fileSpec[1024];
+
+	if (dirSpec)
+	{
+		snprintf(fileSpec, sizeof(fileSpec), "%s%s%s", dirSpec,
+			(dirSpec[0] && dirSpec[strlen(dirSpec) - 1] != '/') ? "/" : "", name);
+	}
+	else
+	{
+		strlcpy(fileSpec, name, sizeof(fileSpec));
+	}
+
+	// Resolve the boot volume from the file spec.
+
+	if ((bvr = getBootVolumeRef(fileSpec, &filePath)) == NULL)
+	{
+		return -1;
+	}
+
+	return GetVolumeFileInfo(bvr, filePath, flags, time);
+}
+
 //==============================================================================
 
 long GetFileBlock(const char *fileSpec, unsigned long long *firstBlock)
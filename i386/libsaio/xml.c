@@ -149,6 +149,19 @@ enum {
 
 #define DOFREE 1
 
+//==========================================================================
+// Symbol object.
+// Symbols are interned: each distinct string is stored once and looked up
+// through a hash table, so keys can be compared by pointer.
+struct Symbol
+{
+	long          refCount;
+	struct Symbol *next;
+	unsigned long hash;
+	char          string[];
+};
+typedef struct Symbol Symbol, *SymbolPtr;
+
 static long ParseTagList(char *buffer, TagPtr *tag, long type, long empty);
 static long ParseTagKey(char *buffer, TagPtr *tag);
 static long ParseTagString(char *buffer, TagPtr *tag);
@@ -160,6 +173,8 @@ static long GetNextTag(char *buffer, char **tag, long *start);
 static long FixDataMatchingTag(char *buffer, char *tag);
 static TagPtr NewTag(void);
 static char *NewSymbol(char *string);
+static unsigned long HashSymbol(const char *string);
+static SymbolPtr FindSymbol(const char *string, unsigned long hash, SymbolPtr *prevSymbol);
 #if DOFREE
 static void FreeSymbol(char *string);
 #endif
@@ -169,12 +184,21 @@ static void FreeSymbol(char *string);
 TagPtr XMLGetProperty(TagPtr dict, const char *key)
 {
 	TagPtr tagList, tag;
+	SymbolPtr symbol;
 
 	if (dict->type != kTagTypeDict)
 	{
 		return NULL;
 	}
 
+	// Keys are interned, so a key that was never interned is not in any dict
+	// and the ones that were can be matched by pointer.
+	symbol = FindSymbol(key, HashSymbol(key), 0);
+	if (symbol == NULL)
+	{
+		return NULL;
+	}
+
 	tag = 0;
 	tagList = dict->tag;
 	while (tagList) {
@@ -186,7 +210,7 @@ TagPtr XMLGetProperty(TagPtr dict, const char *key)
 			continue;
 		}
 
-		if (!strcmp(tag->string, key))
+		if (tag->string == symbol->string)
 		{
 			return tag->tag;
 		}
@@ -1146,29 +1170,49 @@ void XMLFreeTag( TagPtr tag )
 }
 
 //==========================================================================
-// Symbol object.
-struct Symbol
+// Symbol table.
+
+#define kSymbolHashSize (4096)	// must be a power of 2
+
+static SymbolPtr *gSymbolHash	= NULL;
+
+//==========================================================================
+// HashSymbol
+// FNV-1a over the string.
+static unsigned long HashSymbol( const char *string )
 {
-	long          refCount;
-	struct Symbol *next;
-	char          string[];
-};
-typedef struct Symbol Symbol, *SymbolPtr;
+	unsigned long hash = 2166136261UL;
 
-static SymbolPtr FindSymbol(char *string, SymbolPtr *prevSymbol);
+	while (*string)
+	{
+		hash ^= (unsigned char)*string++;
+		hash *= 16777619UL;
+	}
 
-static SymbolPtr gSymbolsHead	= NULL;
+	return hash;
+}
 
 //==========================================================================
 // NewSymbol
 static char *NewSymbol( char *string )
 {
-	static SymbolPtr lastGuy = 0;
-
 	SymbolPtr	symbol;
+	unsigned long	hash;
+
+	if (gSymbolHash == NULL)
+	{
+		gSymbolHash = (SymbolPtr *)malloc(kSymbolHashSize * sizeof(SymbolPtr));
+		if (gSymbolHash == NULL)
+		{
+			stop("NULL symbol table!");
+			return NULL;
+		}
+		bzero(gSymbolHash, kSymbolHashSize * sizeof(SymbolPtr));
+	}
 
-	// Look for string in the list of symbols.
-	symbol = FindSymbol(string, 0);
+	// Look for string in the table of symbols.
+	hash = HashSymbol(string);
+	symbol = FindSymbol(string, hash, 0);
 
 	// Add the new symbol.
 	if (symbol == NULL)
@@ -1182,21 +1226,17 @@ static char *NewSymbol( char *string )
 
 		// Set the symbol's data.
 		symbol->refCount = 0;
+		symbol->hash = hash;
 		strcpy(symbol->string, string);
 
-		// Add the symbol to the list.
-		symbol->next = gSymbolsHead;
-		gSymbolsHead = symbol;
+		// Add the symbol to its bucket.
+		symbol->next = gSymbolHash[hash & (kSymbolHashSize - 1)];
+		gSymbolHash[hash & (kSymbolHashSize - 1)] = symbol;
 	}
 
 	// Update the refCount and return the string.
 	symbol->refCount++;
 
-	if (lastGuy && lastGuy->next != 0)
-	{
-		stop("last guy not last!");
-	}
-
 	return symbol->string;
 }
 
@@ -1206,11 +1246,15 @@ static char *NewSymbol( char *string )
 static void FreeSymbol( char *string )
 {
 	SymbolPtr symbol, prev;
+	unsigned long hash;
 	prev = NULL;
 
-	// Look for string in the list of symbols.
-	symbol = FindSymbol(string, &prev);
-	if (symbol == NULL)
+	// Look for string in the table of symbols.
+	hash = HashSymbol(string);
+	symbol = FindSymbol(string, hash, &prev);
+
+	// Strings that were not interned (IDREF strings) have nothing to release.
+	if ((symbol == NULL) || (symbol->string != string))
 	{
 		return;
 	}
@@ -1223,14 +1267,14 @@ static void FreeSymbol( char *string )
 		return;
 	}
 
-	// Remove the symbol from the list.
+	// Remove the symbol from its bucket.
 	if (prev != NULL)
 	{
 		prev->next = symbol->next;
 	}
 	else
 	{
-		gSymbolsHead = symbol->next;
+		gSymbolHash[hash & (kSymbolHashSize - 1)] = symbol->next;
 	}
 
 	// Free the symbol's memory.
@@ -1240,29 +1284,29 @@ static void FreeSymbol( char *string )
 
 //==========================================================================
 // FindSymbol
-static SymbolPtr FindSymbol( char *string, SymbolPtr *prevSymbol )
+static SymbolPtr FindSymbol( const char *string, unsigned long hash, SymbolPtr *prevSymbol )
 {
 	SymbolPtr symbol, prev;
 
-	if (string == NULL)
+	if ((string == NULL) || (gSymbolHash == NULL))
 	{
 		return NULL;
 	}
 
-	symbol = gSymbolsHead;
+	symbol = gSymbolHash[hash & (kSymbolHashSize - 1)];
 	prev = NULL;
-  
+
 	while (symbol != NULL)
 	{
-		if (!strcmp(symbol->string, string))
+		if ((symbol->hash == hash) && !strcmp(symbol->string, string))
 		{
 			break;
 		}
-    
+
 		prev = symbol;
 		symbol = symbol->next;
 	}
-  
+
 	if ((symbol != NULL) && (prevSymbol != NULL))
 	{
 		*prevSymbol = prev;
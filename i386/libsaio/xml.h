@@ -67,6 +67,8 @@ extern string_ref *ref_strings;
 
 #define kPropCFBundleIdentifier		("CFBundleIdentifier")
 #define kPropCFBundleExecutable		("CFBundleExecutable")
+#define kPropCFBundleVersion		("CFBundleVersion")
+#define kPropOSBundleCompatibleVersion	("OSBundleCompatibleVersion")
 #define kPropOSBundleRequired		("OSBundleRequired")
 #define kPropOSBundleLibraries		("OSBundleLibraries")
 #define kPropIOKitPersonalities		("IOKitPersonalities")
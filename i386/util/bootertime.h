@@ -0,0 +1,45 @@
+/*
+ * bootertime.h - File modification times as the booter sees them.
+ *
+ * The booter compares the times recorded by kextindex and themepack with
+ * the ones its file system drivers return. HFS+ returns seconds since 1970
+ * like stat() does. FAT and exFAT store a local wall clock time without a
+ * time zone, which the booter converts as if it were UTC, so on those
+ * volumes the time is written the same way. Run the tools in the time zone
+ * the files were written in. FAT times only have a 2 second granularity.
+ */
+
+#ifndef __UTIL_BOOTERTIME_H
+#define __UTIL_BOOTERTIME_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+
+static uint32_t booterTime(const char *path, const struct stat *st)
+{
+	struct statfs	fs;
+	struct tm	tm;
+	time_t		t = st->st_mtime;
+
+	if (statfs(path, &fs) == 0)
+	{
+		if (!strcmp(fs.f_fstypename, "msdos") || !strcmp(fs.f_fstypename, "exfat"))
+		{
+			localtime_r(&t, &tm);
+			t = timegm(&tm);
+		}
+
+		if (!strcmp(fs.f_fstypename, "msdos"))
+		{
+			t &= ~(time_t)1;
+		}
+	}
+
+	return (uint32_t)t;
+}
+
+#endif /* !__UTIL_BOOTERTIME_H */
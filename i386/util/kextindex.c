@@ -0,0 +1,396 @@
+/*
+ * Kext Index Tool, part of the Chameleon Boot Loader Project
+ *
+ * Writes Extensions.kextindex (see boot2/kextindex.h) next to an Extensions
+ * folder, so the booter can load the kexts of that folder with one read
+ * instead of walking it. Run it again after adding, removing or changing
+ * a kext; the booter ignores the index once the folder, a PlugIns folder
+ * or an Info.plist in it has changed.
+ *
+ * usage: kextindex /Extra/Extensions
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <sys/stat.h>
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "../boot2/kextindex.h"
+#include "bootertime.h"
+
+typedef struct Buffer {
+	char		*data;
+	size_t		length;
+	size_t		size;
+} Buffer;
+
+static uint32_t gNumBundles;
+static uint32_t gNumTopLevel;
+
+//==========================================================================
+
+static void append(Buffer *buf, const void *data, size_t length)
+{
+	if (buf->length + length > buf->size)
+	{
+		buf->size = (buf->length + length) * 2;
+		buf->data = realloc(buf->data, buf->size);
+
+		if (!buf->data)
+		{
+			fprintf(stderr, "kextindex: out of memory\n");
+			exit(1);
+		}
+	}
+
+	if (data)
+	{
+		memcpy(buf->data + buf->length, data, length);
+	}
+	else
+	{
+		memset(buf->data + buf->length, 0, length);
+	}
+
+	buf->length += length;
+}
+
+//==========================================================================
+
+static void appendString(Buffer *buf, const char *string, size_t *length)
+{
+	*length = strlen(string);
+	append(buf, string, *length + 1);
+}
+
+//==========================================================================
+// Copy a string property of the plist, or "" when it is missing.
+
+static void getString(CFDictionaryRef dict, CFStringRef key, char *string, size_t size)
+{
+	CFTypeRef value = CFDictionaryGetValue(dict, key);
+
+	string[0] = '\0';
+
+	if (value && CFGetTypeID(value) == CFStringGetTypeID())
+	{
+		CFStringGetCString(value, string, size, kCFStringEncodingUTF8);
+	}
+}
+
+//==========================================================================
+
+static int compareNames(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+//==========================================================================
+// Return the .kext folders of dirPath sorted in strcmp order.
+
+static char **listKexts(const char *dirPath, int *count)
+{
+	DIR		*dir;
+	struct dirent	*entry;
+	char		**names = NULL;
+	size_t		length;
+	int		n = 0;
+
+	*count = 0;
+
+	if ((dir = opendir(dirPath)) == NULL)
+	{
+		return NULL;
+	}
+
+	while ((entry = readdir(dir)) != NULL)
+	{
+		length = strlen(entry->d_name);
+
+		if (length < 5 || strcmp(entry->d_name + length - 5, ".kext"))
+		{
+			continue;
+		}
+
+		names = realloc(names, (n + 1) * sizeof(char *));
+		names[n++] = strdup(entry->d_name);
+	}
+
+	closedir(dir);
+
+	if (n)
+	{
+		qsort(names, n, sizeof(char *), compareNames);
+	}
+
+	*count = n;
+
+	return names;
+}
+
+//==========================================================================
+// Append the record of dirPath/name; parent is the folder holding it,
+// relative to the Extensions folder. Returns 0 if the bundle was indexed.
+
+static int addBundle(Buffer *buf, const char *dirPath, const char *parent, const char *name, int plugin)
+{
+	char		path[1024], string[1024];
+	struct stat	st;
+	KextIndexRecord	record;
+	size_t		start, length;
+	FILE		*file;
+	char		*plist;
+	long		plistLength;
+	CFDataRef	data;
+	CFPropertyListRef dict;
+	CFTypeRef	libraries;
+
+	snprintf(path, sizeof(path), "%s/%s", dirPath, name);
+
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+	{
+		return -1;
+	}
+
+	memset(&record, 0, sizeof(record));
+	record.dirTime = booterTime(path, &st);
+
+	snprintf(path, sizeof(path), "%s/%s/Contents", dirPath, name);
+
+	if (stat(path, &st) == 0)
+	{
+		record.flags |= kKextIndexFlagContents;
+	}
+
+	if (plugin)
+	{
+		record.flags |= kKextIndexFlagPlugIn;
+	}
+	else
+	{
+		// Adding or removing a plug-in only touches the PlugIns folder.
+		snprintf(path, sizeof(path), "%s/%s/%sPlugIns", dirPath, name, (record.flags & kKextIndexFlagContents) ? "Contents/" : "");
+
+		if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+		{
+			record.flags |= kKextIndexFlagPlugIns;
+			record.plugInsTime = booterTime(path, &st);
+		}
+	}
+
+	snprintf(path, sizeof(path), "%s/%s/%sInfo.plist", dirPath, name, (record.flags & kKextIndexFlagContents) ? "Contents/" : "");
+
+	if (stat(path, &st) != 0 || (file = fopen(path, "rb")) == NULL)
+	{
+		return -1;
+	}
+
+	record.plistTime = booterTime(path, &st);
+
+	fseek(file, 0, SEEK_END);
+	plistLength = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	plist = malloc(plistLength);
+	if (!plist || fread(plist, 1, plistLength, file) != (size_t)plistLength)
+	{
+		fprintf(stderr, "kextindex: can't read %s\n", path);
+		fclose(file);
+		free(plist);
+		return -1;
+	}
+
+	fclose(file);
+
+	data = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, (const UInt8 *)plist, plistLength, kCFAllocatorNull);
+	// CFPropertyListCreateWithData() needs 10.6; util targets 10.5.
+	dict = CFPropertyListCreateFromXMLData(kCFAllocatorDefault, data, kCFPropertyListImmutable, NULL);
+	CFRelease(data);
+
+	if (!dict || CFGetTypeID(dict) != CFDictionaryGetTypeID())
+	{
+		fprintf(stderr, "kextindex: can't parse %s\n", path);
+		if (dict)
+		{
+			CFRelease(dict);
+		}
+		free(plist);
+		return -1;
+	}
+
+	start = buf->length;
+	append(buf, NULL, sizeof(record));
+
+	appendString(buf, parent, &length);
+	record.parentLength = length;
+
+	appendString(buf, name, &length);
+	record.nameLength = length;
+
+	getString(dict, CFSTR("CFBundleIdentifier"), string, sizeof(string));
+	appendString(buf, string, &length);
+	record.identifierLength = length;
+
+	getString(dict, CFSTR("CFBundleExecutable"), string, sizeof(string));
+	appendString(buf, string, &length);
+	record.executableLength = length;
+
+	getString(dict, CFSTR("OSBundleRequired"), string, sizeof(string));
+	appendString(buf, string, &length);
+	record.requiredLength = length;
+
+	// OSBundleLibraries as identifier/version pairs.
+	length = buf->length;
+	libraries = CFDictionaryGetValue(dict, CFSTR("OSBundleLibraries"));
+
+	if (libraries && CFGetTypeID(libraries) == CFDictionaryGetTypeID())
+	{
+		CFIndex		i, count = CFDictionaryGetCount(libraries);
+		const void	**keys = malloc(count * sizeof(void *));
+		const void	**values = malloc(count * sizeof(void *));
+		size_t		unused;
+
+		CFDictionaryGetKeysAndValues(libraries, keys, values);
+
+		for (i = 0; i < count; i++)
+		{
+			if (CFGetTypeID(keys[i]) != CFStringGetTypeID() || CFGetTypeID(values[i]) != CFStringGetTypeID())
+			{
+				continue;
+			}
+
+			CFStringGetCString(keys[i], string, sizeof(string), kCFStringEncodingUTF8);
+			appendString(buf, string, &unused);
+			CFStringGetCString(values[i], string, sizeof(string), kCFStringEncodingUTF8);
+			appendString(buf, string, &unused);
+		}
+
+		free(keys);
+		free(values);
+	}
+
+	append(buf, "", 1);
+	record.librariesLength = buf->length - length;
+
+	append(buf, plist, plistLength);
+	record.plistLength = plistLength;
+
+	append(buf, NULL, (4 - (buf->length & 3)) & 3);
+	record.recordLength = buf->length - start;
+
+	memcpy(buf->data + start, &record, sizeof(record));
+
+	CFRelease(dict);
+	free(plist);
+
+	gNumBundles++;
+
+	if (!plugin)
+	{
+		gNumTopLevel++;
+	}
+
+	return 0;
+}
+
+//==========================================================================
+
+int main(int argc, char *argv[])
+{
+	KextIndexHeader	header;
+	Buffer		buf = { NULL, 0, 0 };
+	struct stat	st;
+	char		extensions[1024], parent[1024], plugIns[1024], output[1024];
+	char		**names, **plugInNames;
+	int		count, plugInCount, i, j;
+	FILE		*file;
+
+	if (argc != 2)
+	{
+		fprintf(stderr, "usage: %s <Extensions folder>\n", argv[0]);
+		return 1;
+	}
+
+	strlcpy(extensions, argv[1], sizeof(extensions));
+
+	while (strlen(extensions) > 1 && extensions[strlen(extensions) - 1] == '/')
+	{
+		extensions[strlen(extensions) - 1] = '\0';
+	}
+
+	if (stat(extensions, &st) != 0 || !S_ISDIR(st.st_mode))
+	{
+		fprintf(stderr, "kextindex: %s is not a folder\n", extensions);
+		return 1;
+	}
+
+	// Taken first, so a kext added while indexing makes the index stale.
+	memset(&header, 0, sizeof(header));
+	header.dirTime = booterTime(extensions, &st);
+
+	strlcpy(parent, extensions, sizeof(parent));
+	snprintf(output, sizeof(output), "%s/%s", dirname(parent), kKextIndexFileName);
+
+	append(&buf, NULL, sizeof(header));
+
+	names = listKexts(extensions, &count);
+
+	for (i = 0; i < count; i++)
+	{
+		if (addBundle(&buf, extensions, "", names[i], 0) != 0)
+		{
+			// The booter will find the index stale and scan the folder.
+			fprintf(stderr, "kextindex: skipping %s\n", names[i]);
+			free(names[i]);
+			continue;
+		}
+
+		// The booter only looks one level down, in the PlugIns folder.
+		snprintf(plugIns, sizeof(plugIns), "%s/%s/Contents", extensions, names[i]);
+		snprintf(parent, sizeof(parent), "%s/%sPlugIns", names[i], (stat(plugIns, &st) == 0) ? "Contents/" : "");
+		snprintf(plugIns, sizeof(plugIns), "%s/%s", extensions, parent);
+
+		plugInNames = listKexts(plugIns, &plugInCount);
+
+		for (j = 0; j < plugInCount; j++)
+		{
+			if (addBundle(&buf, plugIns, parent, plugInNames[j], 1) != 0)
+			{
+				fprintf(stderr, "kextindex: skipping %s/%s\n", parent, plugInNames[j]);
+			}
+
+			free(plugInNames[j]);
+		}
+
+		free(plugInNames);
+		free(names[i]);
+	}
+
+	free(names);
+
+	header.magic = kKextIndexMagic;
+	header.version = kKextIndexVersion;
+	header.length = buf.length;
+	header.numBundles = gNumBundles;
+	header.numTopLevel = gNumTopLevel;
+	memcpy(buf.data, &header, sizeof(header));
+
+	if ((file = fopen(output, "wb")) == NULL || fwrite(buf.data, 1, buf.length, file) != buf.length)
+	{
+		fprintf(stderr, "kextindex: can't write %s\n", output);
+		return 1;
+	}
+
+	fclose(file);
+
+	printf("%s: %u kexts (%u top level), %lu bytes\n", output, gNumBundles, gNumTopLevel, (unsigned long)buf.length);
+
+	free(buf.data);
+
+	return 0;
+}
@@ -0,0 +1,345 @@
+/*
+ * Theme Pack Tool, part of the Chameleon Boot Loader Project
+ *
+ * Writes theme.pack (see boot2/themepack.h) into a theme folder, so the
+ * booter can load every image of the theme with one read instead of
+ * decoding the PNG files one by one. Run it again after changing the
+ * theme; the booter ignores the pack once theme.plist or a PNG file has
+ * changed.
+ *
+ * usage: themepack /Extra/Themes/Default
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "../boot2/themepack.h"
+#include "bootertime.h"
+
+/*
+ * The PNG files are decoded by the booter's own picopng.c, so the pack holds
+ * exactly the pixels the booter would have made from them. All picopng.c
+ * needs from libsa is its arena; libsa.h is skipped and the arena is the C
+ * library's heap here. Nothing is freed before the tool exits.
+ */
+#define __BOOT_LIBSA_H
+
+struct arena {
+	const char	*name;
+	size_t		chunkSize;
+};
+
+#define ARENA_INITIALIZER(name, chunkSize)	{ name, chunkSize }
+
+static void *arena_alloc(struct arena *a, size_t size)
+{
+	return malloc(size);
+}
+
+static void *arena_realloc(struct arena *a, void *ptr, size_t size)
+{
+	return realloc(ptr, size);
+}
+
+static void arena_free(struct arena *a, void *ptr)
+{
+	free(ptr);
+}
+
+static void arena_reset(struct arena *a)
+{
+}
+
+#include "../boot2/picopng.c"
+
+typedef struct Buffer {
+	char		*data;
+	size_t		length;
+	size_t		size;
+} Buffer;
+
+//==========================================================================
+
+static void append(Buffer *buf, const void *data, size_t length)
+{
+	if (buf->length + length > buf->size)
+	{
+		buf->size = (buf->length + length) * 2;
+		buf->data = realloc(buf->data, buf->size);
+
+		if (!buf->data)
+		{
+			fprintf(stderr, "themepack: out of memory\n");
+			exit(1);
+		}
+	}
+
+	if (data)
+	{
+		memcpy(buf->data + buf->length, data, length);
+	}
+	else
+	{
+		memset(buf->data + buf->length, 0, length);
+	}
+
+	buf->length += length;
+}
+
+//==========================================================================
+// Read a whole file; returns NULL if it can't be read.
+
+static char *readFile(const char *path, long *length)
+{
+	FILE	*file;
+	char	*data;
+
+	if ((file = fopen(path, "rb")) == NULL)
+	{
+		return NULL;
+	}
+
+	fseek(file, 0, SEEK_END);
+	*length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	data = malloc(*length + 1);
+	if (data && fread(data, 1, *length, file) != (size_t)*length)
+	{
+		free(data);
+		data = NULL;
+	}
+
+	fclose(file);
+
+	return data;
+}
+
+//==========================================================================
+// getThemePackImage() in gui.c binary-searches the records by the name
+// without .png, so this order and that search must stay the same.
+
+static int compareNames(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+//==========================================================================
+// Return the names of the PNG files of dirPath, without .png, sorted in
+// strcmp order.
+
+static char **listImages(const char *dirPath, int *count)
+{
+	DIR		*dir;
+	struct dirent	*entry;
+	char		**names = NULL;
+	size_t		length;
+	int		n = 0;
+
+	*count = 0;
+
+	if ((dir = opendir(dirPath)) == NULL)
+	{
+		return NULL;
+	}
+
+	while ((entry = readdir(dir)) != NULL)
+	{
+		length = strlen(entry->d_name);
+
+		if (length < 5 || strcmp(entry->d_name + length - 4, ".png"))
+		{
+			continue;
+		}
+
+		names = realloc(names, (n + 1) * sizeof(char *));
+		names[n] = strdup(entry->d_name);
+		names[n++][length - 4] = '\0';
+	}
+
+	closedir(dir);
+
+	if (n)
+	{
+		qsort(names, n, sizeof(char *), compareNames);
+	}
+
+	*count = n;
+
+	return names;
+}
+
+//==========================================================================
+// Decode dirPath/name.png into pixels, as loadPngImage() and flipRB() do in
+// the booter, and fill in record. Returns 0 on success.
+
+static int addImage(Buffer *pixels, ThemePackImage *record, const char *dirPath, const char *name)
+{
+	char		path[1024];
+	struct stat	st;
+	PNG_info_t	*info;
+	uint8_t		*p, *end, red;
+	char		*png;
+	long		pngLength;
+	size_t		length = strlen(name);
+
+	if (length >= kThemePackNameLen)
+	{
+		fprintf(stderr, "themepack: the name of %s.png is too long\n", name);
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s.png", dirPath, name);
+
+	if (stat(path, &st) != 0 || (png = readFile(path, &pngLength)) == NULL)
+	{
+		fprintf(stderr, "themepack: can't read %s\n", path);
+		return -1;
+	}
+
+	PNG_error = -1;
+	info = PNG_decode((const uint8_t *)png, pngLength);
+
+	if (PNG_error != 0 || info->width > 0xffff || info->height > 0xffff
+		|| info->width * info->height * 4 != info->image->size)
+	{
+		fprintf(stderr, "themepack: can't decode %s (error %d)\n", path, PNG_error);
+		free(png);
+		return -1;
+	}
+
+	memset(record, 0, sizeof(*record));
+	memcpy(record->name, name, length);
+	record->time = booterTime(path, &st);
+	record->width = info->width;
+	record->height = info->height;
+
+	// Each image starts on a 16 byte boundary.
+	append(pixels, NULL, (16 - (pixels->length & 15)) & 15);
+	record->offset = pixels->length;
+	append(pixels, info->image->data, info->image->size);
+
+	// RGBA to the booter's BGRA.
+	end = (uint8_t *)pixels->data + pixels->length;
+	for (p = (uint8_t *)pixels->data + record->offset; p < end; p += 4)
+	{
+		red = p[0];
+		p[0] = p[2];
+		p[2] = red;
+	}
+
+	png_alloc_free_all();
+	free(png);
+
+	return 0;
+}
+
+//==========================================================================
+
+int main(int argc, char *argv[])
+{
+	ThemePackHeader	header;
+	ThemePackImage	*records;
+	Buffer		buf = { NULL, 0, 0 }, pixels = { NULL, 0, 0 };
+	struct stat	st;
+	char		theme[1024], path[1024], output[1024];
+	char		**names, *plist;
+	long		plistLength;
+	size_t		base;
+	int		count, i;
+	FILE		*file;
+
+	if (argc != 2)
+	{
+		fprintf(stderr, "usage: %s <theme folder>\n", argv[0]);
+		return 1;
+	}
+
+	strlcpy(theme, argv[1], sizeof(theme));
+
+	while (strlen(theme) > 1 && theme[strlen(theme) - 1] == '/')
+	{
+		theme[strlen(theme) - 1] = '\0';
+	}
+
+	if (stat(theme, &st) != 0 || !S_ISDIR(st.st_mode))
+	{
+		fprintf(stderr, "themepack: %s is not a folder\n", theme);
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "%s/theme.plist", theme);
+
+	if (stat(path, &st) != 0 || (plist = readFile(path, &plistLength)) == NULL)
+	{
+		fprintf(stderr, "themepack: can't read %s\n", path);
+		return 1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.plistTime = booterTime(path, &st);
+
+	names = listImages(theme, &count);
+	records = calloc(count ? count : 1, sizeof(ThemePackImage));
+
+	// A pack without one of the images would never be current, so any
+	// image that can't be packed stops the tool.
+	for (i = 0; i < count; i++)
+	{
+		if (addImage(&pixels, &records[i], theme, names[i]) != 0)
+		{
+			return 1;
+		}
+
+		free(names[i]);
+	}
+
+	free(names);
+
+	header.numImages = count;
+	header.plistOffset = sizeof(header) + count * sizeof(ThemePackImage);
+	header.plistLength = plistLength;
+
+	base = header.plistOffset + plistLength + 1;
+	base = (base + 15) & ~15;
+
+	for (i = 0; i < count; i++)
+	{
+		records[i].offset += base;
+	}
+
+	append(&buf, NULL, sizeof(header));
+	append(&buf, records, count * sizeof(ThemePackImage));
+	append(&buf, plist, plistLength);
+	append(&buf, NULL, base - buf.length);
+	append(&buf, pixels.data, pixels.length);
+
+	header.magic = kThemePackMagic;
+	header.version = kThemePackVersion;
+	header.length = buf.length;
+	memcpy(buf.data, &header, sizeof(header));
+
+	snprintf(output, sizeof(output), "%s/%s", theme, kThemePackFileName);
+
+	if ((file = fopen(output, "wb")) == NULL || fwrite(buf.data, 1, buf.length, file) != buf.length)
+	{
+		fprintf(stderr, "themepack: can't write %s\n", output);
+		return 1;
+	}
+
+	fclose(file);
+
+	printf("%s: %d images, %lu bytes\n", output, count, (unsigned long)buf.length);
+
+	free(buf.data);
+	free(pixels.data);
+	free(records);
+	free(plist);
+
+	return 0;
+}